@@ -1,34 +1,501 @@
+#define _DEFAULT_SOURCE
 #include "libDisk.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
 
-int diskCounter = 1;
-Disk *diskListHead = NULL;
+/* One cached copy of a disk block. Frames are linked into an LRU list
+(most recently used at the head) and into a hash chain by block number. */
+typedef struct CacheFrame {
+    int bNum;
+    int dirty;
+    int prev;
+    int next;
+    int hashNext;
+    char *data;
+} CacheFrame;
+
+typedef struct BlockCache {
+    int nFrames;
+    int blockSize;
+    int nBuckets;
+    int lruHead;
+    int lruTail;
+    int *buckets;
+    CacheFrame *frames;
+    char *frameData;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks;
+} BlockCache;
+
+struct Disk {
+    int diskNumber;
+    int nBytes;
+    int blockSize;
+    char *filename;
+    int fd;
+    int flags;
+    char *map;
+    BlockCache *cache;
+    pthread_mutex_t lock;
+};
+
+/* Open disks live in a table indexed by slot. A disk number packs the slot
+into its low DISK_SLOT_BITS and the slot's generation above them, so a
+lookup is one array access, and a number kept after closeDisk no longer
+matches once its slot has been recycled. Free slots are chained through
+nextFree. */
+typedef struct DiskSlot {
+    int generation;
+    int nextFree;
+    Disk *disk;
+} DiskSlot;
+
+/* Slots come in chunks of DISK_CHUNK_SLOTS that never move once
+allocated, so lookups run without a lock: a slot's disk pointer is
+published with a release store after its generation is set. Claiming and
+releasing slots take diskTableLock. */
+#define DISK_CHUNK_BITS 8
+#define DISK_CHUNK_SLOTS (1 << DISK_CHUNK_BITS)
+static DiskSlot *diskChunks[MAX_DISKS / DISK_CHUNK_SLOTS];
+static int diskTableSize = 0;
+static int freeSlotHead = -1;
+static pthread_mutex_t diskTableLock = PTHREAD_MUTEX_INITIALIZER;
+
+static DiskSlot *diskSlot(int slot) {
+    return &diskChunks[slot >> DISK_CHUNK_BITS][slot & (DISK_CHUNK_SLOTS - 1)];
+}
+
+static Disk *findDisk(int disk) {
+    int slot = disk & DISK_SLOT_MASK;
+    int generation = disk >> DISK_SLOT_BITS;
+
+    Disk *found = NULL;
+    if (disk > 0 && slot < __atomic_load_n(&diskTableSize, __ATOMIC_ACQUIRE)) {
+        found = __atomic_load_n(&diskSlot(slot)->disk, __ATOMIC_ACQUIRE);
+    }
+    if (found == NULL) {
+        printf("The specified disk was not found. (LibDisk.c)\n");
+        return NULL;
+    }
+    if (__atomic_load_n(&diskSlot(slot)->generation, __ATOMIC_RELAXED) != generation) {
+        printf("The disk number is stale, that disk has been closed. (LibDisk.c)\n");
+        return NULL;
+    }
+    return found;
+}
+
+static int claimDiskSlot(Disk *disk) {
+    pthread_mutex_lock(&diskTableLock);
+    int slot = freeSlotHead;
+
+    if (slot == -1) {
+        if (diskTableSize == MAX_DISKS) {
+            printf("Too many disks are open. (LibDisk.c)\n");
+            pthread_mutex_unlock(&diskTableLock);
+            return -1;
+        }
+
+        DiskSlot *chunk = malloc(DISK_CHUNK_SLOTS * sizeof(DiskSlot));
+        if (chunk == NULL) {
+            printf("Failed to allocate memory for the disk table. (LibDisk.c)\n");
+            pthread_mutex_unlock(&diskTableLock);
+            return -1;
+        }
+        for (int i = 0; i < DISK_CHUNK_SLOTS; i++) {
+            chunk[i].generation = 1;
+            chunk[i].nextFree = (i + 1 < DISK_CHUNK_SLOTS) ? diskTableSize + i + 1 : -1;
+            chunk[i].disk = NULL;
+        }
+        diskChunks[diskTableSize >> DISK_CHUNK_BITS] = chunk;
+        slot = diskTableSize;
+        __atomic_store_n(&diskTableSize, diskTableSize + DISK_CHUNK_SLOTS, __ATOMIC_RELEASE);
+    }
+
+    DiskSlot *entry = diskSlot(slot);
+    freeSlotHead = entry->nextFree;
+    __atomic_store_n(&entry->disk, disk, __ATOMIC_RELEASE);
+    int diskNumber = (entry->generation << DISK_SLOT_BITS) | slot;
+    pthread_mutex_unlock(&diskTableLock);
+    return diskNumber;
+}
+
+static void releaseDiskSlot(int disk) {
+    int slot = disk & DISK_SLOT_MASK;
+
+    pthread_mutex_lock(&diskTableLock);
+    DiskSlot *entry = diskSlot(slot);
+    __atomic_store_n(&entry->disk, NULL, __ATOMIC_RELEASE);
+    // Generations stay positive so disk numbers never collide with error returns
+    int generation = entry->generation + 1;
+    __atomic_store_n(&entry->generation, (generation > DISK_MAX_GENERATION) ? 1 : generation, __ATOMIC_RELAXED);
+    entry->nextFree = freeSlotHead;
+    freeSlotHead = slot;
+    pthread_mutex_unlock(&diskTableLock);
+}
+
+/* I/O counters shared by every disk and thread. They are only ever
+added to, with relaxed atomics, since each transfer already costs a system
+call or a block copy. Building with TFS_NO_STATS removes the counting. */
+#ifndef TFS_NO_STATS
+static DiskIOStats ioStats;
+
+static uint64_t ioClock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Counts one system call that started at start */
+static void countCall(uint64_t start) {
+    __atomic_fetch_add(&ioStats.syscalls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&ioStats.syscallNanos, ioClock() - start, __ATOMIC_RELAXED);
+}
+
+static void countTransfer(int write, unsigned long nBlocks, unsigned long nBytes) {
+    __atomic_fetch_add(write ? &ioStats.blockWrites : &ioStats.blockReads, nBlocks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(write ? &ioStats.bytesWritten : &ioStats.bytesRead, nBytes, __ATOMIC_RELAXED);
+}
+#else
+#define ioClock() 0
+#define countCall(start) ((void)(start))
+#define countTransfer(write, nBlocks, nBytes) ((void)0)
+#endif
+
+/* Block I/O is positional: pread/pwrite at bNum times the block size
+never touch a shared file offset, so no seek is needed and calls on one
+disk cannot disturb each other. A run of nBlocks contiguous blocks moves
+in a single call; short transfers and EINTR are retried. */
+static int rawReadBlocks(Disk *disk, int bNum, int nBlocks, void *blocks) {
+    off_t offset = (off_t)bNum * disk->blockSize;
+    size_t length = (size_t)nBlocks * disk->blockSize;
+    size_t done = 0;
+
+    while (done < length) {
+        uint64_t start = ioClock();
+        ssize_t n = pread(disk->fd, (char *)blocks + done, length - done, offset + done);
+        countCall(start);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            printf("An error occurred while reading the block. (LibDisk.c)\n");
+            return -1;
+        }
+        done += n;
+    }
+    countTransfer(0, nBlocks, length);
+    return 0;
+}
+
+static int rawWriteBlocks(Disk *disk, int bNum, int nBlocks, void *blocks) {
+    off_t offset = (off_t)bNum * disk->blockSize;
+    size_t length = (size_t)nBlocks * disk->blockSize;
+    size_t done = 0;
+
+    while (done < length) {
+        uint64_t start = ioClock();
+        ssize_t n = pwrite(disk->fd, (char *)blocks + done, length - done, offset + done);
+        countCall(start);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            printf("An error occurred while writing the block. (LibDisk.c)\n");
+            return -1;
+        }
+        done += n;
+    }
+    countTransfer(1, nBlocks, length);
+    return 0;
+}
+
+/* Vectored form of the raw transfers: moves the bytes at offset whose
+buffers are scattered, described by iov, with one preadv/pwritev. iov is
+trimmed as the transfer advances. The blocks are counted by the caller
+when it builds iov. */
+static int rawTransferVector(int fd, off_t offset, struct iovec *iov, int iovCount, int write) {
+    while (iovCount > 0) {
+        uint64_t start = ioClock();
+        ssize_t n = write ? pwritev(fd, iov, iovCount, offset) : preadv(fd, iov, iovCount, offset);
+        countCall(start);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            printf("An error occurred while %s the blocks. (LibDisk.c)\n", write ? "writing" : "reading");
+            return -1;
+        }
+        countTransfer(write, 0, n);
+
+        // Drop fully transferred buffers and trim a partially transferred one
+        offset += n;
+        while (iovCount > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovCount--;
+        }
+        if (iovCount > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static BlockCache *createCache(int nFrames, int blockSize) {
+    BlockCache *cache = NULL;
+
+    if ((cache = calloc(1, sizeof(BlockCache))) == NULL) {
+        return NULL;
+    }
+    cache->nFrames = nFrames;
+    cache->blockSize = blockSize;
+    cache->nBuckets = nFrames * 2;
+    cache->frames = malloc(nFrames * sizeof(CacheFrame));
+    cache->buckets = malloc(cache->nBuckets * sizeof(int));
+    cache->frameData = malloc((size_t)nFrames * blockSize);
+    if (cache->frames == NULL || cache->buckets == NULL || cache->frameData == NULL) {
+        free(cache->frames);
+        free(cache->buckets);
+        free(cache->frameData);
+        free(cache);
+        return NULL;
+    }
+
+    for (int i = 0; i < cache->nBuckets; i++) {
+        cache->buckets[i] = -1;
+    }
+
+    // All frames start empty, chained in index order so frame 0 is reused last
+    for (int i = 0; i < nFrames; i++) {
+        cache->frames[i].bNum = -1;
+        cache->frames[i].dirty = 0;
+        cache->frames[i].prev = i - 1;
+        cache->frames[i].next = (i + 1 < nFrames) ? i + 1 : -1;
+        cache->frames[i].hashNext = -1;
+        cache->frames[i].data = cache->frameData + (size_t)i * blockSize;
+    }
+    cache->lruHead = 0;
+    cache->lruTail = nFrames - 1;
+    return cache;
+}
+
+static void destroyCache(BlockCache *cache) {
+    if (cache == NULL) {
+        return;
+    }
+    free(cache->frames);
+    free(cache->buckets);
+    free(cache->frameData);
+    free(cache);
+}
+
+static int cacheLookup(BlockCache *cache, int bNum) {
+    int i = cache->buckets[bNum % cache->nBuckets];
+
+    while (i != -1 && cache->frames[i].bNum != bNum) {
+        i = cache->frames[i].hashNext;
+    }
+    return i;
+}
+
+static void cacheUnhash(BlockCache *cache, int frame) {
+    int *link = &cache->buckets[cache->frames[frame].bNum % cache->nBuckets];
+
+    while (*link != frame) {
+        link = &cache->frames[*link].hashNext;
+    }
+    *link = cache->frames[frame].hashNext;
+    cache->frames[frame].hashNext = -1;
+}
+
+static void cacheTouch(BlockCache *cache, int frame) {
+    CacheFrame *f = &cache->frames[frame];
+
+    if (cache->lruHead == frame) {
+        return;
+    }
+
+    // Unlink from the current position, then push on the head
+    cache->frames[f->prev].next = f->next;
+    if (f->next != -1) {
+        cache->frames[f->next].prev = f->prev;
+    } else {
+        cache->lruTail = f->prev;
+    }
+    f->prev = -1;
+    f->next = cache->lruHead;
+    cache->frames[cache->lruHead].prev = frame;
+    cache->lruHead = frame;
+}
+
+/* Claims the least recently used frame for bNum, writing its previous
+contents back first if they were dirty. */
+static int cacheEvict(Disk *disk, int bNum) {
+    BlockCache *cache = disk->cache;
+    int frame = cache->lruTail;
+    CacheFrame *f = &cache->frames[frame];
+
+    if (f->bNum != -1) {
+        if (f->dirty) {
+            if (rawWriteBlocks(disk, f->bNum, 1, f->data) < 0) {
+                return -1;
+            }
+            cache->writebacks++;
+        }
+        cacheUnhash(cache, frame);
+        cache->evictions++;
+    }
+
+    f->bNum = bNum;
+    f->dirty = 0;
+    f->hashNext = cache->buckets[bNum % cache->nBuckets];
+    cache->buckets[bNum % cache->nBuckets] = frame;
+    cacheTouch(cache, frame);
+    return frame;
+}
+
+static int compareFramesByBlock(const void *a, const void *b) {
+    const CacheFrame *fa = *(CacheFrame *const *)a;
+    const CacheFrame *fb = *(CacheFrame *const *)b;
+    return (fa->bNum > fb->bNum) - (fa->bNum < fb->bNum);
+}
+
+static int cacheFlush(Disk *disk) {
+    BlockCache *cache = disk->cache;
+    CacheFrame **dirtyFrames = NULL;
+    int nDirty = 0;
+
+    if (cache == NULL) {
+        return 0;
+    }
+
+    if ((dirtyFrames = malloc(cache->nFrames * sizeof(CacheFrame *))) == NULL) {
+        printf("Failed to allocate memory for the cache flush. (LibDisk.c)\n");
+        return -1;
+    }
+    for (int i = 0; i < cache->nFrames; i++) {
+        if (cache->frames[i].bNum != -1 && cache->frames[i].dirty) {
+            dirtyFrames[nDirty++] = &cache->frames[i];
+        }
+    }
+
+    // Write back in block order so the flush is one forward pass over the file
+    qsort(dirtyFrames, nDirty, sizeof(CacheFrame *), compareFramesByBlock);
+    for (int i = 0; i < nDirty; i++) {
+        if (rawWriteBlocks(disk, dirtyFrames[i]->bNum, 1, dirtyFrames[i]->data) < 0) {
+            free(dirtyFrames);
+            return -1;
+        }
+        dirtyFrames[i]->dirty = 0;
+        cache->writebacks++;
+    }
+    free(dirtyFrames);
+    return 0;
+}
+
+static void cacheSyncFrame(BlockCache *cache, CacheFrame *f, char *block, int written) {
+    if (written) {
+        memcpy(f->data, block, cache->blockSize);
+        f->dirty = 0;
+    } else if (f->dirty) {
+        memcpy(block, f->data, cache->blockSize);
+    }
+}
+
+/* Reconciles the cache with a range transfer that went straight to the
+file. After a write (written != 0) cached copies take the new contents and
+become clean; after a read, dirty cached copies overwrite the stale data
+read from the file. Short ranges probe the hash, long ones scan frames. */
+static void cacheSyncRange(BlockCache *cache, int bNum, int nBlocks, void *blocks, int written) {
+    if (nBlocks < cache->nFrames) {
+        for (int b = bNum; b < bNum + nBlocks; b++) {
+            int frame = cacheLookup(cache, b);
+            if (frame != -1) {
+                cacheSyncFrame(cache, &cache->frames[frame], (char *)blocks + (size_t)(b - bNum) * cache->blockSize, written);
+            }
+        }
+        return;
+    }
+    for (int i = 0; i < cache->nFrames; i++) {
+        CacheFrame *f = &cache->frames[i];
+        if (f->bNum >= bNum && f->bNum < bNum + nBlocks) {
+            cacheSyncFrame(cache, f, (char *)blocks + (size_t)(f->bNum - bNum) * cache->blockSize, written);
+        }
+    }
+}
+
+/* Caches block bNum after a read that ran outside the disk lock. If
+another thread cached the block in the meantime its copy is kept, and a
+dirty copy also replaces what the caller read. Called with the lock
+held. */
+static int cacheFill(Disk *disk, int bNum, void *block) {
+    BlockCache *cache = disk->cache;
+    int frame;
+
+    if (cache == NULL) {
+        return 0;
+    }
+    if ((frame = cacheLookup(cache, bNum)) != -1) {
+        cacheSyncFrame(cache, &cache->frames[frame], block, 0);
+        cacheTouch(cache, frame);
+        return 0;
+    }
+    if ((frame = cacheEvict(disk, bNum)) < 0) {
+        return -1;
+    }
+    memcpy(cache->frames[frame].data, block, disk->blockSize);
+    return 0;
+}
 
 int openDisk(char *filename, int nBytes) {
-    FILE *fp = NULL;
-    int fileSize = 0;
+    return openDiskWithFlags(filename, nBytes, 0);
+}
+
+/* Same as openDisk, with DISK_* flags selecting the backend. DISK_MMAP maps
+the whole image into memory: block reads and writes become memcpy against
+the mapping, and getBlockPointer hands out direct read-only pointers. */
+int openDiskWithFlags(char *filename, int nBytes, int flags) {
+    int fd = -1;
+    char *map = NULL;
+    struct stat fileStat;
     Disk *newDisk = NULL;
     char *filenameCopy = NULL;
 
     if (nBytes == 0) {
-        if ((fp = fopen(filename, "r+")) == NULL) {
+        if ((fd = open(filename, O_RDWR)) < 0) {
             printf("The file should have existed but was not found. (LibDisk.c)\n");
             return -1;
         }
 
-        fseek(fp, 0, SEEK_END);
-        fileSize = ftell(fp);
+        if (fstat(fd, &fileStat) != 0) {
+            printf("An error occurred while reading the file size. (LibDisk.c)\n");
+            close(fd);
+            return -1;
+        }
 
-        if (fileSize % BLOCKSIZE != 0) {
+        if (fileStat.st_size % BLOCKSIZE != 0) {
             printf("File size is not a multiple of the block size. (LibDisk.c)\n");
-            fclose(fp);
+            close(fd);
             return -1;
         }
 
-        fseek(fp, 0, SEEK_SET);
-        nBytes = fileSize;
+        nBytes = fileStat.st_size;
 
     } else {
         if (nBytes < BLOCKSIZE) {
@@ -40,119 +507,1005 @@ int openDisk(char *filename, int nBytes) {
             nBytes -= nBytes % BLOCKSIZE;
         }
 
-        if ((fp = fopen(filename, "w")) == NULL) {
+        if ((fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
             printf("An error occurred while opening the file. (LibDisk.c)\n");
             return -1;
         }
 
-        char zero = 0;
-        for (int i = 0; i < nBytes; i++) {
-            fwrite(&zero, sizeof(char), 1, fp);
+        // Extending the empty file leaves a sparse image that reads back as zeros
+        if (ftruncate(fd, nBytes) != 0) {
+            printf("An error occurred while sizing the file. (LibDisk.c)\n");
+            close(fd);
+            return -1;
+        }
+    }
+
+    if (flags & DISK_MMAP) {
+        map = mmap(NULL, nBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            printf("An error occurred while mapping the file. (LibDisk.c)\n");
+            close(fd);
+            return -1;
         }
     }
 
     if ((newDisk = malloc(sizeof(Disk))) == NULL) {
         printf("Failed to allocate memory for the new disk. (LibDisk.c)\n");
-        fclose(fp);
+        if (map != NULL) {
+            munmap(map, nBytes);
+        }
+        close(fd);
         return -1;
     }
 
     if ((filenameCopy = malloc(strlen(filename) + 1)) == NULL) {
         printf("Failed to allocate memory for the filename. (LibDisk.c)\n");
         free(newDisk);
-        fclose(fp);
+        if (map != NULL) {
+            munmap(map, nBytes);
+        }
+        close(fd);
         return -1;
     }
 
     strcpy(filenameCopy, filename);
 
-    newDisk->diskNumber = diskCounter++;
     newDisk->filename = filenameCopy;
     newDisk->nBytes = nBytes;
-    newDisk->next = diskListHead;
-    newDisk->filePointer = fp;
-    diskListHead = newDisk;
+    newDisk->blockSize = BLOCKSIZE;
+    newDisk->fd = fd;
+    newDisk->flags = flags;
+    newDisk->map = map;
+    newDisk->cache = NULL;
+    pthread_mutex_init(&newDisk->lock, NULL);
+
+    // The mapping already serves blocks from memory, so only file-backed disks get a cache
+    if (map == NULL && (newDisk->cache = createCache(DEFAULT_CACHE_FRAMES, BLOCKSIZE)) == NULL) {
+        printf("Failed to allocate the block cache, continuing uncached. (LibDisk.c)\n");
+    }
+
+    if ((newDisk->diskNumber = claimDiskSlot(newDisk)) < 0) {
+        pthread_mutex_destroy(&newDisk->lock);
+        destroyCache(newDisk->cache);
+        free(filenameCopy);
+        free(newDisk);
+        if (map != NULL) {
+            munmap(map, nBytes);
+        }
+        close(fd);
+        return -1;
+    }
 
     return newDisk->diskNumber;
 }
 
 int closeDisk(int disk) {
-    Disk *currentDisk = diskListHead;
-    Disk *previousDisk = NULL;
+    Disk *currentDisk = findDisk(disk);
 
-    while (currentDisk != NULL) {
-        if (currentDisk->diskNumber == disk) {
-            if (fclose(currentDisk->filePointer) != 0) {
-                printf("An error occurred while closing the file. (LibDisk.c)\n");
-                return -1;
-            }
-            if (previousDisk == NULL) {
-                diskListHead = currentDisk->next;
-            } else {
-                previousDisk->next = currentDisk->next;
-            }
-            free(currentDisk->filename);
-            free(currentDisk);
-            return 0;
+    if (currentDisk == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&currentDisk->lock);
+    int flushed = cacheFlush(currentDisk);
+    pthread_mutex_unlock(&currentDisk->lock);
+    if (flushed < 0) {
+        printf("An error occurred while flushing the block cache. (LibDisk.c)\n");
+        return -1;
+    }
+    if (currentDisk->map != NULL) {
+        uint64_t start = ioClock();
+        int synced = msync(currentDisk->map, currentDisk->nBytes, MS_SYNC);
+        countCall(start);
+        if (synced != 0) {
+            printf("An error occurred while syncing the mapping. (LibDisk.c)\n");
+            return -1;
         }
-        previousDisk = currentDisk;
-        currentDisk = currentDisk->next;
+        munmap(currentDisk->map, currentDisk->nBytes);
+        currentDisk->map = NULL;
+    }
+    if (close(currentDisk->fd) != 0) {
+        printf("An error occurred while closing the file. (LibDisk.c)\n");
+        return -1;
     }
 
-    printf("The specified disk was not found. (LibDisk.c)\n");
-    return -1;
+    releaseDiskSlot(disk);
+    pthread_mutex_destroy(&currentDisk->lock);
+    destroyCache(currentDisk->cache);
+    free(currentDisk->filename);
+    free(currentDisk);
+    return 0;
 }
 
 int readBlock(int disk, int bNum, void *block) {
-    Disk *currentDisk = diskListHead;
+    Disk *currentDisk = findDisk(disk);
 
-    while (currentDisk != NULL) {
-        if (currentDisk->diskNumber == disk) {
-            if (bNum < 0 || bNum >= currentDisk->nBytes / BLOCKSIZE) {
-                printf("The block number is out of range. (LibDisk.c)\n");
-                return -1;
-            }
-            FILE *fp = currentDisk->filePointer;
-            if (fseek(fp, bNum * BLOCKSIZE, SEEK_SET) != 0) {
-                printf("An error occurred while seeking to the position. (LibDisk.c)\n");
-                return -1;
-            }
-            if (fread(block, sizeof(char), BLOCKSIZE, fp) != BLOCKSIZE) {
-                printf("An error occurred while reading the block. (LibDisk.c)\n");
-                return -1;
-            }
-            return 0;
+    if (currentDisk == NULL) {
+        return -1;
+    }
+    if (bNum < 0 || bNum >= currentDisk->nBytes / currentDisk->blockSize) {
+        printf("The block number is out of range. (LibDisk.c)\n");
+        return -1;
+    }
+
+    if (currentDisk->map != NULL) {
+        memcpy(block, currentDisk->map + (size_t)bNum * currentDisk->blockSize, currentDisk->blockSize);
+        countTransfer(0, 1, currentDisk->blockSize);
+        return 0;
+    }
+
+    pthread_mutex_lock(&currentDisk->lock);
+    BlockCache *cache = currentDisk->cache;
+    if (cache == NULL) {
+        pthread_mutex_unlock(&currentDisk->lock);
+        return rawReadBlocks(currentDisk, bNum, 1, block);
+    }
+
+    int frame = cacheLookup(cache, bNum);
+    if (frame != -1) {
+        cache->hits++;
+        cacheTouch(cache, frame);
+        memcpy(block, cache->frames[frame].data, currentDisk->blockSize);
+        pthread_mutex_unlock(&currentDisk->lock);
+        return 0;
+    }
+    cache->misses++;
+    pthread_mutex_unlock(&currentDisk->lock);
+
+    // Misses read outside the lock, so other threads keep using the cache
+    if (rawReadBlocks(currentDisk, bNum, 1, block) < 0) {
+        return -1;
+    }
+    pthread_mutex_lock(&currentDisk->lock);
+    int success = cacheFill(currentDisk, bNum, block);
+    pthread_mutex_unlock(&currentDisk->lock);
+    return success;
+}
+
+int writeBlock(int disk, int bNum, void *block) {
+    Disk *currentDisk = findDisk(disk);
+
+    if (currentDisk == NULL) {
+        return -1;
+    }
+    if (bNum < 0 || bNum >= currentDisk->nBytes / currentDisk->blockSize) {
+        printf("The block number is out of range. (LibDisk.c)\n");
+        return -1;
+    }
+
+    if (currentDisk->map != NULL) {
+        memcpy(currentDisk->map + (size_t)bNum * currentDisk->blockSize, block, currentDisk->blockSize);
+        countTransfer(1, 1, currentDisk->blockSize);
+        return 0;
+    }
+
+    pthread_mutex_lock(&currentDisk->lock);
+    BlockCache *cache = currentDisk->cache;
+    if (cache == NULL) {
+        pthread_mutex_unlock(&currentDisk->lock);
+        return rawWriteBlocks(currentDisk, bNum, 1, block);
+    }
+
+    // Whole-block writes never need the old contents, so a miss just claims a frame
+    int frame = cacheLookup(cache, bNum);
+    if (frame != -1) {
+        cache->hits++;
+        cacheTouch(cache, frame);
+    } else {
+        cache->misses++;
+        if ((frame = cacheEvict(currentDisk, bNum)) < 0) {
+            pthread_mutex_unlock(&currentDisk->lock);
+            return -1;
+        }
+    }
+    memcpy(cache->frames[frame].data, block, currentDisk->blockSize);
+    cache->frames[frame].dirty = 1;
+    pthread_mutex_unlock(&currentDisk->lock);
+    return 0;
+}
+
+/* Writes every dirty cached block back to the image, so the file on disk
+reflects all completed writeBlock calls. For a mapped disk this schedules
+write-back of the dirty pages. */
+int flushDisk(int disk) {
+    Disk *currentDisk = findDisk(disk);
+
+    if (currentDisk == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&currentDisk->lock);
+    int flushed = cacheFlush(currentDisk);
+    pthread_mutex_unlock(&currentDisk->lock);
+    if (flushed < 0) {
+        printf("An error occurred while flushing the block cache. (LibDisk.c)\n");
+        return -1;
+    }
+    if (currentDisk->map != NULL) {
+        uint64_t start = ioClock();
+        int synced = msync(currentDisk->map, currentDisk->nBytes, MS_ASYNC);
+        countCall(start);
+        if (synced != 0) {
+            printf("An error occurred while syncing the mapping. (LibDisk.c)\n");
+            return -1;
         }
-        currentDisk = currentDisk->next;
+    }
+    return 0;
+}
+
+/* Replaces the block cache of an open disk with one of nFrames blocks.
+Dirty blocks are written back first and the counters start over. A size
+of 0 turns caching off for the disk. */
+int setDiskCacheSize(int disk, int nFrames) {
+    Disk *currentDisk = findDisk(disk);
+    BlockCache *newCache = NULL;
+
+    if (currentDisk == NULL) {
+        return -1;
+    }
+    if (nFrames < 0) {
+        printf("The cache size cannot be negative. (LibDisk.c)\n");
+        return -1;
+    }
+    if (currentDisk->map != NULL) {
+        printf("Mapped disks are served from the mapping and are not cached. (LibDisk.c)\n");
+        return -1;
+    }
+    if (nFrames > 0 && (newCache = createCache(nFrames, currentDisk->blockSize)) == NULL) {
+        printf("Failed to allocate memory for the block cache. (LibDisk.c)\n");
+        return -1;
+    }
+    pthread_mutex_lock(&currentDisk->lock);
+    if (cacheFlush(currentDisk) < 0) {
+        pthread_mutex_unlock(&currentDisk->lock);
+        printf("An error occurred while flushing the block cache. (LibDisk.c)\n");
+        destroyCache(newCache);
+        return -1;
+    }
+
+    destroyCache(currentDisk->cache);
+    currentDisk->cache = newCache;
+    pthread_mutex_unlock(&currentDisk->lock);
+    return 0;
+}
+
+/* Changes the size of the blocks an open disk is read and written in,
+for images formatted with a block size other than BLOCKSIZE. The image
+size must be a multiple of the new size. Dirty blocks are written back
+and the cache keeps its number of frames, each resized to the new block.
+No other call may be using the disk meanwhile. */
+int setDiskBlockSize(int disk, int blockSize) {
+    Disk *currentDisk = findDisk(disk);
+    BlockCache *newCache = NULL;
+
+    if (currentDisk == NULL) {
+        return -1;
+    }
+    if (blockSize <= 0 || currentDisk->nBytes % blockSize != 0) {
+        printf("The disk size is not a multiple of the block size. (LibDisk.c)\n");
+        return -1;
+    }
+    if (blockSize == currentDisk->blockSize) {
+        return 0;
+    }
+    if (currentDisk->cache != NULL && (newCache = createCache(currentDisk->cache->nFrames, blockSize)) == NULL) {
+        printf("Failed to allocate memory for the block cache. (LibDisk.c)\n");
+        return -1;
+    }
+    pthread_mutex_lock(&currentDisk->lock);
+    if (cacheFlush(currentDisk) < 0) {
+        pthread_mutex_unlock(&currentDisk->lock);
+        printf("An error occurred while flushing the block cache. (LibDisk.c)\n");
+        destroyCache(newCache);
+        return -1;
     }
 
-    printf("The specified disk was not found. (LibDisk.c)\n");
+    destroyCache(currentDisk->cache);
+    currentDisk->cache = newCache;
+    currentDisk->blockSize = blockSize;
+    pthread_mutex_unlock(&currentDisk->lock);
+    return 0;
+}
+
+/* Returns the number of blocks of an open disk at its current block size,
+or -1 for an unknown disk. */
+int getDiskBlockCount(int disk) {
+    Disk *currentDisk = findDisk(disk);
+
+    if (currentDisk == NULL) {
+        return -1;
+    }
+    return currentDisk->nBytes / currentDisk->blockSize;
+}
+
+int getDiskCacheStats(int disk, DiskCacheStats *stats) {
+    Disk *currentDisk = findDisk(disk);
+
+    if (currentDisk == NULL) {
+        return -1;
+    }
+
+    memset(stats, 0, sizeof(DiskCacheStats));
+    pthread_mutex_lock(&currentDisk->lock);
+    if (currentDisk->cache != NULL) {
+        stats->nFrames = currentDisk->cache->nFrames;
+        stats->hits = currentDisk->cache->hits;
+        stats->misses = currentDisk->cache->misses;
+        stats->evictions = currentDisk->cache->evictions;
+        stats->writebacks = currentDisk->cache->writebacks;
+    }
+    pthread_mutex_unlock(&currentDisk->lock);
+    return 0;
+}
+
+/* Copies the process-wide I/O counters into stats. Returns -1, with stats
+zeroed, when libDisk was built with TFS_NO_STATS. */
+int getDiskIOStats(DiskIOStats *stats) {
+    memset(stats, 0, sizeof(DiskIOStats));
+#ifndef TFS_NO_STATS
+    stats->blockReads = __atomic_load_n(&ioStats.blockReads, __ATOMIC_RELAXED);
+    stats->blockWrites = __atomic_load_n(&ioStats.blockWrites, __ATOMIC_RELAXED);
+    stats->bytesRead = __atomic_load_n(&ioStats.bytesRead, __ATOMIC_RELAXED);
+    stats->bytesWritten = __atomic_load_n(&ioStats.bytesWritten, __ATOMIC_RELAXED);
+    stats->syscalls = __atomic_load_n(&ioStats.syscalls, __ATOMIC_RELAXED);
+    stats->syscallNanos = __atomic_load_n(&ioStats.syscallNanos, __ATOMIC_RELAXED);
+    return 0;
+#else
     return -1;
+#endif
 }
 
-int writeBlock(int disk, int bNum, void *block) {
-    Disk *currentDisk = diskListHead;
+/* Sets the I/O counters back to zero. Transfers running meanwhile may be
+counted on either side. */
+int resetDiskIOStats(void) {
+#ifndef TFS_NO_STATS
+    __atomic_store_n(&ioStats.blockReads, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ioStats.blockWrites, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ioStats.bytesRead, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ioStats.bytesWritten, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ioStats.syscalls, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&ioStats.syscallNanos, 0, __ATOMIC_RELAXED);
+    return 0;
+#else
+    return -1;
+#endif
+}
 
-    while (currentDisk != NULL) {
-        if (currentDisk->diskNumber == disk) {
-            if (bNum < 0 || bNum >= currentDisk->nBytes / BLOCKSIZE) {
-                printf("The block number is out of range. (LibDisk.c)\n");
-                return -1;
+/* Returns a read-only pointer to block bNum of a disk opened with
+DISK_MMAP, or NULL for file-backed disks and bad block numbers. The pointer
+is valid until closeDisk and sees every later writeBlock to that block. */
+const void *getBlockPointer(int disk, int bNum) {
+    Disk *currentDisk = findDisk(disk);
+
+    if (currentDisk == NULL || currentDisk->map == NULL) {
+        return NULL;
+    }
+    if (bNum < 0 || bNum >= currentDisk->nBytes / currentDisk->blockSize) {
+        printf("The block number is out of range. (LibDisk.c)\n");
+        return NULL;
+    }
+    return currentDisk->map + (size_t)bNum * currentDisk->blockSize;
+}
+
+/* Reads nBlocks contiguous blocks starting at bNum into blocks with one
+positional read, returning exactly what readBlock would for each block. */
+int readBlockRange(int disk, int bNum, int nBlocks, void *blocks) {
+    Disk *currentDisk = findDisk(disk);
+
+    if (currentDisk == NULL) {
+        return -1;
+    }
+    if (nBlocks < 0 || bNum < 0 || bNum > currentDisk->nBytes / currentDisk->blockSize - nBlocks) {
+        printf("The block range is out of range. (LibDisk.c)\n");
+        return -1;
+    }
+
+    if (currentDisk->map != NULL) {
+        memcpy(blocks, currentDisk->map + (size_t)bNum * currentDisk->blockSize, (size_t)nBlocks * currentDisk->blockSize);
+        countTransfer(0, nBlocks, (size_t)nBlocks * currentDisk->blockSize);
+        return 0;
+    }
+    if (rawReadBlocks(currentDisk, bNum, nBlocks, blocks) < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&currentDisk->lock);
+    if (currentDisk->cache != NULL) {
+        cacheSyncRange(currentDisk->cache, bNum, nBlocks, blocks, 0);
+    }
+    pthread_mutex_unlock(&currentDisk->lock);
+    return 0;
+}
+
+/* Writes nBlocks contiguous blocks starting at bNum with one positional
+write that bypasses the cache, for bulk writes such as formatting. */
+int writeBlockRange(int disk, int bNum, int nBlocks, void *blocks) {
+    Disk *currentDisk = findDisk(disk);
+
+    if (currentDisk == NULL) {
+        return -1;
+    }
+    if (nBlocks < 0 || bNum < 0 || bNum > currentDisk->nBytes / currentDisk->blockSize - nBlocks) {
+        printf("The block range is out of range. (LibDisk.c)\n");
+        return -1;
+    }
+
+    if (currentDisk->map != NULL) {
+        memcpy(currentDisk->map + (size_t)bNum * currentDisk->blockSize, blocks, (size_t)nBlocks * currentDisk->blockSize);
+        countTransfer(1, nBlocks, (size_t)nBlocks * currentDisk->blockSize);
+        return 0;
+    }
+    if (rawWriteBlocks(currentDisk, bNum, nBlocks, blocks) < 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&currentDisk->lock);
+    if (currentDisk->cache != NULL) {
+        cacheSyncRange(currentDisk->cache, bNum, nBlocks, blocks, 1);
+    }
+    pthread_mutex_unlock(&currentDisk->lock);
+    return 0;
+}
+
+/* Orders requests by block number; requests for the same block keep their
+array order so the last write of a block still wins. */
+static int compareBlockIO(const void *a, const void *b) {
+    const BlockIO *x = *(BlockIO *const *)a;
+    const BlockIO *y = *(BlockIO *const *)b;
+
+    if (x->bNum != y->bNum) {
+        return (x->bNum > y->bNum) - (x->bNum < y->bNum);
+    }
+    return (x > y) - (x < y);
+}
+
+/* One run of consecutive blocks within a batch: a single readv/writev of
+iovCount buffers at offset. iov and iovCount move past what a short
+transfer moved; firstBlock and nBlocks keep the whole run. Queued runs
+wait for a pool worker on next. */
+typedef struct DiskRun {
+    DiskBatch *batch;
+    int fd;
+    off_t offset;
+    int firstBlock;
+    int nBlocks;
+    struct iovec *iov;
+    int iovCount;
+    int write;
+    struct DiskRun *next;
+} DiskRun;
+
+/* disk is set for writes through the block cache, whose cached copies
+take the new contents at submission */
+struct DiskBatch {
+    Disk *disk;
+    int pending;
+    int failed;
+    int onRing;
+    int nRuns;
+    DiskRun *runs;
+    struct iovec *iov;
+};
+
+/* The shared io_uring instance, set up with raw system calls on first
+use. The submission and completion queues are rings in memory shared with
+the kernel; tails are published with release stores and read with acquire
+loads. */
+typedef struct DiskRing {
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    unsigned cqEntries;
+    struct io_uring_cqe *cqes;
+    unsigned inFlight;
+    int reaping;
+} DiskRing;
+
+/* Asynchronous transfers share one engine. asyncLock guards the ring's
+queues, the pool's work queue and every batch's pending count; asyncDone
+is signalled whenever runs complete. At most one thread at a time waits in
+the kernel for ring completions, and reaps them for everybody. */
+enum { ASYNC_UNSET, ASYNC_RING, ASYNC_POOL };
+static pthread_mutex_t asyncLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t asyncDone = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t asyncWork = PTHREAD_COND_INITIALIZER;
+static int ringState = ASYNC_UNSET;
+static int poolStarted = 0;
+static DiskRing ring;
+static DiskRun *workHead = NULL;
+static DiskRun *workTail = NULL;
+
+static int setupRing(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, DISK_RING_ENTRIES, &params);
+    if (fd < 0) {
+        return -1;
+    }
+
+    size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) && cqSize > sqSize) {
+        sqSize = cqSize;
+    }
+    char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    }
+    void *sqes = MAP_FAILED;
+    if (sq != MAP_FAILED && cq != MAP_FAILED) {
+        sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    }
+    if (sqes == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    ring.fd = fd;
+    ring.sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring.sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring.sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring.sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring.sqes = sqes;
+    ring.cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring.cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring.cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring.cqEntries = params.cq_entries;
+    ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring.inFlight = 0;
+    ring.reaping = 0;
+    return 0;
+}
+
+/* Records the result of a run: res bytes moved, or -errno. A short or
+interrupted transfer is finished synchronously. Called with asyncLock
+held. */
+static void completeRun(DiskRun *run, int res) {
+    if (res < 0 && res != -EINTR && res != -EAGAIN) {
+        printf("An error occurred while %s the blocks. (LibDisk.c)\n", run->write ? "writing" : "reading");
+        run->batch->failed = 1;
+    } else {
+        // Skip what was transferred; anything left is finished here
+        size_t n = (res > 0) ? (size_t)res : 0;
+        countTransfer(run->write, 0, n);
+        off_t offset = run->offset + n;
+        while (run->iovCount > 0 && n >= run->iov->iov_len) {
+            n -= run->iov->iov_len;
+            run->iov++;
+            run->iovCount--;
+        }
+        if (run->iovCount > 0) {
+            run->iov->iov_base = (char *)run->iov->iov_base + n;
+            run->iov->iov_len -= n;
+            if (rawTransferVector(run->fd, offset, run->iov, run->iovCount, run->write) < 0) {
+                run->batch->failed = 1;
             }
-            FILE *fp = currentDisk->filePointer;
-            if (fseek(fp, bNum * BLOCKSIZE, SEEK_SET) != 0) {
-                printf("An error occurred while seeking to the position. (LibDisk.c)\n");
-                return -1;
+        }
+    }
+    run->batch->pending--;
+}
+
+/* Moves every completion off the ring. Called with asyncLock held. */
+static void reapRing(void) {
+    unsigned head = *ring.cqHead;
+    unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return;
+    }
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & ring.cqMask];
+        completeRun((DiskRun *)(uintptr_t)cqe->user_data, cqe->res);
+        ring.inFlight--;
+        head++;
+    }
+    __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&asyncDone);
+}
+
+/* Calls io_uring_enter, retrying when a signal interrupts it. Returns its
+result, or -errno on failure. */
+static int enterRing(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    int result;
+    do {
+        uint64_t start = ioClock();
+        result = syscall(__NR_io_uring_enter, ring.fd, toSubmit, minComplete, flags, NULL, 0);
+        if (result < 0) {
+            result = -errno;
+        }
+        countCall(start);
+    } while (result == -EINTR);
+    return result;
+}
+
+/* Hands every queued submission to the kernel. Runs it does not take are
+taken back off the queue and transferred synchronously. Called with
+asyncLock held. */
+static void submitQueued(void) {
+    unsigned tail = *ring.sqTail;
+    unsigned head = __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        int submitted = enterRing(tail - head, 0, 0);
+        head = __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+        if (submitted > 0) {
+            continue;
+        }
+
+        // Without a polling thread the kernel only takes entries inside
+        // io_uring_enter, so the ones still queued are safe to withdraw
+        __atomic_store_n(ring.sqTail, head, __ATOMIC_RELEASE);
+        for (unsigned i = head; i != tail; i++) {
+            struct io_uring_sqe *sqe = &ring.sqes[ring.sqArray[i & ring.sqMask]];
+            ring.inFlight--;
+            completeRun((DiskRun *)(uintptr_t)sqe->user_data, 0);
+        }
+        pthread_cond_broadcast(&asyncDone);
+        return;
+    }
+}
+
+/* Waits until batch has completed, or with a NULL batch until the
+completion queue has room for another run. Pool batches wait for the
+workers' signal; ring waiters take turns reaping. Called with asyncLock
+held. */
+static void waitForRuns(DiskBatch *batch) {
+    while (batch != NULL ? batch->pending > 0 : ring.inFlight >= ring.cqEntries) {
+        if ((batch != NULL && !batch->onRing) || ring.reaping) {
+            pthread_cond_wait(&asyncDone, &asyncLock);
+            continue;
+        }
+        reapRing();
+        if (batch != NULL ? batch->pending == 0 : ring.inFlight < ring.cqEntries) {
+            break;
+        }
+        submitQueued();
+        ring.reaping = 1;
+        pthread_mutex_unlock(&asyncLock);
+        if (enterRing(0, 1, IORING_ENTER_GETEVENTS) < 0) {
+            // Submitted runs belong to the kernel until they complete, so a
+            // failed wait (EBUSY with a full completion queue, among
+            // others) only means reaping and waiting again
+            sched_yield();
+        }
+        pthread_mutex_lock(&asyncLock);
+        ring.reaping = 0;
+        reapRing();
+        pthread_cond_broadcast(&asyncDone);
+    }
+}
+
+/* Puts a run on the submission queue; the caller enters the ring once the
+whole batch is queued. Called with asyncLock held. */
+static void queueRingRun(DiskRun *run) {
+    waitForRuns(NULL);
+    if (*ring.sqTail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) > ring.sqMask) {
+        submitQueued();
+    }
+    unsigned tail = *ring.sqTail;
+    unsigned index = tail & ring.sqMask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = run->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = run->fd;
+    sqe->off = run->offset;
+    sqe->addr = (uintptr_t)run->iov;
+    sqe->len = run->iovCount;
+    sqe->user_data = (uintptr_t)run;
+    ring.sqArray[index] = index;
+    __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring.inFlight++;
+}
+
+static void *poolWorker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&asyncLock);
+    while (1) {
+        while (workHead == NULL) {
+            pthread_cond_wait(&asyncWork, &asyncLock);
+        }
+        DiskRun *run = workHead;
+        workHead = run->next;
+        if (workHead == NULL) {
+            workTail = NULL;
+        }
+        pthread_mutex_unlock(&asyncLock);
+        int success = rawTransferVector(run->fd, run->offset, run->iov, run->iovCount, run->write);
+        pthread_mutex_lock(&asyncLock);
+        run->batch->failed |= (success < 0);
+        run->batch->pending--;
+        pthread_cond_broadcast(&asyncDone);
+    }
+    return NULL;
+}
+
+/* Starts the fallback pool's workers. Called with asyncLock held. */
+static int startPool(void) {
+    for (int i = poolStarted; i < DISK_ASYNC_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, poolWorker, NULL) != 0) {
+            break;
+        }
+        pthread_detach(thread);
+        poolStarted++;
+    }
+    return poolStarted > 0 ? 0 : -1;
+}
+
+/* Sends every run of batch to the ring or, for DISK_THREAD_POOL disks and
+kernels without io_uring, to the worker pool. Returns -1 if neither can
+take it. */
+static int submitRuns(Disk *disk, DiskBatch *batch) {
+    pthread_mutex_lock(&asyncLock);
+    if (ringState == ASYNC_UNSET) {
+        ringState = (setupRing() == 0) ? ASYNC_RING : ASYNC_POOL;
+    }
+    if (ringState == ASYNC_RING && !(disk->flags & DISK_THREAD_POOL)) {
+        batch->onRing = 1;
+        for (int i = 0; i < batch->nRuns; i++) {
+            queueRingRun(&batch->runs[i]);
+        }
+        submitQueued();
+        pthread_mutex_unlock(&asyncLock);
+        return 0;
+    }
+    if (startPool() < 0) {
+        pthread_mutex_unlock(&asyncLock);
+        printf("Could not start the I/O worker threads. (LibDisk.c)\n");
+        return -1;
+    }
+    for (int i = 0; i < batch->nRuns; i++) {
+        DiskRun *run = &batch->runs[i];
+        run->next = NULL;
+        if (workTail != NULL) {
+            workTail->next = run;
+        } else {
+            workHead = run;
+        }
+        workTail = run;
+    }
+    pthread_cond_broadcast(&asyncWork);
+    pthread_mutex_unlock(&asyncLock);
+    return 0;
+}
+
+/* Validates the requests, serves what it can from the cache or the
+mapping, and groups the rest into runs of consecutive blocks. Returns a
+batch whose runs still have to be transferred (possibly none), or NULL. */
+static DiskBatch *prepareBatch(Disk *currentDisk, BlockIO *ios, int count, int write) {
+    for (int i = 0; i < count; i++) {
+        if (ios[i].bNum < 0 || ios[i].bNum >= currentDisk->nBytes / currentDisk->blockSize) {
+            printf("The block number is out of range. (LibDisk.c)\n");
+            return NULL;
+        }
+    }
+
+    // The batch, its runs, their iovecs and the sort array share one allocation
+    DiskBatch *batch = malloc(sizeof(DiskBatch) + (size_t)count * (sizeof(DiskRun) + sizeof(struct iovec) + sizeof(BlockIO *)));
+    if (batch == NULL) {
+        printf("Failed to allocate memory for the block requests. (LibDisk.c)\n");
+        return NULL;
+    }
+    memset(batch, 0, sizeof(DiskBatch));
+    batch->runs = (DiskRun *)(batch + 1);
+    batch->iov = (struct iovec *)(batch->runs + count);
+    BlockIO **sorted = (BlockIO **)(batch->iov + count);
+
+    if (currentDisk->map != NULL) {
+        for (int i = 0; i < count; i++) {
+            char *mapped = currentDisk->map + (size_t)ios[i].bNum * currentDisk->blockSize;
+            memcpy(write ? mapped : ios[i].block, write ? ios[i].block : mapped, currentDisk->blockSize);
+        }
+        countTransfer(write, count, (size_t)count * currentDisk->blockSize);
+        return batch;
+    }
+
+    for (int i = 0; i < count; i++) {
+        sorted[i] = &ios[i];
+    }
+    qsort(sorted, count, sizeof(BlockIO *), compareBlockIO);
+
+    // Only the last write of a block is kept, since runs may complete in
+    // any order. Reads of cached blocks are served from the cache, and
+    // cached copies of written blocks take the new contents and are clean
+    // again unless the write fails; cached reads drop out before any I/O
+    // starts.
+    int i;
+    pthread_mutex_lock(&currentDisk->lock);
+    BlockCache *cache = currentDisk->cache;
+    for (i = 0; i < count; i++) {
+        if (write && i + 1 < count && sorted[i + 1]->bNum == sorted[i]->bNum) {
+            sorted[i] = NULL;
+            continue;
+        }
+        int frame = (cache != NULL) ? cacheLookup(cache, sorted[i]->bNum) : -1;
+        if (cache == NULL) {
+            continue;
+        }
+        if (write) {
+            batch->disk = currentDisk;
+            if (frame != -1) {
+                cacheSyncFrame(cache, &cache->frames[frame], sorted[i]->block, 1);
+                cache->hits++;
+            } else {
+                cache->misses++;
             }
-            if (fwrite(block, sizeof(char), BLOCKSIZE, fp) != BLOCKSIZE) {
-                printf("An error occurred while writing the block. (LibDisk.c)\n");
-                return -1;
+        } else if (frame != -1) {
+            memcpy(sorted[i]->block, cache->frames[frame].data, currentDisk->blockSize);
+            cache->hits++;
+            sorted[i] = NULL;
+        } else {
+            cache->misses++;
+        }
+    }
+    pthread_mutex_unlock(&currentDisk->lock);
+
+    int nIov = 0;
+    i = 0;
+    while (i < count) {
+        if (sorted[i] == NULL) {
+            i++;
+            continue;
+        }
+
+        // Extend the run while the next request is for the following block
+        DiskRun *run = &batch->runs[batch->nRuns++];
+        int runStart = sorted[i]->bNum;
+        run->batch = batch;
+        run->fd = currentDisk->fd;
+        run->offset = (off_t)runStart * currentDisk->blockSize;
+        run->iov = &batch->iov[nIov];
+        run->iovCount = 0;
+        run->write = write;
+        while (i < count && run->iovCount < DISK_MAX_IOV && sorted[i] != NULL && sorted[i]->bNum == runStart + run->iovCount) {
+            batch->iov[nIov].iov_base = sorted[i]->block;
+            batch->iov[nIov].iov_len = currentDisk->blockSize;
+            nIov++;
+            run->iovCount++;
+            i++;
+        }
+        run->firstBlock = runStart;
+        run->nBlocks = run->iovCount;
+    }
+    countTransfer(write, nIov, 0);
+    batch->pending = batch->nRuns;
+    return batch;
+}
+
+static DiskBatch *submitBlocks(int disk, BlockIO *ios, int count, int write) {
+    Disk *currentDisk = findDisk(disk);
+
+    if (currentDisk == NULL) {
+        return NULL;
+    }
+    if (count < 0) {
+        return NULL;
+    }
+    DiskBatch *batch = prepareBatch(currentDisk, ios, count, write);
+    if (batch != NULL && batch->nRuns > 0 && submitRuns(currentDisk, batch) < 0) {
+        free(batch);
+        return NULL;
+    }
+    return batch;
+}
+
+/* Starts reading count blocks into their buffers and returns at once.
+Blocks in the cache are copied before it returns; every run of
+consecutive blocks that is not becomes one readv, and all of them are in
+flight together, on io_uring where the kernel has it and on a pool of
+DISK_ASYNC_THREADS workers otherwise. The buffers belong to the batch
+until waitDiskBatch returns; the ios array can be reused at once. Returns
+NULL if nothing could be submitted. */
+DiskBatch *readBlocksAsync(int disk, BlockIO *ios, int count) {
+    return submitBlocks(disk, ios, count, 0);
+}
+
+/* Starts writing count blocks from their buffers, as readBlocksAsync does
+for reads. Cached copies take the new contents at submission. Where a
+block appears more than once the last request wins. */
+DiskBatch *writeBlocksAsync(int disk, BlockIO *ios, int count) {
+    return submitBlocks(disk, ios, count, 1);
+}
+
+/* Returns 1 once every transfer of batch has finished, 0 while some are
+still in flight. Never blocks; completions waiting on the ring are
+collected on the way. */
+int pollDiskBatch(DiskBatch *batch) {
+    pthread_mutex_lock(&asyncLock);
+    if (batch->pending > 0 && ringState == ASYNC_RING && !ring.reaping) {
+        reapRing();
+    }
+    int done = (batch->pending == 0);
+    pthread_mutex_unlock(&asyncLock);
+    return done;
+}
+
+/* Drops the cached copies of the blocks of a failed write batch. They took
+the new contents at submission, which the image may never have received,
+so they are read from the image again. Copies dirtied since hold a later
+write and are kept. */
+static void dropWrittenFrames(DiskBatch *batch) {
+    Disk *disk = batch->disk;
+    pthread_mutex_lock(&disk->lock);
+    BlockCache *cache = disk->cache;
+    for (int r = 0; cache != NULL && r < batch->nRuns; r++) {
+        DiskRun *run = &batch->runs[r];
+        for (int b = run->firstBlock; b < run->firstBlock + run->nBlocks; b++) {
+            int frame = cacheLookup(cache, b);
+            if (frame != -1 && !cache->frames[frame].dirty) {
+                cacheUnhash(cache, frame);
+                cache->frames[frame].bNum = -1;
             }
-            return 0;
         }
-        currentDisk = currentDisk->next;
     }
+    pthread_mutex_unlock(&disk->lock);
+}
 
-    printf("The specified disk was not found. (LibDisk.c)\n");
-    return -1;
+/* Waits for every transfer of batch to finish and frees it. Returns 0 if
+they all succeeded, -1 otherwise. */
+int waitDiskBatch(DiskBatch *batch) {
+    if (batch == NULL) {
+        return -1;
+    }
+    if (batch->nRuns > 0) {
+        pthread_mutex_lock(&asyncLock);
+        waitForRuns(batch);
+        pthread_mutex_unlock(&asyncLock);
+    }
+    if (batch->failed && batch->disk != NULL) {
+        dropWrittenFrames(batch);
+    }
+    int failed = batch->failed;
+    free(batch);
+    return failed ? -1 : 0;
+}
+
+static int transferBlocks(int disk, BlockIO *ios, int count, int write) {
+    Disk *currentDisk = findDisk(disk);
+
+    if (currentDisk == NULL) {
+        return -1;
+    }
+    if (count <= 0) {
+        return count == 0 ? 0 : -1;
+    }
+    DiskBatch *batch = prepareBatch(currentDisk, ios, count, write);
+    if (batch == NULL) {
+        return -1;
+    }
+
+    // A single run goes straight to preadv/pwritev; several are submitted
+    // together so they are all in flight at once
+    int success = 0;
+    if (batch->nRuns == 1) {
+        success = rawTransferVector(currentDisk->fd, batch->runs[0].offset, batch->runs[0].iov, batch->runs[0].iovCount, write);
+        batch->failed = (success < 0);
+        batch->pending = 0;
+    } else if (batch->nRuns > 1 && submitRuns(currentDisk, batch) < 0) {
+        free(batch);
+        return -1;
+    }
+    if (waitDiskBatch(batch) < 0) {
+        success = -1;
+    }
+    return success;
+}
+
+/* Reads count blocks, each into its own buffer. Requests are sorted by
+block number and every run of consecutive blocks is fetched with a single
+preadv, so callers can hand over a whole file's worth of blocks at once.
+When there are several runs they are all in flight together, as with
+readBlocksAsync. */
+int readBlocks(int disk, BlockIO *ios, int count) {
+    return transferBlocks(disk, ios, count, 0);
+}
+
+/* Writes count blocks from their own buffers, merging runs of consecutive
+block numbers into single pwritev calls, all in flight together. The
+writes bypass the block cache; cached copies are refreshed. */
+int writeBlocks(int disk, BlockIO *ios, int count) {
+    return transferBlocks(disk, ios, count, 1);
 }
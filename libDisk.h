@@ -1,22 +1,93 @@
 #ifndef libDisk_h
 #define libDisk_h
+/* Block size of every newly opened disk. Use setDiskBlockSize to change
+it for an open disk. */
 #define BLOCKSIZE 256
+/* Number of cached blocks given to every newly opened disk. Use
+setDiskCacheSize to resize or disable the cache of an open disk. */
+#define DEFAULT_CACHE_FRAMES 64
+/* openDiskWithFlags flag: memory-map the whole image instead of using
+pread/pwrite through the block cache */
+#define DISK_MMAP 0x1
+/* openDiskWithFlags flag: run asynchronous transfers on the worker thread
+pool even where the kernel supports io_uring */
+#define DISK_THREAD_POOL 0x2
+/* Most buffers merged into one preadv/pwritev by readBlocks/writeBlocks */
+#define DISK_MAX_IOV 1024
+/* Disk numbers carry a table slot in their low bits and a generation count
+above it, so numbers of closed disks are detected instead of aliasing a
+newer disk in the same slot. */
+#define DISK_SLOT_BITS 16
+#define DISK_SLOT_MASK ((1 << DISK_SLOT_BITS) - 1)
+#define MAX_DISKS (1 << DISK_SLOT_BITS)
+#define DISK_MAX_GENERATION 0x7fff
+/* Submission queue entries of the io_uring shared by all disks for
+asynchronous transfers, and worker threads of the fallback pool */
+#define DISK_RING_ENTRIES 256
+#define DISK_ASYNC_THREADS 4
 #include <stdio.h>
 
-typedef struct Disk Disk;
-struct Disk {
-    int diskNumber;
-    int nBytes;
-    char *filename;
-    Disk *next;
-    FILE *filePointer;
-};
+typedef struct DiskCacheStats {
+    int nFrames;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks;
+} DiskCacheStats;
+
+/* Process-wide counts of the transfers every disk makes against its
+image, kept unless libDisk is built with TFS_NO_STATS. Blocks are counted
+as they are sent to or fetched from the image, including through a
+mapping, but not when served by the cache. Bytes count what each
+system call moved. syscalls and syscallNanos cover pread/pwrite,
+preadv/pwritev, io_uring_enter and msync. */
+typedef struct DiskIOStats {
+    unsigned long blockReads;
+    unsigned long blockWrites;
+    unsigned long bytesRead;
+    unsigned long bytesWritten;
+    unsigned long syscalls;
+    unsigned long syscallNanos;
+} DiskIOStats;
+
+/* One request for readBlocks/writeBlocks: block bNum and its buffer of
+one block */
+typedef struct BlockIO {
+    int bNum;
+    void *block;
+} BlockIO;
 
-extern int diskCounter;
-extern Disk *diskListHead;
+/* Blocks submitted together by readBlocksAsync or writeBlocksAsync, until
+waitDiskBatch reaps them */
+typedef struct DiskBatch DiskBatch;
+
+/* An open disk. Every libDisk call is thread-safe: lock guards the block
+cache and its counters, while the reads and writes themselves run outside
+it, so threads working on different blocks overlap their I/O. Calls on
+the same block from different threads have no defined order; callers
+serialize those themselves. The structure, its lock and its cache are
+private to libDisk.c. */
+typedef struct Disk Disk;
 
 int openDisk(char *filename, int nBytes);
+int openDiskWithFlags(char *filename, int nBytes, int flags);
 int closeDisk(int disk);
 int readBlock(int disk, int bNum, void *block);
 int writeBlock(int disk, int bNum, void *block);
+int readBlockRange(int disk, int bNum, int nBlocks, void *blocks);
+int writeBlockRange(int disk, int bNum, int nBlocks, void *blocks);
+int readBlocks(int disk, BlockIO *ios, int count);
+int writeBlocks(int disk, BlockIO *ios, int count);
+DiskBatch *readBlocksAsync(int disk, BlockIO *ios, int count);
+DiskBatch *writeBlocksAsync(int disk, BlockIO *ios, int count);
+int pollDiskBatch(DiskBatch *batch);
+int waitDiskBatch(DiskBatch *batch);
+int flushDisk(int disk);
+int setDiskCacheSize(int disk, int nFrames);
+int setDiskBlockSize(int disk, int blockSize);
+int getDiskBlockCount(int disk);
+int getDiskCacheStats(int disk, DiskCacheStats *stats);
+int getDiskIOStats(DiskIOStats *stats);
+int resetDiskIOStats(void);
+const void *getBlockPointer(int disk, int bNum);
 #endif
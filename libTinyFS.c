@@ -1,3 +1,4 @@
+#define _DEFAULT_SOURCE
 #include "libTinyFS.h"
 #include "libDisk.h"
 #include "tinyFS_errno.h"
@@ -6,10 +7,1005 @@
 #include <string.h>
 #include <stdint.h>
 #include <time.h> 
+#include <pthread.h>
+
+/* An open file. The cursor remembers the last data block visited in the
+chain (cursorBlock, 0 when unset), its position in the chain (cursorIndex)
+and a copy of its contents, so reads continue from there instead of
+walking the chain from the inode again. Extent files need no walk and only
+use it to keep the last block read. On lazy-atime mounts accessTime holds
+the last access not yet written to the inode (0 when none).
+A file has at most one open entry, so lock is the file's reader/writer
+lock: reads hold it shared and anything that changes the inode or data
+holds it exclusively. cursorLock guards the file pointer, the cursor and
+accessTime, which concurrent readers share. */
+struct fileDescriptorTableEntry {
+    int inodeNumber;
+    int filePointer;
+    int cursorBlock;
+    int cursorIndex;
+    char *cursorData;
+    int64_t accessTime;
+    pthread_rwlock_t lock;
+    pthread_mutex_t cursorLock;
+};
+
+/* One mounted file system, declared opaque in libTinyFS.h.
+namespaceLock guards the name index, the inode list and the open file
+table: opening, closing, deleting and renaming hold it exclusively,
+tfs_readdir and tfs_sync shared. allocLock guards the super block, the
+bitmap, the free list and the zero-pending set for the short time an
+allocation or free takes. Locks are taken in
+the order namespaceLock, file lock, allocLock. Reads and writes of a file
+take only its own lock, so threads on different files run in parallel. A
+descriptor must not be closed or deleted while another thread still uses
+it.
+blockSize and the sizes derived from it are the block geometry of the
+image, set by tfs_fsMount from its super block.
+cleanOnDisk is set while the image on disk still carries the clean flag
+it was mounted with; cleanSuper is its super block as read at mount.
+stateLock guards both and is taken after every other lock. */
+struct tfs_fs {
+    int disk;
+    int mountFlags;
+    int blockSize;
+    int dataSize;
+    int directExtents;
+    int maxExtents;
+    pthread_rwlock_t namespaceLock;
+    pthread_mutex_t allocLock;
+    pthread_mutex_t stateLock;
+    int cleanOnDisk;
+    superBlockInfo cleanSuper;
+    superBlockInfo superBlock;
+    fileDescriptorTableEntry **fileDescriptorTable;
+    nameIndex fileNameIndex;
+    blockBitmap freeBitmap;
+    zeroPendingSet zeroPending;
+    inodeLinkMap inodeLinks;
+};
+
+/* File system mounted through the single-mount API (tfs_mount and the
+functions without a tfs_fs argument), or NULL */
+tfs_fs *defaultFs = NULL;
+
+/* Allocates an open file table entry for the inode in the lowest free
+slot, with the file pointer at the start and no chain cursor yet. Returns
+the new file descriptor. */
+int addFileDescriptorEntry(tfs_fs *fs, int inodeNumber) {
+    int currentFileDescriptor = 0;
+    while (currentFileDescriptor < fs->superBlock.maxNumberOfFiles && fs->fileDescriptorTable[currentFileDescriptor] != NULL) {
+        currentFileDescriptor++;
+    }
+    if (currentFileDescriptor == fs->superBlock.maxNumberOfFiles) {
+        printf("Open file table is full\n");
+        return FILE_OPEN_ERROR;
+    }
+
+    fileDescriptorTableEntry *newEntry = (fileDescriptorTableEntry *)malloc(sizeof(fileDescriptorTableEntry));
+    char *cursorData = (char *)malloc(fs->blockSize);
+    if (newEntry == NULL || cursorData == NULL) {
+        free(newEntry);
+        free(cursorData);
+        printf("Could not allocate memory for new open file table entry\n");
+        return FILE_OPEN_ERROR;
+    }
+    newEntry->inodeNumber = inodeNumber;
+    newEntry->filePointer = 0;
+    newEntry->cursorBlock = 0;
+    newEntry->cursorIndex = 0;
+    newEntry->cursorData = cursorData;
+    newEntry->accessTime = 0;
+    pthread_rwlock_init(&newEntry->lock, NULL);
+    pthread_mutex_init(&newEntry->cursorLock, NULL);
+    fs->fileDescriptorTable[currentFileDescriptor] = newEntry;
+    return currentFileDescriptor;
+}
+
+void freeFileDescriptorEntry(tfs_fs *fs, fileDescriptor fileDescriptor) {
+    pthread_rwlock_destroy(&fs->fileDescriptorTable[fileDescriptor]->lock);
+    pthread_mutex_destroy(&fs->fileDescriptorTable[fileDescriptor]->cursorLock);
+    free(fs->fileDescriptorTable[fileDescriptor]->cursorData);
+    free(fs->fileDescriptorTable[fileDescriptor]);
+    fs->fileDescriptorTable[fileDescriptor] = NULL;
+}
+
+/* Returns the descriptor of the open file whose inode is inodeNumber, or
+-1 if it is not open */
+int findOpenFile(tfs_fs *fs, int inodeNumber) {
+    for (int i = 0; i < fs->superBlock.maxNumberOfFiles; i++) {
+        if (fs->fileDescriptorTable[i] != NULL && fs->fileDescriptorTable[i]->inodeNumber == inodeNumber) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Takes the lock of open file fileDescriptor, exclusively or shared, and
+returns its entry. Returns NULL without locking anything when the
+descriptor is out of range or not open; the caller reports the error, as
+the *Locked bodies all assume an open descriptor. */
+fileDescriptorTableEntry *lockFile(tfs_fs *fs, fileDescriptor fileDescriptor, int exclusive) {
+    if (fileDescriptor < 0 || fileDescriptor >= fs->superBlock.maxNumberOfFiles) {
+        return NULL;
+    }
+    fileDescriptorTableEntry *entry = fs->fileDescriptorTable[fileDescriptor];
+    if (entry != NULL) {
+        if (exclusive) {
+            pthread_rwlock_wrlock(&entry->lock);
+        } else {
+            pthread_rwlock_rdlock(&entry->lock);
+        }
+    }
+    return entry;
+}
+
+void unlockFile(fileDescriptorTableEntry *entry) {
+    if (entry != NULL) {
+        pthread_rwlock_unlock(&entry->lock);
+    }
+}
+
+void packSuperBlock(superBlockInfo *info, char *superData) {
+    memset(superData, 0, info->blockSize);
+    superData[BLOCK_NUMBER_OFFSET] = SUPER_BLOCK_TYPE;
+    superData[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+    memcpy(superData + FB_OFFSET, &info->freeBlockHead, sizeof(int));
+    memcpy(superData + IB_OFFSET, &info->inodeHead, sizeof(int));
+    memcpy(superData + SUPER_MAX_NUM_FILES_OFFSET, &info->maxNumberOfFiles, sizeof(int));
+    memcpy(superData + SUPER_VERSION_OFFSET, &info->version, sizeof(int));
+    memcpy(superData + SUPER_TOTAL_BLOCKS_OFFSET, &info->totalBlocks, sizeof(int));
+    memcpy(superData + SUPER_BITMAP_START_OFFSET, &info->bitmapStart, sizeof(int));
+    memcpy(superData + SUPER_BITMAP_BLOCKS_OFFSET, &info->bitmapBlocks, sizeof(int));
+    if (info->version >= FORMAT_BLOCK_SIZE) {
+        memcpy(superData + SUPER_BLOCK_SIZE_OFFSET, &info->blockSize, sizeof(int));
+    }
+    if (info->version >= FORMAT_CLEAN_FLAG) {
+        superData[SUPER_STATE_OFFSET] = (char)info->clean;
+    }
+}
+
+void unpackSuperBlock(char *superData, superBlockInfo *info) {
+    memcpy(&info->freeBlockHead, superData + FB_OFFSET, sizeof(int));
+    memcpy(&info->inodeHead, superData + IB_OFFSET, sizeof(int));
+    memcpy(&info->maxNumberOfFiles, superData + SUPER_MAX_NUM_FILES_OFFSET, sizeof(int));
+    memcpy(&info->version, superData + SUPER_VERSION_OFFSET, sizeof(int));
+    memcpy(&info->totalBlocks, superData + SUPER_TOTAL_BLOCKS_OFFSET, sizeof(int));
+    memcpy(&info->bitmapStart, superData + SUPER_BITMAP_START_OFFSET, sizeof(int));
+    memcpy(&info->bitmapBlocks, superData + SUPER_BITMAP_BLOCKS_OFFSET, sizeof(int));
+    info->blockSize = BLOCKSIZE;
+    if (info->version >= FORMAT_BLOCK_SIZE) {
+        memcpy(&info->blockSize, superData + SUPER_BLOCK_SIZE_OFFSET, sizeof(int));
+    }
+    info->clean = 0;
+    if (info->version >= FORMAT_CLEAN_FLAG) {
+        info->clean = (superData[SUPER_STATE_OFFSET] == 1);
+    }
+    info->dirty = 0;
+}
+
+/* Clears the clean flag on disk before the first write of a mount that
+found the image clean, so a crash from then on leaves it marked dirty.
+Nothing has been written since mount, so the super block read then is
+still what the image holds; it goes straight to the image with the flag
+cleared, ahead of any block waiting in the cache. */
+int markFsDirty(tfs_fs *fs) {
+    int success = 1;
+    pthread_mutex_lock(&fs->stateLock);
+    if (fs->cleanOnDisk) {
+        char *superData = (char *)malloc(fs->blockSize);
+        if (superData == NULL) {
+            pthread_mutex_unlock(&fs->stateLock);
+            return MEM_ALLOC_FAILURE;
+        }
+        fs->cleanSuper.clean = 0;
+        packSuperBlock(&fs->cleanSuper, superData);
+        if (writeBlockRange(fs->disk, SUPER_BLOCK, 1, superData) < 0) {
+            printf("Issue with super block write when marking the disk dirty\n");
+            success = FILE_WRITE_ERROR;
+        } else {
+            fs->cleanOnDisk = 0;
+        }
+        free(superData);
+    }
+    pthread_mutex_unlock(&fs->stateLock);
+    return success;
+}
+
+/* writeBlock and writeBlocks for the mounted image: every write of a
+mount goes through these so the clean flag is cleared first */
+int fsWriteBlock(tfs_fs *fs, int bNum, void *block) {
+    if (markFsDirty(fs) < 0) {
+        return -1;
+    }
+    return writeBlock(fs->disk, bNum, block);
+}
+
+int fsWriteBlocks(tfs_fs *fs, BlockIO *ios, int count) {
+    if (markFsDirty(fs) < 0) {
+        return -1;
+    }
+    return writeBlocks(fs->disk, ios, count);
+}
+
+/* Writes the pinned super block back to block 0 if it changed since the
+last write-back. */
+int syncSuperBlock(tfs_fs *fs) {
+    if (!fs->superBlock.dirty) {
+        return 1;
+    }
+    char *superData = (char *)malloc(fs->blockSize);
+    if (superData == NULL) {
+        return MEM_ALLOC_FAILURE;
+    }
+    packSuperBlock(&fs->superBlock, superData);
+    int success = fsWriteBlock(fs, SUPER_BLOCK, superData);
+    free(superData);
+    if (success < 0) {
+        printf("Issue with super block write\n");
+        return FILE_WRITE_ERROR;
+    }
+    fs->superBlock.dirty = 0;
+    return 1;
+}
+
+/* FNV-1a hash of a file name */
+unsigned int hashName(const char *name) {
+    unsigned int hash = 2166136261u;
+    while (*name != '\0') {
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    }
+    return hash;
+}
+
+int initNameIndex(tfs_fs *fs, int nBuckets) {
+    fs->fileNameIndex.buckets = (nameIndexEntry **)calloc(nBuckets, sizeof(nameIndexEntry *));
+    if (fs->fileNameIndex.buckets == NULL) {
+        return MEM_ALLOC_FAILURE;
+    }
+    fs->fileNameIndex.nBuckets = nBuckets;
+    fs->fileNameIndex.count = 0;
+    return 1;
+}
+
+void freeNameIndex(tfs_fs *fs) {
+    for (int i = 0; i < fs->fileNameIndex.nBuckets; i++) {
+        nameIndexEntry *entry = fs->fileNameIndex.buckets[i];
+        while (entry != NULL) {
+            nameIndexEntry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(fs->fileNameIndex.buckets);
+    fs->fileNameIndex.buckets = NULL;
+    fs->fileNameIndex.nBuckets = 0;
+    fs->fileNameIndex.count = 0;
+}
+
+/* Returns the inode block of the named file, or 0 if there is none */
+int lookupName(tfs_fs *fs, const char *name) {
+    nameIndexEntry *entry = fs->fileNameIndex.buckets[hashName(name) % fs->fileNameIndex.nBuckets];
+    while (entry != NULL) {
+        if (strcmp(entry->name, name) == 0) {
+            return entry->inodeNumber;
+        }
+        entry = entry->next;
+    }
+    return 0;
+}
+
+/* Doubles the bucket array, rehashing every entry into it */
+void growNameIndex(tfs_fs *fs) {
+    int nBuckets = fs->fileNameIndex.nBuckets * 2;
+    nameIndexEntry **buckets = (nameIndexEntry **)calloc(nBuckets, sizeof(nameIndexEntry *));
+    if (buckets == NULL) {
+        return; // Keep the current buckets; lookups still work, just slower
+    }
+    for (int i = 0; i < fs->fileNameIndex.nBuckets; i++) {
+        nameIndexEntry *entry = fs->fileNameIndex.buckets[i];
+        while (entry != NULL) {
+            nameIndexEntry *next = entry->next;
+            unsigned int bucket = hashName(entry->name) % nBuckets;
+            entry->next = buckets[bucket];
+            buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+    free(fs->fileNameIndex.buckets);
+    fs->fileNameIndex.buckets = buckets;
+    fs->fileNameIndex.nBuckets = nBuckets;
+}
+
+/* Adds a name to the index. Names are expected to be unique; the caller
+checks with lookupName first. */
+int insertName(tfs_fs *fs, const char *name, int inodeNumber) {
+    nameIndexEntry *entry = (nameIndexEntry *)malloc(sizeof(nameIndexEntry));
+    if (entry == NULL) {
+        return MEM_ALLOC_FAILURE;
+    }
+    memset(entry->name, 0, MAX_FILE_NAME_SIZE);
+    strncpy(entry->name, name, MAX_FILE_NAME_SIZE - 1);
+    entry->inodeNumber = inodeNumber;
+
+    if (fs->fileNameIndex.count >= fs->fileNameIndex.nBuckets) {
+        growNameIndex(fs);
+    }
+    unsigned int bucket = hashName(entry->name) % fs->fileNameIndex.nBuckets;
+    entry->next = fs->fileNameIndex.buckets[bucket];
+    fs->fileNameIndex.buckets[bucket] = entry;
+    fs->fileNameIndex.count++;
+    return 1;
+}
+
+/* Removes a name from the index if it maps to the given inode */
+void removeName(tfs_fs *fs, const char *name, int inodeNumber) {
+    nameIndexEntry **link = &fs->fileNameIndex.buckets[hashName(name) % fs->fileNameIndex.nBuckets];
+    while (*link != NULL) {
+        if ((*link)->inodeNumber == inodeNumber && strcmp((*link)->name, name) == 0) {
+            nameIndexEntry *entry = *link;
+            *link = entry->next;
+            free(entry);
+            fs->fileNameIndex.count--;
+            return;
+        }
+        link = &(*link)->next;
+    }
+}
+
+/* Records prev as the inode before inode in the inode list, growing the
+map to cover the inode's block number if needed */
+int setInodePrev(tfs_fs *fs, int inode, int prev) {
+    if (inode >= fs->inodeLinks.nSlots) {
+        int nSlots = (fs->inodeLinks.nSlots > 0) ? fs->inodeLinks.nSlots : 256;
+        while (nSlots <= inode) {
+            nSlots *= 2;
+        }
+        int *slots = (int *)realloc(fs->inodeLinks.prev, nSlots * sizeof(int));
+        if (slots == NULL) {
+            return MEM_ALLOC_FAILURE;
+        }
+        memset(slots + fs->inodeLinks.nSlots, 0, (nSlots - fs->inodeLinks.nSlots) * sizeof(int));
+        fs->inodeLinks.prev = slots;
+        fs->inodeLinks.nSlots = nSlots;
+    }
+    fs->inodeLinks.prev[inode] = prev;
+    return 1;
+}
+
+void releaseInodeLinks(tfs_fs *fs) {
+    free(fs->inodeLinks.prev);
+    fs->inodeLinks.prev = NULL;
+    fs->inodeLinks.nSlots = 0;
+}
+
+/* Builds the name index and the inode predecessor map from one walk of
+the inode list. If an image holds the same name twice, the inode nearer
+the list head wins, which is the one a walk of the list would have
+found. A list that loops, runs longer than the disk or reaches a block
+that is not an inode fails with FS_MOUNT_ERROR. */
+int buildNameIndex(tfs_fs *fs) {
+    if (initNameIndex(fs, NAME_INDEX_MIN_BUCKETS) < 0) {
+        return MEM_ALLOC_FAILURE;
+    }
+    char *inodeBuffer = (char *)malloc(fs->blockSize);
+    if (inodeBuffer == NULL) {
+        freeNameIndex(fs);
+        return MEM_ALLOC_FAILURE;
+    }
+    char fileName[MAX_FILE_NAME_SIZE];
+    int inodePrevious = 0;
+    int inodeCurrent = fs->superBlock.inodeHead;
+    int stepsLeft = getDiskBlockCount(fs->disk);
+    while (inodeCurrent != 0) {
+        // Every inode already walked has a predecessor recorded, except the
+        // head, so meeting one again means the list loops
+        int seen = (inodePrevious != 0 && inodeCurrent == fs->superBlock.inodeHead) ||
+                   (inodeCurrent > 0 && inodeCurrent < fs->inodeLinks.nSlots && fs->inodeLinks.prev[inodeCurrent] != 0);
+        if (seen || stepsLeft-- <= 0) {
+            printf("The inode list loops back to block %d\n", inodeCurrent);
+            free(inodeBuffer);
+            freeNameIndex(fs);
+            releaseInodeLinks(fs);
+            return FS_MOUNT_ERROR;
+        }
+        if (readBlock(fs->disk, inodeCurrent, inodeBuffer) < 0) {
+            printf("Invalid pointer to inode block\n");
+            free(inodeBuffer);
+            freeNameIndex(fs);
+            releaseInodeLinks(fs);
+            return FILE_READ_ERROR;
+        }
+        if (inodeBuffer[BLOCK_NUMBER_OFFSET] != INODE_BLOCK_TYPE) {
+            printf("Block %d in the inode list is not an inode\n", inodeCurrent);
+            free(inodeBuffer);
+            freeNameIndex(fs);
+            releaseInodeLinks(fs);
+            return FS_MOUNT_ERROR;
+        }
+        memcpy(fileName, inodeBuffer + INODE_FILE_NAME_OFFSET, MAX_FILE_NAME_SIZE);
+        fileName[MAX_FILE_NAME_SIZE - 1] = '\0';
+        if ((lookupName(fs, fileName) == 0 && insertName(fs, fileName, inodeCurrent) < 0) ||
+            setInodePrev(fs, inodeCurrent, inodePrevious) < 0) {
+            free(inodeBuffer);
+            freeNameIndex(fs);
+            releaseInodeLinks(fs);
+            return MEM_ALLOC_FAILURE;
+        }
+        inodePrevious = inodeCurrent;
+        memcpy(&inodeCurrent, inodeBuffer + INODE_NEXT_INODE_OFFSET, sizeof(int));
+    }
+    free(inodeBuffer);
+    return 1;
+}
 
-fileDescriptorTableEntry **fileDescriptorTable = NULL;
-int activeDisk = 0;
-int maxNumberOfFiles = 0;
+/* Number of blockSize-byte bitmap blocks needed to track nBlocks blocks */
+int bitmapBlocksFor(int nBlocks, int blockSize) {
+    int bytes = (nBlocks + 7) / 8;
+    return (bytes + BITMAP_BYTES_PER_BLOCK(blockSize) - 1) / BITMAP_BYTES_PER_BLOCK(blockSize);
+}
+
+/* Sets up an all-used bitmap for nBlocks blocks, kept in blockSize-byte
+bitmap blocks. The word array is sized to whole bitmap blocks so packing a
+block never reads past its end. */
+int initBitmap(blockBitmap *map, int nBlocks, int blockSize) {
+    int mapBlocks = bitmapBlocksFor(nBlocks, blockSize);
+    int allocatedWords = ((size_t)mapBlocks * BITMAP_BYTES_PER_BLOCK(blockSize) + 7) / 8;
+    map->bytesPerBlock = BITMAP_BYTES_PER_BLOCK(blockSize);
+    map->nWords = (nBlocks + 63) / 64;
+    map->hint = 0;
+    map->words = (uint64_t *)calloc(allocatedWords, sizeof(uint64_t));
+    map->dirty = (char *)calloc(mapBlocks, sizeof(char));
+    if (map->words == NULL || map->dirty == NULL) {
+        free(map->words);
+        free(map->dirty);
+        map->words = NULL;
+        map->dirty = NULL;
+        return MEM_ALLOC_FAILURE;
+    }
+    return 1;
+}
+
+void releaseBitmap(blockBitmap *map) {
+    free(map->words);
+    free(map->dirty);
+    map->words = NULL;
+    map->dirty = NULL;
+    map->nWords = 0;
+}
+
+void setBlockFree(blockBitmap *map, int blockNum, int isFree) {
+    uint64_t mask = (uint64_t)1 << (blockNum & 63);
+    if (isFree) {
+        map->words[blockNum >> 6] |= mask;
+    } else {
+        map->words[blockNum >> 6] &= ~mask;
+    }
+    map->dirty[(blockNum / 8) / map->bytesPerBlock] = 1;
+}
+
+/* Marks blocks first up to (not including) end free, whole words at a time
+where it can */
+void setBlockRangeFree(blockBitmap *map, int first, int end) {
+    while (first < end && (first & 63) != 0) {
+        setBlockFree(map, first++, 1);
+    }
+    while (end - first >= 64) {
+        map->words[first >> 6] = ~(uint64_t)0;
+        map->dirty[(first / 8) / map->bytesPerBlock] = 1;
+        first += 64;
+    }
+    while (first < end) {
+        setBlockFree(map, first++, 1);
+    }
+}
+
+/* Builds the on-disk image of bitmap block index (0 for the first block
+of the region) */
+void packBitmapBlock(blockBitmap *map, int index, char *data) {
+    memset(data, 0, BITMAP_DATA_OFFSET);
+    data[BLOCK_NUMBER_OFFSET] = BITMAP_BLOCK_TYPE;
+    data[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+    memcpy(data + BITMAP_DATA_OFFSET, (char *)map->words + (size_t)index * map->bytesPerBlock, map->bytesPerBlock);
+}
+
+/* Reads the bitmap region of the mounted image into fs->freeBitmap */
+int loadBitmap(tfs_fs *fs) {
+    if (initBitmap(&fs->freeBitmap, fs->superBlock.totalBlocks, fs->blockSize) < 0) {
+        return MEM_ALLOC_FAILURE;
+    }
+    char *mapData = (char *)malloc((size_t)fs->superBlock.bitmapBlocks * fs->blockSize);
+    if (mapData == NULL) {
+        releaseBitmap(&fs->freeBitmap);
+        return MEM_ALLOC_FAILURE;
+    }
+    if (readBlockRange(fs->disk, fs->superBlock.bitmapStart, fs->superBlock.bitmapBlocks, mapData) < 0) {
+        free(mapData);
+        releaseBitmap(&fs->freeBitmap);
+        return FILE_READ_ERROR;
+    }
+    for (int i = 0; i < fs->superBlock.bitmapBlocks; i++) {
+        char *data = mapData + (size_t)i * fs->blockSize;
+        if (data[BLOCK_NUMBER_OFFSET] != BITMAP_BLOCK_TYPE || data[MAGIC_NUMBER_OFFSET] != MAGIC_NUMBER) {
+            printf("Invalid bitmap block %d\n", fs->superBlock.bitmapStart + i);
+            free(mapData);
+            releaseBitmap(&fs->freeBitmap);
+            return FILE_READ_ERROR;
+        }
+        memcpy((char *)fs->freeBitmap.words + (size_t)i * fs->freeBitmap.bytesPerBlock, data + BITMAP_DATA_OFFSET, fs->freeBitmap.bytesPerBlock);
+    }
+    free(mapData);
+
+    // Bits past the last block must read as used so scans never return them
+    if (fs->superBlock.totalBlocks & 63) {
+        fs->freeBitmap.words[fs->freeBitmap.nWords - 1] &= ((uint64_t)1 << (fs->superBlock.totalBlocks & 63)) - 1;
+    }
+    fs->freeBitmap.hint = fs->superBlock.bitmapStart + fs->superBlock.bitmapBlocks;
+    return 1;
+}
+
+/* Writes back every bitmap block changed since the last write-back */
+int syncBitmap(tfs_fs *fs) {
+    if (fs->superBlock.version < FORMAT_BITMAP) {
+        return 1;
+    }
+    int count = 0;
+    for (int i = 0; i < fs->superBlock.bitmapBlocks; i++) {
+        count += fs->freeBitmap.dirty[i];
+    }
+    if (count == 0) {
+        return 1;
+    }
+
+    char *mapData = (char *)malloc((size_t)count * fs->blockSize);
+    BlockIO *ios = (BlockIO *)malloc(count * sizeof(BlockIO));
+    if (mapData == NULL || ios == NULL) {
+        free(mapData);
+        free(ios);
+        return MEM_ALLOC_FAILURE;
+    }
+    int n = 0;
+    for (int i = 0; i < fs->superBlock.bitmapBlocks; i++) {
+        if (fs->freeBitmap.dirty[i]) {
+            ios[n].bNum = fs->superBlock.bitmapStart + i;
+            ios[n].block = mapData + (size_t)n * fs->blockSize;
+            packBitmapBlock(&fs->freeBitmap, i, ios[n].block);
+            n++;
+        }
+    }
+    int success = fsWriteBlocks(fs, ios, count);
+    free(mapData);
+    free(ios);
+    if (success < 0) {
+        printf("Issue with bitmap block write\n");
+        return FILE_WRITE_ERROR;
+    }
+    memset(fs->freeBitmap.dirty, 0, fs->superBlock.bitmapBlocks);
+    return 1;
+}
+
+/* Writes back the pinned super block and free-space bitmap */
+int syncMetadata(tfs_fs *fs) {
+    int success = syncSuperBlock(fs);
+    if (success < 0) {
+        return success;
+    }
+    return syncBitmap(fs);
+}
+
+/* Returns the first block at or after from that is free (wantFree = 1) or
+in use (wantFree = 0), or totalBlocks if there is none. Whole words that
+cannot match are skipped, and the match inside a word is found with a
+count-trailing-zeros instruction. */
+int scanBitmap(tfs_fs *fs, int from, int wantFree) {
+    int totalBlocks = fs->superBlock.totalBlocks;
+    if (from >= totalBlocks) {
+        return totalBlocks;
+    }
+    uint64_t flip = wantFree ? 0 : ~(uint64_t)0;
+    int w = from >> 6;
+    uint64_t word = (fs->freeBitmap.words[w] ^ flip) & (~(uint64_t)0 << (from & 63));
+    while (word == 0) {
+        if (++w >= fs->freeBitmap.nWords) {
+            return totalBlocks;
+        }
+        word = fs->freeBitmap.words[w] ^ flip;
+    }
+    int blockNum = (w << 6) + __builtin_ctzll(word);
+    return blockNum < totalBlocks ? blockNum : totalBlocks;
+}
+
+/* Allocates one run of contiguous blocks from the bitmap, searching from
+where the last allocation ended and wrapping around. The first free run
+of at least minimum blocks is used, otherwise the longest one. At most
+wanted blocks are taken. Returns the run length (0 when the disk is full)
+and its first block in *start. */
+int allocateRun(tfs_fs *fs, int wanted, int minimum, int *start) {
+    int best = 0;
+    int bestStart = 0;
+    for (int pass = 0; pass < 2 && best < minimum; pass++) {
+        int blockNum = (pass == 0) ? fs->freeBitmap.hint : 0;
+        int end = (pass == 0) ? fs->superBlock.totalBlocks : fs->freeBitmap.hint;
+        while (blockNum < end) {
+            int first = scanBitmap(fs, blockNum, 1);
+            if (first >= end) {
+                break;
+            }
+            int last = scanBitmap(fs, first, 0);
+            if (last - first > best) {
+                best = last - first;
+                bestStart = first;
+            }
+            if (best >= minimum) {
+                break;
+            }
+            blockNum = last;
+        }
+    }
+
+    if (best > wanted) {
+        best = wanted;
+    }
+    for (int i = 0; i < best; i++) {
+        setBlockFree(&fs->freeBitmap, bestStart + i, 0);
+    }
+    if (best > 0) {
+        fs->freeBitmap.hint = bestStart + best;
+        *start = bestStart;
+    }
+    return best;
+}
+
+/* Records a freed block whose old contents are still on disk */
+void markZeroPending(tfs_fs *fs, int blockNum) {
+    int word = blockNum >> 6;
+    if (word >= fs->zeroPending.nWords) {
+        int nWords = (fs->zeroPending.nWords > 0) ? fs->zeroPending.nWords : 64;
+        while (nWords <= word) {
+            nWords *= 2;
+        }
+        uint64_t *words = (uint64_t *)realloc(fs->zeroPending.words, nWords * sizeof(uint64_t));
+        if (words == NULL) {
+            return; // The block is simply never zeroed
+        }
+        memset(words + fs->zeroPending.nWords, 0, (nWords - fs->zeroPending.nWords) * sizeof(uint64_t));
+        fs->zeroPending.words = words;
+        fs->zeroPending.nWords = nWords;
+    }
+    uint64_t mask = (uint64_t)1 << (blockNum & 63);
+    if (!(fs->zeroPending.words[word] & mask)) {
+        fs->zeroPending.words[word] |= mask;
+        fs->zeroPending.count++;
+    }
+}
+
+void clearZeroPending(tfs_fs *fs, int blockNum) {
+    int word = blockNum >> 6;
+    uint64_t mask = (uint64_t)1 << (blockNum & 63);
+    if (word < fs->zeroPending.nWords && (fs->zeroPending.words[word] & mask)) {
+        fs->zeroPending.words[word] &= ~mask;
+        fs->zeroPending.count--;
+    }
+}
+
+void releaseZeroPending(tfs_fs *fs) {
+    free(fs->zeroPending.words);
+    fs->zeroPending.words = NULL;
+    fs->zeroPending.nWords = 0;
+    fs->zeroPending.count = 0;
+}
+
+/* Allocates up to count blocks into blockNums. On bitmap images the
+blocks come in as few contiguous runs as the free space allows and no
+I/O is done; on free-list images each block is popped off the list, which
+reads it to find the next one. Returns the number of blocks allocated,
+less than count when the disk fills up. */
+int allocateBlocks(tfs_fs *fs, int count, int *blockNums) {
+    int allocated = 0;
+
+    if (fs->superBlock.version == FORMAT_FREE_LIST) {
+        char *freeBuffer = (char *)malloc(fs->blockSize);
+        if (freeBuffer == NULL) {
+            return MEM_ALLOC_FAILURE;
+        }
+        while (allocated < count && fs->superBlock.freeBlockHead != 0) {
+            if (readBlock(fs->disk, fs->superBlock.freeBlockHead, freeBuffer) < 0) {
+                printf("Invalid pointer to free block\n");
+                free(freeBuffer);
+                return FILE_READ_ERROR;
+            }
+            clearZeroPending(fs, fs->superBlock.freeBlockHead);
+            blockNums[allocated++] = fs->superBlock.freeBlockHead;
+            memcpy(&fs->superBlock.freeBlockHead, freeBuffer + FREE_NEXT_BLOCK_OFFSET, sizeof(int));
+            fs->superBlock.dirty = 1;
+        }
+        free(freeBuffer);
+        return allocated;
+    }
+
+    // Ask for the whole request as one run first; if the free space is too
+    // fragmented for that, fill the rest from whatever runs come next
+    int minimum = count;
+    while (allocated < count) {
+        int start;
+        int length = allocateRun(fs, count - allocated, minimum, &start);
+        if (length == 0) {
+            break;
+        }
+        for (int i = 0; i < length; i++) {
+            blockNums[allocated++] = start + i;
+        }
+        minimum = 1;
+    }
+    return allocated;
+}
+
+/* Returns count blocks to free space. On bitmap images only their bits
+are set, and the blocks wait for the lazy zeroing pass. On free-list
+images every block is rewritten as a free block pointing at the next
+one, the last pointing at the old free list head, all in one vectored
+write; then the pinned free list head moves. */
+int deallocateBlocks(tfs_fs *fs, int *blockNums, int count) {
+    if (count == 0) {
+        return 1;
+    }
+
+    if (fs->superBlock.version >= FORMAT_BITMAP) {
+        int firstDataBlock = fs->superBlock.bitmapStart + fs->superBlock.bitmapBlocks;
+        for (int i = 0; i < count; i++) {
+            if (blockNums[i] < firstDataBlock || blockNums[i] >= fs->superBlock.totalBlocks) {
+                printf("Block %d cannot be deallocated\n", blockNums[i]);
+                return DEALLOCATION_ERROR;
+            }
+        }
+        for (int i = 0; i < count; i++) {
+            setBlockFree(&fs->freeBitmap, blockNums[i], 1);
+            markZeroPending(fs, blockNums[i]);
+        }
+        return 1;
+    }
+
+    char *freeData = (char *)calloc(count, fs->blockSize);
+    BlockIO *ios = (BlockIO *)malloc(count * sizeof(BlockIO));
+    if (freeData == NULL || ios == NULL) {
+        free(freeData);
+        free(ios);
+        return MEM_ALLOC_FAILURE;
+    }
+
+    for (int i = 0; i < count; i++) {
+        char *data = freeData + (size_t)i * fs->blockSize;
+        int nextFree = (i + 1 < count) ? blockNums[i + 1] : fs->superBlock.freeBlockHead;
+        data[BLOCK_NUMBER_OFFSET] = FREE_BLOCK_TYPE;
+        data[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+        memcpy(data + FREE_NEXT_BLOCK_OFFSET, &nextFree, sizeof(int));
+        ios[i].bNum = blockNums[i];
+        ios[i].block = data;
+    }
+
+    int writeSuccess = fsWriteBlocks(fs, ios, count);
+    free(freeData);
+    free(ios);
+    if (writeSuccess < 0) {
+        printf("Issue with free block write when deallocating block\n");
+        return DEALLOCATION_ERROR;
+    }
+
+    fs->superBlock.freeBlockHead = blockNums[0];
+    fs->superBlock.dirty = 1;
+    return 1;
+}
+
+int deallocateBlock(tfs_fs *fs, int blockNum) {
+    return deallocateBlocks(fs, &blockNum, 1);
+}
+
+/* Adds up to count newly allocated blocks to the end of an extent list of
+*nExtents runs. The last extent grows in place while the blocks after it
+are free; the rest comes from allocateRun as new extents, up to
+fs->maxExtents. The new blocks are listed in blockNums unless it is
+NULL. Returns the number of blocks added, less than count when the disk
+or the extent list fills up. */
+int growExtents(tfs_fs *fs, fileExtent *extents, int *nExtents, int count, int *blockNums) {
+    int added = 0;
+    if (*nExtents > 0 && count > 0) {
+        fileExtent *last = &extents[*nExtents - 1];
+        int next = last->start + last->length;
+        int length = scanBitmap(fs, next, 0) - next;
+        if (length > count) {
+            length = count;
+        }
+        for (int i = 0; i < length; i++) {
+            setBlockFree(&fs->freeBitmap, next + i, 0);
+            if (blockNums != NULL) {
+                blockNums[added] = next + i;
+            }
+            added++;
+        }
+        last->length += length;
+    }
+
+    int minimum = count - added;
+    while (added < count) {
+        if (*nExtents == fs->maxExtents) {
+            printf("Free space is too fragmented for the file\n");
+            break;
+        }
+        int start;
+        int length = allocateRun(fs, count - added, minimum, &start);
+        if (length == 0) {
+            break;
+        }
+        for (int i = 0; i < length; i++) {
+            if (blockNums != NULL) {
+                blockNums[added] = start + i;
+            }
+            added++;
+        }
+        extents[*nExtents].start = start;
+        extents[*nExtents].length = length;
+        (*nExtents)++;
+        minimum = 1;
+    }
+    return added;
+}
+
+/* Allocates up to count data blocks for an extent-format file as at most
+fs->maxExtents runs, plus an indirect extent block in *indirectBlock
+when the runs do not fit in the inode (0 otherwise). Returns the number of
+data blocks allocated, less than count when the disk fills up. */
+int allocateExtents(tfs_fs *fs, int count, fileExtent *extents, int *nExtents, int *indirectBlock) {
+    *nExtents = 0;
+    *indirectBlock = 0;
+    int allocated = growExtents(fs, extents, nExtents, count, NULL);
+
+    if (*nExtents > fs->directExtents && allocateBlocks(fs, 1, indirectBlock) != 1) {
+        // The disk is full, so the file's last block holds the extent list
+        fileExtent *last = &extents[*nExtents - 1];
+        *indirectBlock = last->start + last->length - 1;
+        allocated--;
+        last->length--;
+        if (last->length == 0) {
+            (*nExtents)--;
+        }
+        if (*nExtents <= fs->directExtents) {
+            deallocateBlock(fs, *indirectBlock);
+            *indirectBlock = 0;
+        }
+    }
+    return allocated;
+}
+
+/* Current time in nanoseconds since the epoch. Reads the kernel's coarse
+real-time clock, which is updated once per tick and costs no system call;
+each operation reads it once and uses that value throughout. */
+int64_t currentTime(void) {
+    struct timespec now;
+#ifdef CLOCK_REALTIME_COARSE
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+#else
+    clock_gettime(CLOCK_REALTIME, &now);
+#endif
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Formats a time as the text timestamps of version 0-2 inodes, ex:
+2024-06-03 11:44:48. Each thread caches the last second it formatted, so
+operations within the same second skip localtime_r and strftime. */
+void formatTimestamp(int64_t when, char *buffer, size_t bufferSize) {
+    static __thread time_t cachedSecond = 0;
+    static __thread char cachedText[TIMESTAMP_BUFFER_SIZE];
+    time_t second = (time_t)(when / 1000000000);
+    if (second != cachedSecond || cachedText[0] == '\0') {
+        struct tm parts;
+        strftime(cachedText, sizeof(cachedText), "%Y-%m-%d %H:%M:%S", localtime_r(&second, &parts));
+        cachedSecond = second;
+    }
+    snprintf(buffer, bufferSize, "%s", cachedText);
+}
+
+/* Stores one of an inode's INODE_TIME_* timestamps, in binary on version
+3 images and as text before that */
+void storeInodeTime(tfs_fs *fs, char *inodeBuffer, int which, int64_t when) {
+    if (fs->superBlock.version >= FORMAT_BINARY_TIMES) {
+        memcpy(inodeBuffer + INODE_TIMES_OFFSET + which * INODE_TIME_SIZE, &when, sizeof(int64_t));
+        return;
+    }
+    char *field = inodeBuffer + INODE_CR8_TIME_STAMP_OFFSET + which * TIMESTAMP_BUFFER_SIZE;
+    memset(field, 0, TIMESTAMP_BUFFER_SIZE);
+    formatTimestamp(when, field, TIMESTAMP_BUFFER_SIZE);
+}
+
+/* Copies one of an inode's INODE_TIME_* timestamps into buffer as text */
+void describeInodeTime(tfs_fs *fs, char *inodeBuffer, int which, char *buffer) {
+    if (fs->superBlock.version >= FORMAT_BINARY_TIMES) {
+        int64_t when;
+        memcpy(&when, inodeBuffer + INODE_TIMES_OFFSET + which * INODE_TIME_SIZE, sizeof(int64_t));
+        formatTimestamp(when, buffer, TIMESTAMP_BUFFER_SIZE);
+        return;
+    }
+    memcpy(buffer, inodeBuffer + INODE_CR8_TIME_STAMP_OFFSET + which * TIMESTAMP_BUFFER_SIZE, TIMESTAMP_BUFFER_SIZE);
+    buffer[TIMESTAMP_BUFFER_SIZE - 1] = '\0';
+}
+
+/* Records an access at time now to an open file according to the
+mount's access-time mode. Updates the timestamp in inodeBuffer and
+returns 1 when the caller has to write the inode back, 0 when it does
+not. */
+int touchAccessTime(tfs_fs *fs, fileDescriptorTableEntry *entry, char *inodeBuffer, int64_t now) {
+    if (fs->mountFlags & TFS_MOUNT_NOATIME) {
+        return 0;
+    }
+    if (fs->mountFlags & TFS_MOUNT_LAZYATIME) {
+        entry->accessTime = now;
+        return 0;
+    }
+    if ((fs->mountFlags & TFS_MOUNT_RELATIME) && fs->superBlock.version >= FORMAT_BINARY_TIMES) {
+        int64_t accessed, modified;
+        memcpy(&accessed, inodeBuffer + INODE_TIMES_OFFSET + INODE_TIME_ACCESSED * INODE_TIME_SIZE, sizeof(int64_t));
+        memcpy(&modified, inodeBuffer + INODE_TIMES_OFFSET + INODE_TIME_MODIFIED * INODE_TIME_SIZE, sizeof(int64_t));
+        if (accessed >= modified && now - accessed < (int64_t)RELATIME_STALE_SECONDS * 1000000000) {
+            return 0;
+        }
+    } else if (fs->mountFlags & TFS_MOUNT_RELATIME) {
+        // Text timestamps sort as strings, so compare them without parsing
+        char cutoff[TIMESTAMP_BUFFER_SIZE];
+        formatTimestamp(now - (int64_t)RELATIME_STALE_SECONDS * 1000000000, cutoff, TIMESTAMP_BUFFER_SIZE);
+        char *accessed = inodeBuffer + INODE_ACC_TIME_STAMP_OFFSET;
+        char *modified = inodeBuffer + INODE_MOD_TIME_STAMP_OFFSET;
+        if (strncmp(accessed, modified, TIMESTAMP_BUFFER_SIZE) >= 0 &&
+            strncmp(accessed, cutoff, TIMESTAMP_BUFFER_SIZE) > 0) {
+            return 0;
+        }
+    }
+    storeInodeTime(fs, inodeBuffer, INODE_TIME_ACCESSED, now);
+    return 1;
+}
+
+/* Writes an open file's pending lazy access time to its inode */
+int flushAccessTime(tfs_fs *fs, fileDescriptorTableEntry *entry) {
+    pthread_mutex_lock(&entry->cursorLock);
+    int64_t accessTime = entry->accessTime;
+    entry->accessTime = 0;
+    pthread_mutex_unlock(&entry->cursorLock);
+    if (accessTime == 0) {
+        return 1;
+    }
+    char *inodeBuffer = (char *)malloc(fs->blockSize);
+    if (inodeBuffer == NULL) {
+        return MEM_ALLOC_FAILURE;
+    }
+    if (readBlock(fs->disk, entry->inodeNumber, inodeBuffer) < 0) {
+        printf("Invalid pointer to inode block\n");
+        free(inodeBuffer);
+        return FILE_READ_ERROR;
+    }
+    storeInodeTime(fs, inodeBuffer, INODE_TIME_ACCESSED, accessTime);
+    int success = fsWriteBlock(fs, entry->inodeNumber, inodeBuffer);
+    free(inodeBuffer);
+    if (success < 0) {
+        printf("Issue with inode block write when updating access time\n");
+        return FILE_WRITE_ERROR;
+    }
+    return 1;
+}
+
+/* Writes the pending lazy access times of every open file */
+int flushAccessTimes(tfs_fs *fs) {
+    for (int i = 0; i < fs->superBlock.maxNumberOfFiles; i++) {
+        fileDescriptorTableEntry *entry = fs->fileDescriptorTable[i];
+        if (entry == NULL) {
+            continue;
+        }
+        pthread_rwlock_rdlock(&entry->lock);
+        int result = flushAccessTime(fs, entry);
+        pthread_rwlock_unlock(&entry->lock);
+        if (result < 0) {
+            return FILE_WRITE_ERROR;
+        }
+    }
+    return 1;
+}
 
 /* Makes a blank TinyFS file system of size nBytes on the unix file
 specified by ‘filename’. This function should use the emulated disk
@@ -19,195 +1015,538 @@ setting magic numbers, initializing and writing the superblock and
 inodes, etc. Must return a specified success/error code. */
 
 int tfs_mkfs(char *filename, int nBytes) {
+    return tfs_mkfsWithBlockSize(filename, nBytes, BLOCKSIZE);
+}
+
+/* Same as tfs_mkfs, formatting the file system in blockSize-byte blocks,
+a power of two from MIN_BLOCKSIZE to MAX_BLOCKSIZE. nBytes is rounded down
+to a whole number of blocks. */
+int formatDisk(char *filename, int nBytes, int blockSize) {
     // Check for valid size parameters first
     if (nBytes < 0 || nBytes > MAX_BYTES) {
         printf("File system size out of range\n");
         return FS_CREATION_ERROR;
     }
+    if (blockSize < MIN_BLOCKSIZE || blockSize > MAX_BLOCKSIZE || (blockSize & (blockSize - 1)) != 0) {
+        printf("Block size must be a power of two from %d to %d\n", MIN_BLOCKSIZE, MAX_BLOCKSIZE);
+        return FS_CREATION_ERROR;
+    }
 
     // Calculate total blocks and check if they're insufficient
-    int totalBlocks = (nBytes / BLOCKSIZE) - 1;
+    int totalBlocks = (nBytes / blockSize) - 1;
     if (totalBlocks < 3) {
         printf("File system size too small\n");
         return FS_CREATION_ERROR;
     }
 
     // Attempt to create the disk and verify successful creation
-    int diskID = openDisk(filename, nBytes);
+    int diskID = openDisk(filename, (totalBlocks + 1) * blockSize);
     if (diskID < 0) {
         printf("Failed to create disk\n");
         return FS_CREATION_ERROR;
     }
+    if (setDiskBlockSize(diskID, blockSize) < 0) {
+        printf("Failed to set the disk block size\n");
+        closeDisk(diskID);
+        return FS_CREATION_ERROR;
+    }
 
     // Calculate maximum number of files supported
     int fileLimit = totalBlocks / 2;
     if (fileLimit < 1) {
         printf("Not enough blocks for metadata\n");
+        closeDisk(diskID);
         return FS_CREATION_ERROR;
     }
 
     // Initialize super block
-    char *superBlock = (char *)malloc(BLOCKSIZE);
+    char *superData = (char *)malloc(blockSize);
 
-    if (!superBlock) {
+    if (!superData) {
         printf("Memory allocation failed\n");
+        closeDisk(diskID);
         return FS_CREATION_ERROR;
     }
 
-    memset(superBlock, 0, BLOCKSIZE);
-    superBlock[BLOCK_NUMBER_OFFSET] = 1;
-    superBlock[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
-    uint32_t firstFreeBlock = 2;  // Start of free blocks after superblock and root directory
-    *((uint32_t *)(superBlock + 2)) = firstFreeBlock;
-    memcpy(superBlock + SUPER_MAX_NUM_FILES_OFFSET, &fileLimit, sizeof(int));
+    // Free space is tracked by a bitmap in the blocks right after the super
+    // block; every block after the bitmap starts out free
+    superBlockInfo newSuperBlock;
+    newSuperBlock.freeBlockHead = 0;
+    newSuperBlock.inodeHead = 0;
+    newSuperBlock.maxNumberOfFiles = fileLimit;
+    newSuperBlock.version = FORMAT_VERSION;
+    newSuperBlock.totalBlocks = totalBlocks + 1;
+    newSuperBlock.bitmapStart = 1;
+    newSuperBlock.bitmapBlocks = bitmapBlocksFor(newSuperBlock.totalBlocks, blockSize);
+    newSuperBlock.blockSize = blockSize;
+    newSuperBlock.clean = 1;
+    packSuperBlock(&newSuperBlock, superData);
+
+    blockBitmap newBitmap;
+    if (initBitmap(&newBitmap, newSuperBlock.totalBlocks, blockSize) < 0) {
+        printf("Memory allocation failed\n");
+        free(superData);
+        closeDisk(diskID);
+        return FS_CREATION_ERROR;
+    }
+    int firstDataBlock = newSuperBlock.bitmapStart + newSuperBlock.bitmapBlocks;
+    setBlockRangeFree(&newBitmap, firstDataBlock, newSuperBlock.totalBlocks);
 
-    // Write super block to disk
-    int result = writeBlock(diskID, 0, superBlock);
-    free(superBlock);  // Free immediately after use
+    // Write super block to disk. It goes through the block cache and so
+    // only reaches the image at closeDisk, after every block it calls clean
+    int result = writeBlock(diskID, SUPER_BLOCK, superData);
+    free(superData);  // Free immediately after use
     if (result < 0) {
         printf("Error writing super block to disk\n");
+        releaseBitmap(&newBitmap);
+        closeDisk(diskID);
         return FS_CREATION_ERROR;
     }
 
-    // Initialize all other blocks
-    for (int i = 1; i <= totalBlocks; i++) {
-        char *blockData = (char *)malloc(BLOCKSIZE);
-        if (!blockData) {
-            printf("Memory allocation failed for block %d\n", i);
-            continue; // Proceed to attempt next block allocation
+    // Write the bitmap and format all other blocks as free blocks, building
+    // them in a staging buffer and writing each full buffer with one
+    // sequential write
+    int stagingBlocks = MKFS_STAGING_BYTES / blockSize;
+    char *staging = (char *)calloc(stagingBlocks, blockSize);
+    if (!staging) {
+        printf("Memory allocation failed\n");
+        releaseBitmap(&newBitmap);
+        closeDisk(diskID);
+        return FS_CREATION_ERROR;
+    }
+
+    for (int first = 1; first <= totalBlocks; first += stagingBlocks) {
+        int count = totalBlocks - first + 1;
+        if (count > stagingBlocks) {
+            count = stagingBlocks;
+        }
+        for (int i = first; i < first + count; i++) {
+            char *blockData = staging + (size_t)(i - first) * blockSize;
+            if (i < firstDataBlock) {
+                packBitmapBlock(&newBitmap, i - newSuperBlock.bitmapStart, blockData);
+                continue;
+            }
+            memset(blockData, 0, blockSize);
+            blockData[BLOCK_NUMBER_OFFSET] = FREE_BLOCK_TYPE;
+            blockData[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
         }
-        memset(blockData, 0, BLOCKSIZE);
-        blockData[BLOCK_NUMBER_OFFSET] = (i < totalBlocks) ? 4 : 0; // Mark last block differently if needed
-        blockData[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
-        uint32_t nextBlock = (i < totalBlocks) ? i + 1 : 0;
-        *((uint32_t *)(blockData + 2)) = nextBlock;
 
-        result = writeBlock(diskID, i, blockData);
-        free(blockData); // Free immediately after use
+        result = writeBlockRange(diskID, first, count, staging);
         if (result < 0) {
-            printf("Failed to write block %d to disk\n", i);
+            printf("Failed to write blocks %d-%d to disk\n", first, first + count - 1);
+            free(staging);
+            releaseBitmap(&newBitmap);
+            closeDisk(diskID);
             return FS_CREATION_ERROR;
         }
     }
+    free(staging);
+    releaseBitmap(&newBitmap);
+
+    // Closing the disk flushes the formatted blocks out of the block cache
+    if (closeDisk(diskID) < 0) {
+        printf("Failed to close disk after formatting\n");
+        return FS_CREATION_ERROR;
+    }
     return 1;
 }
 
 /* tfs_mount(char *diskname) “mounts” a TinyFS file system located within
 ‘diskname’. tfs_unmount(void) “unmounts” the currently mounted file
 system. As part of the mount operation, tfs_mount should verify the file
-system is the correct type. In tinyFS, only one file system may be
-mounted at a time. Use tfs_unmount to cleanly unmount the currently
-mounted file system. Must return a specified success/error code. */
+system is the correct type. tfs_mount and tfs_unmount manage the single
+default file system used by the functions without a tfs_fs argument;
+tfs_fsMount and tfs_fsUnmount mount any number of file systems side by
+side. Must return a specified success/error code. */
+
+/* Bounded validation of the pinned super block against the disk: the
+block counts, the bitmap region and the list heads must all lie on it */
+int checkSuperBlock(tfs_fs *fs) {
+    superBlockInfo *info = &fs->superBlock;
+    int diskBlocks = getDiskBlockCount(fs->disk);
+    int valid = (info->maxNumberOfFiles > 0 && info->inodeHead >= 0 && info->inodeHead < diskBlocks &&
+                 info->freeBlockHead >= 0 && info->freeBlockHead < diskBlocks);
+    if (valid && info->version >= FORMAT_BITMAP) {
+        valid = (info->totalBlocks == diskBlocks && info->bitmapStart == 1 &&
+                 info->bitmapBlocks == bitmapBlocksFor(info->totalBlocks, fs->blockSize) &&
+                 info->bitmapStart + info->bitmapBlocks < info->totalBlocks);
+    }
+    if (!valid) {
+        printf("Super block does not match the disk\n");
+        return FS_MOUNT_ERROR;
+    }
+    return 1;
+}
 
-int tfs_mount(char *diskname) {
+/* Checks the type and magic number of every block of the disk, reading
+MOUNT_CHECK_BYTES at a time with one sequential read each. Used when the
+image was not cleanly unmounted. The original tfs_mkfs wrote type 0 into
+the last block of the free list, so free-list images may hold it. */
+int checkAllBlocks(tfs_fs *fs) {
+    int diskBlocks = getDiskBlockCount(fs->disk);
+    int lowestType = (fs->superBlock.version == FORMAT_FREE_LIST) ? 0 : SUPER_BLOCK_TYPE;
+    int batchBlocks = MOUNT_CHECK_BYTES / fs->blockSize;
+    char *data = (char *)malloc((size_t)batchBlocks * fs->blockSize);
+    if (data == NULL) {
+        printf("Could not allocate memory to check the disk\n");
+        return MEM_ALLOC_FAILURE;
+    }
+
+    for (int first = 0; first < diskBlocks; first += batchBlocks) {
+        int count = (diskBlocks - first < batchBlocks) ? diskBlocks - first : batchBlocks;
+        if (readBlockRange(fs->disk, first, count, data) < 0) {
+            printf("Could not read blocks %d-%d\n", first, first + count - 1);
+            free(data);
+            return FILE_READ_ERROR;
+        }
+        for (int i = 0; i < count; i++) {
+            char *block = data + (size_t)i * fs->blockSize;
+            if (block[BLOCK_NUMBER_OFFSET] < lowestType || block[BLOCK_NUMBER_OFFSET] > EXTENT_BLOCK_TYPE) {
+                printf("Invalid block type in block %d\n", first + i);
+                free(data);
+                return FS_MOUNT_ERROR;
+            }
+            if (block[MAGIC_NUMBER_OFFSET] != MAGIC_NUMBER) {
+                printf("Invalid magic number in block %d\n", first + i);
+                free(data);
+                return FS_MOUNT_ERROR;
+            }
+        }
+    }
+    free(data);
+    return 1;
+}
 
-    // Check if there is already a disk mounted
-    if (activeDisk != 0) {
-        printf("A disk is already mounted, unmount current\ndisk to mount a new disk\n");
+/* Mounts diskname into the zeroed context fs */
+int mountFs(tfs_fs *fs, char *diskname, int flags) {
+
+    // At most one access-time mode may be chosen
+    int atimeMode = flags & TFS_MOUNT_ATIME_MASK;
+    if ((flags & ~TFS_MOUNT_ATIME_MASK) != 0 || (atimeMode & (atimeMode - 1)) != 0) {
+        printf("Invalid mount flags\n");
         return FS_MOUNT_ERROR;
     }
+    fs->mountFlags = flags;
 
     // Attempt to open the disk specified by 'diskname'
-    activeDisk = openDisk(diskname, 0);
-    if (activeDisk == -1) {
-        activeDisk = 0;
+    fs->disk = openDisk(diskname, 0);
+    if (fs->disk == -1) {
+        fs->disk = 0;
         printf("Could not open disk\n");
         return FS_MOUNT_ERROR;
     }
 
-    // Read the super block to fetch fs metadata
+    // Read the super block once; it stays pinned in memory until unmount.
+    // Its fields all lie in the first BLOCKSIZE bytes, so it is read at the
+    // default block size before the image's own size is known.
     char *superData = (char *)malloc(BLOCKSIZE);
-    int success = readBlock(activeDisk, SUPER_BLOCK, superData);
-    if (success < 0) {
+    if (superData == NULL) {
+        closeDisk(fs->disk);
+        fs->disk = 0;
+        return MEM_ALLOC_FAILURE;
+    }
+    int success = readBlock(fs->disk, SUPER_BLOCK, superData);
+    if (success < 0 || superData[BLOCK_NUMBER_OFFSET] != SUPER_BLOCK_TYPE || superData[MAGIC_NUMBER_OFFSET] != MAGIC_NUMBER) {
         printf("Issue with super block read when mounting disk\n");
+        free(superData);
+        closeDisk(fs->disk);
+        fs->disk = 0;
+        return FS_MOUNT_ERROR;
+    }
+    unpackSuperBlock(superData, &fs->superBlock);
+    free(superData);
+    if (fs->superBlock.version > FORMAT_VERSION) {
+        printf("Unsupported file system format version %d\n", fs->superBlock.version);
+        closeDisk(fs->disk);
+        fs->disk = 0;
         return FS_MOUNT_ERROR;
     }
 
-    // Retrieve the maximum number of files supported by this file system from the super block
-    memcpy(&maxNumberOfFiles, superData + SUPER_MAX_NUM_FILES_OFFSET, sizeof(int));
-
+    // Switch the disk to the image's block size and derive the geometry
+    int blockSize = fs->superBlock.blockSize;
+    if (blockSize < MIN_BLOCKSIZE || blockSize > MAX_BLOCKSIZE || (blockSize & (blockSize - 1)) != 0 ||
+        setDiskBlockSize(fs->disk, blockSize) < 0) {
+        printf("Invalid file system block size %d\n", blockSize);
+        closeDisk(fs->disk);
+        fs->disk = 0;
+        return FS_MOUNT_ERROR;
+    }
+    fs->blockSize = blockSize;
+    fs->dataSize = DATA_BYTES_PER_BLOCK(blockSize);
+    fs->directExtents = INODE_DIRECT_EXTENTS(blockSize);
+    fs->maxExtents = fs->directExtents + INDIRECT_EXTENTS(blockSize);
+    if (fs->maxExtents > MAX_FILE_EXTENTS) {
+        fs->maxExtents = MAX_FILE_EXTENTS;
+    }
 
-    char *data = (char *)malloc(BLOCKSIZE * sizeof(char));
-    int i = 0;
+    // The super block fields have to describe this disk before anything is
+    // read through them
+    if (checkSuperBlock(fs) < 0) {
+        closeDisk(fs->disk);
+        fs->disk = 0;
+        return FS_MOUNT_ERROR;
+    }
 
-    // Check every block in the disk to validate type and magic number
-    while (readBlock(activeDisk, i, data) < 0) {
-        if (data[BLOCK_NUMBER_OFFSET] <= 0 || data[BLOCK_NUMBER_OFFSET] > 4) {
-            printf("Invalid block type\n");
-            return FS_MOUNT_ERROR;
-        }
+    // Bitmap images keep their free-space bitmap in memory while mounted
+    if (fs->superBlock.version >= FORMAT_BITMAP && loadBitmap(fs) < 0) {
+        printf("Could not load free-space bitmap\n");
+        closeDisk(fs->disk);
+        fs->disk = 0;
+        return FS_MOUNT_ERROR;
+    }
 
-        if (data[MAGIC_NUMBER_OFFSET] != MAGIC_NUMBER) {
-            printf("Invalid magic number\n");
-            return FS_MOUNT_ERROR;
-        }
+    // A cleanly unmounted image needs only its super block, bitmap and
+    // inode list; any other has every block checked first
+    if (!fs->superBlock.clean && checkAllBlocks(fs) < 0) {
+        releaseBitmap(&fs->freeBitmap);
+        closeDisk(fs->disk);
+        fs->disk = 0;
+        return FS_MOUNT_ERROR;
     }
+    fs->cleanOnDisk = fs->superBlock.clean;
+    fs->cleanSuper = fs->superBlock;
+    fs->superBlock.clean = 0;
 
     // Allocate memory
-    fileDescriptorTable = (fileDescriptorTableEntry **)malloc(maxNumberOfFiles * sizeof(fileDescriptorTableEntry *));
-    if (fileDescriptorTable == NULL) {
+    fs->fileDescriptorTable = (fileDescriptorTableEntry **)calloc(fs->superBlock.maxNumberOfFiles, sizeof(fileDescriptorTableEntry *));
+    if (fs->fileDescriptorTable == NULL) {
         printf("Could not allocate memory for open file table\n");
+        releaseBitmap(&fs->freeBitmap);
+        closeDisk(fs->disk);
+        fs->disk = 0;
         return FS_MOUNT_ERROR;
     }
 
-    for (i = 0; i < maxNumberOfFiles; i++) {
-        fileDescriptorTable[i] = NULL;
+    // Index every file name and inode link so opens and deletes do not
+    // have to walk the inode list
+    if (buildNameIndex(fs) < 0) {
+        printf("Could not build file name index\n");
+        free(fs->fileDescriptorTable);
+        fs->fileDescriptorTable = NULL;
+        releaseBitmap(&fs->freeBitmap);
+        closeDisk(fs->disk);
+        fs->disk = 0;
+        return FS_MOUNT_ERROR;
     }
+    return fs->disk;
+}
 
-    free(data);
-    return activeDisk;
+/* Mounts diskname with TFS_MOUNT_* flags choosing how access times are
+kept. Returns a new file system context to pass to the tfs_fs* functions,
+or NULL if the disk could not be mounted. */
+tfs_fs *fsMount(char *diskname, int flags) {
+    tfs_fs *fs = (tfs_fs *)calloc(1, sizeof(tfs_fs));
+    if (fs == NULL) {
+        printf("Could not allocate memory for file system\n");
+        return NULL;
+    }
+    pthread_rwlock_init(&fs->namespaceLock, NULL);
+    pthread_mutex_init(&fs->allocLock, NULL);
+    pthread_mutex_init(&fs->stateLock, NULL);
+    if (mountFs(fs, diskname, flags) < 0) {
+        pthread_rwlock_destroy(&fs->namespaceLock);
+        pthread_mutex_destroy(&fs->allocLock);
+        pthread_mutex_destroy(&fs->stateLock);
+        free(fs);
+        return NULL;
+    }
+    return fs;
 }
 
-int tfs_unmount(void) {
+int tfs_mount(char *diskname) {
+    return tfs_mountWithFlags(diskname, 0);
+}
+
+/* tfs_mount with TFS_MOUNT_* flags choosing how access times are kept */
+int tfs_mountWithFlags(char *diskname, int flags) {
+
+    // Check if there is already a disk mounted
+    if (defaultFs != NULL) {
+        printf("A disk is already mounted, unmount current\ndisk to mount a new disk\n");
+        return FS_MOUNT_ERROR;
+    }
+    defaultFs = tfs_fsMount(diskname, flags);
+    return (defaultFs != NULL) ? defaultFs->disk : FS_MOUNT_ERROR;
+}
+
+/* Unmounts fs and frees it. No other call on fs may be running. */
+int fsUnmount(tfs_fs *fs) {
     // Check if there is an active disk to unmount
-    if (activeDisk == 0) {
+    if (fs == NULL) {
         printf("No disk to unmount\n");
         return FS_UNMOUNT_ERROR;
     }
-    activeDisk = 0;
+
+    // Write back lazy access times, the pinned super block and the bitmap,
+    // then close the disk, which writes back every dirty cached block
+    if (flushAccessTimes(fs) < 0 || syncMetadata(fs) < 0) {
+        printf("Could not write back super block and bitmap\n");
+        return FS_UNMOUNT_ERROR;
+    }
+
+    // Once every other block is in the image, a FORMAT_CLEAN_FLAG image
+    // written during the mount is marked clean so the next mount can skip
+    // the full check. One that was never written still carries the flag.
+    if (fs->superBlock.version >= FORMAT_CLEAN_FLAG && !fs->cleanOnDisk) {
+        if (flushDisk(fs->disk) < 0) {
+            printf("Could not flush disk\n");
+            return FS_UNMOUNT_ERROR;
+        }
+        fs->superBlock.clean = 1;
+        fs->superBlock.dirty = 1;
+        if (syncSuperBlock(fs) < 0) {
+            fs->superBlock.clean = 0;
+            printf("Could not mark the disk clean\n");
+            return FS_UNMOUNT_ERROR;
+        }
+    }
+    if (closeDisk(fs->disk) < 0) {
+        printf("Could not flush and close disk\n");
+        return FS_UNMOUNT_ERROR;
+    }
 
     // Iterate through the file descriptor table to free any open file descriptors
-    for (int i = 0; i < maxNumberOfFiles; i++) {
-        if (fileDescriptorTable[i] != NULL) {
-            free(fileDescriptorTable[i]);
-            fileDescriptorTable[i] = NULL;
+    for (int i = 0; i < fs->superBlock.maxNumberOfFiles; i++) {
+        if (fs->fileDescriptorTable[i] != NULL) {
+            freeFileDescriptorEntry(fs, i);
         }
     }
 
     // Free memory
-    free(fileDescriptorTable);
-    fileDescriptorTable = NULL;
+    free(fs->fileDescriptorTable);
+    fs->fileDescriptorTable = NULL;
+    freeNameIndex(fs);
+    releaseInodeLinks(fs);
+    releaseBitmap(&fs->freeBitmap);
+    releaseZeroPending(fs);
+    pthread_rwlock_destroy(&fs->namespaceLock);
+    pthread_mutex_destroy(&fs->allocLock);
+    pthread_mutex_destroy(&fs->stateLock);
+    free(fs);
 
     return 1;
 }
 
-int getTimestamp(char *buffer, size_t bufferSize) {
-    // Retrieve the current time
-    time_t now;
-    time(&now);
-
-    // Convert the time_t value to local time
-    struct tm *localTime = localtime(&now);
-
-    // Format time ex: 2024-06-03 11:44:48
-    strftime(buffer, bufferSize, "%Y-%m-%d %H:%M:%S", localTime);
+int tfs_unmount(void) {
+    int success = tfs_fsUnmount(defaultFs);
+    if (success >= 0) {
+        defaultFs = NULL;
+    }
+    return success;
+}
 
+/* Makes everything written so far durable in the image: writes back the
+pinned super block, the bitmap and lazy access times and flushes the
+disk's block cache. tfs_unmount does the same. */
+int fsSync(tfs_fs *fs) {
+    if (fs == NULL) {
+        printf("Error: No disk mounted. (sync)\n");
+        return FS_MOUNT_ERROR;
+    }
+    pthread_rwlock_rdlock(&fs->namespaceLock);
+    int success = flushAccessTimes(fs);
+    if (success >= 0) {
+        pthread_mutex_lock(&fs->allocLock);
+        success = syncMetadata(fs);
+        pthread_mutex_unlock(&fs->allocLock);
+    }
+    pthread_rwlock_unlock(&fs->namespaceLock);
+    if (success < 0) {
+        return success;
+    }
+    if (flushDisk(fs->disk) < 0) {
+        printf("Error: Could not flush disk. (sync)\n");
+        return FILE_WRITE_ERROR;
+    }
     return 1;
 }
 
-int tfs_readFileInfo(fileDescriptor fileDescriptor) {
+/* Lazy zeroing pass: rewrites up to maxBlocks of the blocks freed since
+mount as clean free blocks, so contents of deleted files do not linger on
+disk. Freeing never waits for this; callers run it when they have time to
+spare. Blocks that were allocated again in the meantime are skipped, and
+blocks on a free list keep their next pointer. Returns the number of
+blocks zeroed, 0 once nothing is left to zero. */
+int zeroFreeBlocksLocked(tfs_fs *fs, int maxBlocks) {
+    if (maxBlocks <= 0 || fs->zeroPending.count == 0) {
+        return 0;
+    }
+    if (maxBlocks > fs->zeroPending.count) {
+        maxBlocks = fs->zeroPending.count;
+    }
+
+    char *freeData = (char *)calloc(maxBlocks, fs->blockSize);
+    BlockIO *ios = (BlockIO *)malloc(maxBlocks * sizeof(BlockIO));
+    if (freeData == NULL || ios == NULL) {
+        free(freeData);
+        free(ios);
+        return MEM_ALLOC_FAILURE;
+    }
+
+    // Take pending blocks a word at a time, lowest block numbers first
+    int count = 0;
+    for (int w = 0; w < fs->zeroPending.nWords && count < maxBlocks; w++) {
+        while (fs->zeroPending.words[w] != 0 && count < maxBlocks) {
+            int blockNum = (w << 6) + __builtin_ctzll(fs->zeroPending.words[w]);
+            clearZeroPending(fs, blockNum);
+            if (fs->superBlock.version >= FORMAT_BITMAP && !(fs->freeBitmap.words[blockNum >> 6] & ((uint64_t)1 << (blockNum & 63)))) {
+                continue;
+            }
+            ios[count].bNum = blockNum;
+            ios[count].block = freeData + (size_t)count * fs->blockSize;
+            count++;
+        }
+    }
 
-    // Check if the file descriptor corresponds to an open file
-    if (fileDescriptorTable[fileDescriptor] == NULL) {
-        printf("File is not open. Cannot read file info\n");
-        return FILE_OPEN_ERROR;
+    // Free-list blocks are read first for the next pointer they carry
+    if (fs->superBlock.version == FORMAT_FREE_LIST && readBlocks(fs->disk, ios, count) < 0) {
+        free(freeData);
+        free(ios);
+        printf("Error: Issue with free block read. (zeroFreeBlocks)\n");
+        return FILE_READ_ERROR;
     }
+    for (int i = 0; i < count; i++) {
+        char *data = ios[i].block;
+        int nextFree = 0;
+        if (fs->superBlock.version == FORMAT_FREE_LIST) {
+            memcpy(&nextFree, data + FREE_NEXT_BLOCK_OFFSET, sizeof(int));
+        }
+        memset(data, 0, fs->blockSize);
+        data[BLOCK_NUMBER_OFFSET] = FREE_BLOCK_TYPE;
+        data[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+        memcpy(data + FREE_NEXT_BLOCK_OFFSET, &nextFree, sizeof(int));
+    }
+
+    int success = fsWriteBlocks(fs, ios, count);
+    free(freeData);
+    free(ios);
+    if (success < 0) {
+        printf("Error: Issue with free block write. (zeroFreeBlocks)\n");
+        return FILE_WRITE_ERROR;
+    }
+    return count;
+}
 
+/* The pass holds the allocator lock throughout, so no block it zeroes can
+be allocated again before its write lands */
+int fsZeroFreeBlocks(tfs_fs *fs, int maxBlocks) {
+    if (fs == NULL) {
+        printf("Error: No disk mounted. (zeroFreeBlocks)\n");
+        return FS_MOUNT_ERROR;
+    }
+    pthread_mutex_lock(&fs->allocLock);
+    int result = zeroFreeBlocksLocked(fs, maxBlocks);
+    pthread_mutex_unlock(&fs->allocLock);
+    return result;
+}
+
+int readFileInfoLocked(tfs_fs *fs, fileDescriptor fileDescriptor) {
     // Allocate memory to read the inode data associated with the file descriptor
-    char *inodeBuffer = (char *)malloc(BLOCKSIZE);
-    int success = readBlock(activeDisk, fileDescriptorTable[fileDescriptor]->inodeNumber, inodeBuffer);
+    char *inodeBuffer = (char *)malloc(fs->blockSize);
+    int success = readBlock(fs->disk, fs->fileDescriptorTable[fileDescriptor]->inodeNumber, inodeBuffer);
     if (success < 0) {
         printf("Invalid pointer to inode block\n");
+        free(inodeBuffer);
         return FILE_READ_ERROR;
     }
 
@@ -221,9 +1560,15 @@ int tfs_readFileInfo(fileDescriptor fileDescriptor) {
     // Copy file metadata from the inode into local variables
     memcpy(fileName, inodeBuffer + INODE_FILE_NAME_OFFSET, MAX_FILE_NAME_SIZE);
     memcpy(&fileSize, inodeBuffer + INODE_FILE_SIZE_OFFSET, sizeof(int));
-    memcpy(created, inodeBuffer + INODE_CR8_TIME_STAMP_OFFSET, TIMESTAMP_BUFFER_SIZE);
-    memcpy(modified, inodeBuffer + INODE_MOD_TIME_STAMP_OFFSET, TIMESTAMP_BUFFER_SIZE);
-    memcpy(accessed, inodeBuffer + INODE_ACC_TIME_STAMP_OFFSET, TIMESTAMP_BUFFER_SIZE);
+    describeInodeTime(fs, inodeBuffer, INODE_TIME_CREATED, created);
+    describeInodeTime(fs, inodeBuffer, INODE_TIME_MODIFIED, modified);
+    describeInodeTime(fs, inodeBuffer, INODE_TIME_ACCESSED, accessed);
+    pthread_mutex_lock(&fs->fileDescriptorTable[fileDescriptor]->cursorLock);
+    int64_t accessTime = fs->fileDescriptorTable[fileDescriptor]->accessTime;
+    pthread_mutex_unlock(&fs->fileDescriptorTable[fileDescriptor]->cursorLock);
+    if (accessTime != 0) {
+        formatTimestamp(accessTime, accessed, TIMESTAMP_BUFFER_SIZE);
+    }
 
     // Display the file information
     printf("\n%s Information:", fileName);
@@ -240,119 +1585,113 @@ int tfs_readFileInfo(fileDescriptor fileDescriptor) {
     return 1;
 }
 
+int fsReadFileInfo(tfs_fs *fs, fileDescriptor fileDescriptor) {
+    // Check if a disk is mounted
+    if (fs == NULL) {
+        printf("No disk mounted. Cannot read file info\n");
+        return FS_MOUNT_ERROR;
+    }
+    fileDescriptorTableEntry *entry = lockFile(fs, fileDescriptor, 0);
+    if (entry == NULL) {
+        printf("File is not open. Cannot read file info\n");
+        return FILE_BAD_DESCRIPTOR;
+    }
+    int result = readFileInfoLocked(fs, fileDescriptor);
+    unlockFile(entry);
+    return result;
+}
+
 /* Creates or Opens a file for reading and writing on the currently
 mounted file system. Creates a dynamic resource table entry for the file,
 and returns a file descriptor (integer) that can be used to reference
 this entry while the filesystem is mounted. */
 
-fileDescriptor tfs_openFile(char *name) {
+fileDescriptor openFileLocked(tfs_fs *fs, char *name) {
+    int success;
 
-    // Allocate memory to read the super block data
-    char *superData = (char *)malloc(BLOCKSIZE);
-
-    // Read the super block to access file system metadata
-    int success = readBlock(activeDisk, SUPER_BLOCK, superData);
-    if (success < 0) {
-        printf("Issue with super block read when opening file\n");
-        return FILE_OPEN_ERROR;
-    }
-
-    // Retrieve the head of the inode list from the super block
-    int inodeHead;
-    memcpy(&inodeHead, superData + IB_OFFSET, sizeof(int));
-
-    // If there are existing inodes, search for the file
-    if (inodeHead != 0) {
-        int inodeCurrent = inodeHead;
-        char *inodeBuffer = (char *)malloc(BLOCKSIZE);
-        char fileName[MAX_FILE_NAME_SIZE];
-
-        // Loop through inodes to find the file
-        while (1) {
-            success = readBlock(activeDisk, inodeCurrent, inodeBuffer);
-            if (success < 0) {
-                printf("Invalid pointer to inode block\n");
-                return FILE_OPEN_ERROR;
-            }
-
-            // Compare the file name stored in the inode with the provided name
-            memcpy(fileName, inodeBuffer + INODE_FILE_NAME_OFFSET, MAX_FILE_NAME_SIZE * sizeof(char));
-            if (strcmp(fileName, name) == 0) {
-                // Check if the file is already open
-                for (int i = 0; i < maxNumberOfFiles; i++) {
-                    if (fileDescriptorTable[i] != NULL && fileDescriptorTable[i]->inodeNumber == inodeCurrent) {
-                        printf("File is already open\n");
-                        return FILE_OPEN_ERROR;
-                    }
-                }
-
-                // Allocate a new entry for the open file table
-                fileDescriptorTableEntry *newEntry = (fileDescriptorTableEntry *)malloc(sizeof(fileDescriptorTableEntry));
-
-                if (newEntry == NULL) {
-                    printf("Could not allocate memory for new open file table entry\n");
-                    return FILE_OPEN_ERROR;
-                }
+    // Look the name up in the index; only an existing file's inode is read
+    int inodeCurrent = lookupName(fs, name);
+    if (inodeCurrent != 0) {
+        // Check if the file is already open
+        if (findOpenFile(fs, inodeCurrent) >= 0) {
+            printf("File is already open\n");
+            return FILE_OPEN_ERROR;
+        }
 
-                // Initialize the new entry and add it to the file descriptor table
-                newEntry->filePointer = 0;
-                int currentFileDescriptor = 0;
-                while (fileDescriptorTable[currentFileDescriptor] != NULL) {
-                    currentFileDescriptor++;
-                }
-                newEntry->inodeNumber = inodeCurrent;
-                fileDescriptorTable[currentFileDescriptor] = newEntry;
-
-                // Update the access time in the inode
-                char *timeStampBuffer = (char *)malloc(TIMESTAMP_BUFFER_SIZE);
-                getTimestamp(timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-                memset(inodeBuffer + INODE_ACC_TIME_STAMP_OFFSET, 0, TIMESTAMP_BUFFER_SIZE);
-                memcpy(inodeBuffer + INODE_ACC_TIME_STAMP_OFFSET, timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-                int writeSuccess = writeBlock(activeDisk, inodeCurrent, inodeBuffer);
-                if (writeSuccess < 0) {
-                    printf("Issue with inode block write when opening file\n");
-                    return FILE_OPEN_ERROR;
-                }
-                return currentFileDescriptor;
-            }
-            memset(fileName, 0, MAX_FILE_NAME_SIZE * sizeof(char));
+        // Add a new entry to the open file table
+        int currentFileDescriptor = addFileDescriptorEntry(fs, inodeCurrent);
+        if (currentFileDescriptor < 0) {
+            return FILE_OPEN_ERROR;
+        }
+        fileDescriptorTableEntry *entry = fs->fileDescriptorTable[currentFileDescriptor];
 
-            // Move to the next inode if the current one is not the target
-            if (inodeBuffer[INODE_NEXT_INODE_OFFSET] == 0) {
-                break;
-            }
-            memcpy(&inodeCurrent, inodeBuffer + INODE_NEXT_INODE_OFFSET, sizeof(int));
-            memset(inodeBuffer, 0, BLOCKSIZE);
+        // Record the access; only the strict and relatime modes need the inode
+        if (fs->mountFlags & (TFS_MOUNT_NOATIME | TFS_MOUNT_LAZYATIME)) {
+            touchAccessTime(fs, entry, NULL, currentTime());
+            return currentFileDescriptor;
+        }
+        char *inodeBuffer = (char *)malloc(fs->blockSize);
+        if (inodeBuffer == NULL) {
+            freeFileDescriptorEntry(fs, currentFileDescriptor);
+            return MEM_ALLOC_FAILURE;
+        }
+        success = readBlock(fs->disk, inodeCurrent, inodeBuffer);
+        if (success < 0) {
+            printf("Invalid pointer to inode block\n");
+            free(inodeBuffer);
+            freeFileDescriptorEntry(fs, currentFileDescriptor);
+            return FILE_OPEN_ERROR;
+        }
+        int writeSuccess = 1;
+        if (touchAccessTime(fs, entry, inodeBuffer, currentTime())) {
+            writeSuccess = fsWriteBlock(fs, inodeCurrent, inodeBuffer);
         }
         free(inodeBuffer);
+        if (writeSuccess < 0) {
+            printf("Issue with inode block write when opening file\n");
+            freeFileDescriptorEntry(fs, currentFileDescriptor);
+            return FILE_OPEN_ERROR;
+        }
+        return currentFileDescriptor;
     }
 
-    // Check if there are free blocks available to create a new file
-    int freeBlockHead;
-    memcpy(&freeBlockHead, superData + FB_OFFSET, sizeof(int));
-    if (freeBlockHead == 0) {
-        printf("No free blocks\n");
-        return NO_SPACE_LEFT;
+    // Check that the name fits in the inode before creating the file
+    if (strlen(name) >= MAX_FILE_NAME_SIZE) {
+        printf("File name is too long\n");
+        return FILE_OPEN_ERROR;
     }
 
-    // Prepare to create a new file if it does not exist
-    char *freeBlockData = (char *)malloc(BLOCKSIZE);
-    success = readBlock(activeDisk, freeBlockHead, freeBlockData);
+    // Take a block for the new inode from the allocator
+    int newInodeBlockNum;
+    pthread_mutex_lock(&fs->allocLock);
+    success = allocateBlocks(fs, 1, &newInodeBlockNum);
+    pthread_mutex_unlock(&fs->allocLock);
     if (success < 0) {
-        printf("Invalid pointer to free block\n");
         return FILE_OPEN_ERROR;
     }
+    if (success == 0) {
+        printf("No free blocks\n");
+        return NO_SPACE_LEFT;
+    }
+    if (setInodePrev(fs, newInodeBlockNum, 0) < 0) {
+        printf("Could not add file to inode link map\n");
+        pthread_mutex_lock(&fs->allocLock);
+        deallocateBlock(fs, newInodeBlockNum);
+        pthread_mutex_unlock(&fs->allocLock);
+        return MEM_ALLOC_FAILURE;
+    }
 
-    // Update the free block list and set up a new inode for the file
-    int nextFreeBlock;
-    memcpy(&nextFreeBlock, freeBlockData + FREE_NEXT_BLOCK_OFFSET, sizeof(int));
-    memcpy(superData + FB_OFFSET, &nextFreeBlock, sizeof(int));
-    int newInodeBlockNum = freeBlockHead;
+    // Set up a new inode for the file at the head of the inode list
+    char *freeBlockData = (char *)calloc(1, fs->blockSize);
+    if (freeBlockData == NULL) {
+        pthread_mutex_lock(&fs->allocLock);
+        deallocateBlock(fs, newInodeBlockNum);
+        pthread_mutex_unlock(&fs->allocLock);
+        return MEM_ALLOC_FAILURE;
+    }
     freeBlockData[BLOCK_NUMBER_OFFSET] = INODE_BLOCK_TYPE;
     freeBlockData[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
-    memcpy(&inodeHead, superData + IB_OFFSET, sizeof(int));
-    memcpy(freeBlockData + INODE_NEXT_INODE_OFFSET, &inodeHead, sizeof(int));
-    memcpy(superData + IB_OFFSET, &newInodeBlockNum, sizeof(int));
+    memcpy(freeBlockData + INODE_NEXT_INODE_OFFSET, &fs->superBlock.inodeHead, sizeof(int));
 
     // Initialize the new inode with file details and timestamps
     int fileSize = 0;
@@ -361,535 +1700,1210 @@ fileDescriptor tfs_openFile(char *name) {
     memcpy(freeBlockData + INODE_DATA_BLOCK_OFFSET, &dataBlockPointer, sizeof(int));
     memset(freeBlockData + INODE_FILE_NAME_OFFSET, 0, MAX_FILE_NAME_SIZE * sizeof(char));
     memcpy(freeBlockData + INODE_FILE_NAME_OFFSET, name, strlen(name) * sizeof(char));
-    char *timeStampBuffer = (char *)malloc(TIMESTAMP_BUFFER_SIZE);
-    getTimestamp(timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    memcpy(freeBlockData + INODE_CR8_TIME_STAMP_OFFSET, timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    memcpy(freeBlockData + INODE_MOD_TIME_STAMP_OFFSET, timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    memcpy(freeBlockData + INODE_ACC_TIME_STAMP_OFFSET, timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
+    int64_t now = currentTime();
+    storeInodeTime(fs, freeBlockData, INODE_TIME_CREATED, now);
+    storeInodeTime(fs, freeBlockData, INODE_TIME_MODIFIED, now);
+    storeInodeTime(fs, freeBlockData, INODE_TIME_ACCESSED, now);
     
-    // Write the updated super block and the new inode block
-    int writeSuccess = writeBlock(activeDisk, SUPER_BLOCK, superData);
-    if (writeSuccess < 0) {
-        printf("Issue with super block write when opening file\n");
-        return FILE_OPEN_ERROR;
-    }
-    writeSuccess = writeBlock(activeDisk, newInodeBlockNum, freeBlockData);
+    // Write the new inode block and index its name, then link it in through
+    // the pinned super block; until then a failure only frees the block
+    int writeSuccess = fsWriteBlock(fs, newInodeBlockNum, freeBlockData);
+    free(freeBlockData);
     if (writeSuccess < 0) {
         printf("Issue with inode block write when opening file\n");
+        pthread_mutex_lock(&fs->allocLock);
+        deallocateBlock(fs, newInodeBlockNum);
+        pthread_mutex_unlock(&fs->allocLock);
         return FILE_OPEN_ERROR;
     }
+    if (insertName(fs, name, newInodeBlockNum) < 0) {
+        printf("Could not add file to name index\n");
+        pthread_mutex_lock(&fs->allocLock);
+        deallocateBlock(fs, newInodeBlockNum);
+        pthread_mutex_unlock(&fs->allocLock);
+        return MEM_ALLOC_FAILURE;
+    }
+    if (fs->superBlock.inodeHead != 0) {
+        fs->inodeLinks.prev[fs->superBlock.inodeHead] = newInodeBlockNum;
+    }
+    pthread_mutex_lock(&fs->allocLock);
+    fs->superBlock.inodeHead = newInodeBlockNum;
+    fs->superBlock.dirty = 1;
+    pthread_mutex_unlock(&fs->allocLock);
 
     // Create a new entry in the file descriptor table for the new file
-    fileDescriptorTableEntry *newEntry = (fileDescriptorTableEntry *)malloc(sizeof(fileDescriptorTableEntry));
-    if (newEntry == NULL) {
-        printf("Could not allocate memory for new open file table entry\n");
+    int currentFileDescriptor = addFileDescriptorEntry(fs, newInodeBlockNum);
+    if (currentFileDescriptor < 0) {
         return FILE_OPEN_ERROR;
     }
-    newEntry->filePointer = 0;
-    int currentFileDescriptor = 0;
-    while (fileDescriptorTable[currentFileDescriptor] != NULL) {
-        currentFileDescriptor++;
-    }
-    newEntry->inodeNumber = newInodeBlockNum;
-    fileDescriptorTable[currentFileDescriptor] = newEntry;
-
-    // Free memory
-    free(superData);
-    free(freeBlockData);
-    free(timeStampBuffer);
 
     // Return file descriptor of the newly opened or found file
     return currentFileDescriptor;
 }
 
+fileDescriptor fsOpenFile(tfs_fs *fs, char *name) {
+    // Check if a disk is mounted
+    if (fs == NULL) {
+        printf("Error: No disk mounted. Cannot open file. (openFile)\n");
+        return FS_MOUNT_ERROR;
+    }
+    pthread_rwlock_wrlock(&fs->namespaceLock);
+    fileDescriptor result = openFileLocked(fs, name);
+    pthread_rwlock_unlock(&fs->namespaceLock);
+    return result;
+}
+
 /* Closes the file, de-allocates all system resources, and removes table
 entry */
 
-int tfs_closeFile(fileDescriptor fileDescriptor) {
-    // Check if the file descriptor is valid
-    if (fileDescriptorTable[fileDescriptor] == NULL) {
-        printf("Invalid file descriptor. Cannot close file\n");
-        return FILE_BAD_DESCRIPTOR;
-    }
+int closeFileLocked(tfs_fs *fs, fileDescriptor fileDescriptor) {
+    // Write a pending lazy access time before the entry goes away
+    int success = flushAccessTime(fs, fs->fileDescriptorTable[fileDescriptor]);
+
+    // Free memory
+    freeFileDescriptorEntry(fs, fileDescriptor);
+
+    return (success < 0) ? FILE_CLOSE_ERROR : 1;
+}
 
+int fsCloseFile(tfs_fs *fs, fileDescriptor fileDescriptor) {
     // Check if a disk is mounted before attempting to close the file
-    if (activeDisk == 0) {
+    if (fs == NULL) {
         printf("No disk mounted. Cannot close file\n");
         return FILE_CLOSE_ERROR;
     }
 
-    // Validate the range of the file descriptor
-    if (fileDescriptor < 0 || fileDescriptor >= maxNumberOfFiles) {
+    // Wait for calls already holding the file's lock before freeing it
+    pthread_rwlock_wrlock(&fs->namespaceLock);
+    fileDescriptorTableEntry *entry = lockFile(fs, fileDescriptor, 1);
+    if (entry == NULL) {
+        pthread_rwlock_unlock(&fs->namespaceLock);
         printf("Invalid file descriptor. Cannot close file\n");
         return FILE_BAD_DESCRIPTOR;
     }
+    unlockFile(entry);
+    int result = closeFileLocked(fs, fileDescriptor);
+    pthread_rwlock_unlock(&fs->namespaceLock);
+    return result;
+}
 
-    // Free memory
-    free(fileDescriptorTable[fileDescriptor]);
-    fileDescriptorTable[fileDescriptor] = NULL;
-    
+/* Collects the block numbers of the data chain starting at dataBlock into
+a malloc'd array returned through chain. Returns the chain length. */
+int readDataChain(tfs_fs *fs, int dataBlock, int **chain) {
+    int capacity = 16;
+    int length = 0;
+    int *blocks = (int *)malloc(capacity * sizeof(int));
+    char *dataBuffer = (char *)malloc(fs->blockSize);
+    if (blocks == NULL || dataBuffer == NULL) {
+        free(blocks);
+        free(dataBuffer);
+        return MEM_ALLOC_FAILURE;
+    }
+
+    while (dataBlock != 0) {
+        if (length == capacity) {
+            capacity *= 2;
+            int *grown = (int *)realloc(blocks, capacity * sizeof(int));
+            if (grown == NULL) {
+                free(blocks);
+                free(dataBuffer);
+                return MEM_ALLOC_FAILURE;
+            }
+            blocks = grown;
+        }
+        if (readBlock(fs->disk, dataBlock, dataBuffer) < 0) {
+            printf("Invalid pointer to data block\n");
+            free(blocks);
+            free(dataBuffer);
+            return FILE_READ_ERROR;
+        }
+        blocks[length++] = dataBlock;
+        memcpy(&dataBlock, dataBuffer + DATA_NEXT_BLOCK_OFFSET, sizeof(int));
+    }
+
+    free(dataBuffer);
+    *chain = blocks;
+    return length;
+}
+
+/* Loads the extent list of an extent-format inode into extents, which
+has room for MAX_FILE_EXTENTS, reading the indirect extent block when the
+inode has one. Returns the number of extents. */
+int readExtents(tfs_fs *fs, char *inodeBuffer, fileExtent *extents) {
+    int count;
+    int indirectBlock;
+    memcpy(&count, inodeBuffer + INODE_EXTENT_COUNT_OFFSET, sizeof(int));
+    memcpy(&indirectBlock, inodeBuffer + INODE_INDIRECT_OFFSET, sizeof(int));
+    if (count < 0 || count > fs->maxExtents) {
+        printf("Invalid extent count %d\n", count);
+        return FILE_READ_ERROR;
+    }
+
+    int direct = (count < fs->directExtents) ? count : fs->directExtents;
+    memcpy(extents, inodeBuffer + INODE_EXTENTS_OFFSET, direct * EXTENT_SIZE);
+    if (count > direct) {
+        char *extentData = (char *)malloc(fs->blockSize);
+        if (extentData == NULL) {
+            return MEM_ALLOC_FAILURE;
+        }
+        if (readBlock(fs->disk, indirectBlock, extentData) < 0 || extentData[BLOCK_NUMBER_OFFSET] != EXTENT_BLOCK_TYPE) {
+            printf("Invalid pointer to extent block\n");
+            free(extentData);
+            return FILE_READ_ERROR;
+        }
+        memcpy(extents + direct, extentData + EXTENT_BLOCK_DATA_OFFSET, (count - direct) * EXTENT_SIZE);
+        free(extentData);
+    }
+    return count;
+}
+
+/* Stores an extent list in an extent-format inode buffer. Runs past
+fs->directExtents are written to indirectBlock, which the caller has
+allocated. */
+int writeExtents(tfs_fs *fs, char *inodeBuffer, fileExtent *extents, int count, int indirectBlock) {
+    int direct = (count < fs->directExtents) ? count : fs->directExtents;
+    memset(inodeBuffer + INODE_EXTENT_COUNT_OFFSET, 0, fs->blockSize - INODE_EXTENT_COUNT_OFFSET);
+    memcpy(inodeBuffer + INODE_EXTENT_COUNT_OFFSET, &count, sizeof(int));
+    memcpy(inodeBuffer + INODE_INDIRECT_OFFSET, &indirectBlock, sizeof(int));
+    memcpy(inodeBuffer + INODE_EXTENTS_OFFSET, extents, direct * EXTENT_SIZE);
+    if (count > direct) {
+        char *extentData = (char *)calloc(1, fs->blockSize);
+        if (extentData == NULL) {
+            return MEM_ALLOC_FAILURE;
+        }
+        extentData[BLOCK_NUMBER_OFFSET] = EXTENT_BLOCK_TYPE;
+        extentData[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+        memcpy(extentData + EXTENT_BLOCK_DATA_OFFSET, extents + direct, (count - direct) * EXTENT_SIZE);
+        int success = fsWriteBlock(fs, indirectBlock, extentData);
+        free(extentData);
+        if (success < 0) {
+            printf("Issue with extent block write\n");
+            return FILE_WRITE_ERROR;
+        }
+    }
     return 1;
 }
 
-int deallocateBlock(int blockNum) {
-    char *data = (char *)malloc(BLOCKSIZE);
-    int success = readBlock(activeDisk, blockNum, data);
-    if (success < 0) {
-        printf("Invalid pointer to block\n");
-        return DEALLOCATION_ERROR;
+/* Lists every block a file owns apart from its inode: the data chain on
+older images, or the blocks of each extent plus the indirect extent block
+on extent images. Returns the number of blocks. */
+int collectFileBlocks(tfs_fs *fs, char *inodeBuffer, int **blocks) {
+    if (fs->superBlock.version < FORMAT_EXTENTS) {
+        int dataBlock;
+        memcpy(&dataBlock, inodeBuffer + INODE_DATA_BLOCK_OFFSET, sizeof(int));
+        return readDataChain(fs, dataBlock, blocks);
+    }
+
+    fileExtent extents[MAX_FILE_EXTENTS];
+    int count = readExtents(fs, inodeBuffer, extents);
+    if (count < 0) {
+        return count;
+    }
+    int total = (count > fs->directExtents) ? 1 : 0;
+    for (int i = 0; i < count; i++) {
+        total += extents[i].length;
+    }
+    int *list = (int *)malloc((total > 0 ? total : 1) * sizeof(int));
+    if (list == NULL) {
+        return MEM_ALLOC_FAILURE;
+    }
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < extents[i].length; j++) {
+            list[n++] = extents[i].start + j;
+        }
     }
-    memset(data, 0, BLOCKSIZE);
-    data[BLOCK_NUMBER_OFFSET] = FREE_BLOCK_TYPE;
-    data[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
-    char *superData = (char *)malloc(BLOCKSIZE);
-    success = readBlock(activeDisk, SUPER_BLOCK, superData);
-    if (success < 0) {
-        printf("Issue with super block read when deallocating block\n");
-        return DEALLOCATION_ERROR;
+    if (count > fs->directExtents) {
+        memcpy(&list[n], inodeBuffer + INODE_INDIRECT_OFFSET, sizeof(int));
     }
-    int freeBlockHead;
-    memcpy(&freeBlockHead, superData + FB_OFFSET, sizeof(int));
-    memcpy(data + FREE_NEXT_BLOCK_OFFSET, &freeBlockHead, sizeof(int));
-    memcpy(superData + FB_OFFSET, &blockNum, sizeof(int));
-    int writeSuccess = writeBlock(activeDisk, SUPER_BLOCK, superData);
-    if (writeSuccess < 0) {
-        printf("Issue with super block write when deallocating block\n");
+    *blocks = list;
+    return total;
+}
+
+/* Returns a chained file's data blocks, listed in chain order, to a
+free-list image by splicing the whole chain onto the front of the free
+list. Only the last block is rewritten, to point at the old list head;
+the head then moves to the first block. The other blocks keep their
+contents and the next pointers that already link them, until the lazy
+zeroing pass rewrites them as free blocks. */
+int spliceChain(tfs_fs *fs, int *chain, int length) {
+    if (length == 0) {
+        return 1;
+    }
+    char *tailData = (char *)malloc(fs->blockSize);
+    if (tailData == NULL) {
+        return MEM_ALLOC_FAILURE;
+    }
+    if (readBlock(fs->disk, chain[length - 1], tailData) < 0) {
+        printf("Invalid pointer to data block\n");
+        free(tailData);
         return DEALLOCATION_ERROR;
     }
-    writeSuccess = writeBlock(activeDisk, blockNum, data);
-    if (writeSuccess < 0) {
-        printf("Issue with free block write when deallocating block\n");
+    memcpy(tailData + FREE_NEXT_BLOCK_OFFSET, &fs->superBlock.freeBlockHead, sizeof(int));
+    int success = fsWriteBlock(fs, chain[length - 1], tailData);
+    free(tailData);
+    if (success < 0) {
+        printf("Issue with data block write when freeing chain\n");
         return DEALLOCATION_ERROR;
     }
+
+    fs->superBlock.freeBlockHead = chain[0];
+    fs->superBlock.dirty = 1;
+    for (int i = 0; i < length; i++) {
+        markZeroPending(fs, chain[i]);
+    }
     return 1;
 }
 
+/* Frees the blocks collectFileBlocks listed for a file. On free-list
+images they are the file's data chain and get spliced onto the free list
+whole; otherwise they are deallocated like any other blocks. */
+int freeFileBlocks(tfs_fs *fs, int *blocks, int count) {
+    if (fs->superBlock.version == FORMAT_FREE_LIST) {
+        return spliceChain(fs, blocks, count);
+    }
+    return deallocateBlocks(fs, blocks, count);
+}
+
 /* Writes buffer ‘buffer’ of size ‘size’, which represents an entire
 file’s content, to the file system. Previous content (if any) will be
 completely lost. Sets the file pointer to 0 (the start of file) when
 done. Returns success/error codes. */
 
-int tfs_writeFile(fileDescriptor fileDescriptor, char *buffer, int size) {
-    // Check if there is a disk mounted before attempting to write
-    if (activeDisk == 0) {
-        printf("Error: No disk mounted. Cannot find file. (writeFile)\n");
-        return FS_MOUNT_ERROR;
-    }
-
+int writeFileLocked(tfs_fs *fs, fileDescriptor fileDescriptor, char *buffer, int size) {
     // Retrieve the file descriptor table entry to get file-specific data
-    fileDescriptorTableEntry *fileDescriptorEntry = fileDescriptorTable[fileDescriptor];
-    if (fileDescriptorEntry == NULL) {
-        printf("Error: File has not been opened. (writeFile)\n");
-        return FILE_BAD_DESCRIPTOR;
-    }
-
-    // Read the inode for the file from the file system's super block
-    int fileInode = fileDescriptorEntry->inodeNumber;
-    char *superData = (char *)malloc(BLOCKSIZE * sizeof(char));
-    int success = readBlock(activeDisk, SUPER_BLOCK, superData);
-    if (success < 0) {
-        free(superData);
-        printf("Error: Issue with super block read. (writeFile)\n");
-        return FILE_READ_ERROR;
-    }
+    fileDescriptorTableEntry *fileDescriptorEntry = fs->fileDescriptorTable[fileDescriptor];
 
     // Read the inode block of the file to access file-specific metadata
-    char *inodeBuffer = (char *)malloc(BLOCKSIZE * sizeof(char));
-    success = readBlock(activeDisk, fileInode, inodeBuffer);
+    int fileInode = fileDescriptorEntry->inodeNumber;
+    char *inodeBuffer = (char *)malloc(fs->blockSize);
+    int success = readBlock(fs->disk, fileInode, inodeBuffer);
     if (success < 0) {
-        free(superData);
         free(inodeBuffer);
         printf("Error: Issue with inode read. (writeFile)\n");
         return FILE_READ_ERROR;
     }
 
-    // Determine the current size of the file from the inode
-    int currentFileSize;
-    memcpy(&currentFileSize, inodeBuffer + INODE_FILE_SIZE_OFFSET, sizeof(int));
-
-    // Calculate the number of data blocks needed based on the size parameter
+    // Deallocate existing data blocks if the file already contains data
     int dataBlock;
     memcpy(&dataBlock, inodeBuffer + INODE_DATA_BLOCK_OFFSET, sizeof(int));
-    int blocksNeeded = size / USEABLE_DATA_SIZE + (size % USEABLE_DATA_SIZE > 0 ? 1 : 0);
-    
-    // Deallocate existing data blocks if the file already contains data
-    int bufferPointer = 0;
-    int remainingBytes = size;
-    if (currentFileSize != 0) {
-        int blocksToDeallocate = currentFileSize / USEABLE_DATA_SIZE + (size % USEABLE_DATA_SIZE > 0 ? 1 : 0);
-        for (int i = 0; i < blocksToDeallocate; i++) {
-            char *dataBuffer = (char *)malloc(BLOCKSIZE * sizeof(char));
-            success = readBlock(activeDisk, dataBlock, dataBuffer);
-            if (success < 0) {
-                free(inodeBuffer);
-                free(superData);
-                printf("Error: Data block could not be read. (writeFile)\n");
-                return FILE_READ_ERROR;
-            }
-            int nextBlock;
-            memcpy(&nextBlock, dataBuffer + DATA_NEXT_BLOCK_OFFSET, sizeof(int));
-            success = deallocateBlock(dataBlock);
-            if (success < 0) {
-                free(inodeBuffer);
-                free(superData);
-                printf("Error: Could not deallocate data block. (writeFile)\n");
-                return DEALLOCATION_ERROR;
-            }
-            dataBlock = nextBlock;
-            free(dataBuffer);
-        }
-    }
-
-    // Allocate new data blocks and write the buffer to these blocks
-    int freeBlock;
-    memcpy(&freeBlock, superData + FB_OFFSET, sizeof(int));
-    int dataExtentHead = freeBlock;
-    char *freeBuffer = (char *)malloc(BLOCKSIZE * sizeof(char));
-    while (blocksNeeded != 0) {
-        success = readBlock(activeDisk, freeBlock, freeBuffer);
-        if (success < 0) {
+    if (dataBlock != 0) {
+        int *chain = NULL;
+        int chainLength = collectFileBlocks(fs, inodeBuffer, &chain);
+        if (chainLength < 0) {
             free(inodeBuffer);
-            free(superData);
-            free(freeBuffer);
-            printf("Error: Free block could not be read. (writeFile)\n");
+            printf("Error: Data block could not be read. (writeFile)\n");
             return FILE_READ_ERROR;
         }
-        freeBuffer[BLOCK_NUMBER_OFFSET] = DATA_BLOCK_TYPE;
-        int writeBufferSize = (remainingBytes >= USEABLE_DATA_SIZE ? USEABLE_DATA_SIZE : remainingBytes) * sizeof(char);
-        memcpy(freeBuffer + DATA_BLOCK_DATA_OFFSET, buffer + bufferPointer, writeBufferSize);
-        bufferPointer = bufferPointer + writeBufferSize;
-        remainingBytes = remainingBytes - writeBufferSize;
-        int dataBlock = freeBlock;
-        memcpy(&freeBlock, freeBuffer + FREE_NEXT_BLOCK_OFFSET, sizeof(int));
-        blocksNeeded--;
-        if (blocksNeeded == 0) {
-            int zero = 0;
-            memcpy(freeBuffer + DATA_NEXT_BLOCK_OFFSET, &zero, sizeof(int));
-        }
-        success = writeBlock(activeDisk, dataBlock, freeBuffer);
+        fileDescriptorEntry->cursorBlock = 0;
+        pthread_mutex_lock(&fs->allocLock);
+        success = freeFileBlocks(fs, chain, chainLength);
+        pthread_mutex_unlock(&fs->allocLock);
+        free(chain);
         if (success < 0) {
             free(inodeBuffer);
-            free(superData);
-            free(freeBuffer);
-            printf("Error: Free block could not be written to. (writeFile)\n");
-            return FILE_WRITE_ERROR;
+            printf("Error: Could not deallocate data block. (writeFile)\n");
+            return DEALLOCATION_ERROR;
         }
-        if (freeBlock == 0 && blocksNeeded != 0) {
-            break;
+    }
+
+    // Calculate the number of data blocks needed based on the size parameter
+    int blocksNeeded = size / fs->dataSize + (size % fs->dataSize > 0 ? 1 : 0);
+    char *dataBuffers = (char *)calloc(blocksNeeded > 0 ? blocksNeeded : 1, fs->blockSize);
+    BlockIO *ios = (BlockIO *)malloc((blocksNeeded > 0 ? blocksNeeded : 1) * sizeof(BlockIO));
+    int *chainBlocks = (int *)malloc((blocksNeeded > 0 ? blocksNeeded : 1) * sizeof(int));
+    if (dataBuffers == NULL || ios == NULL || chainBlocks == NULL) {
+        free(inodeBuffer);
+        free(dataBuffers);
+        free(ios);
+        free(chainBlocks);
+        printf("Error: Memory allocation failed. (writeFile)\n");
+        return MEM_ALLOC_FAILURE;
+    }
+
+    // Allocate the blocks, as runs on extent images, then build the new
+    // data blocks in memory
+    fileExtent extents[MAX_FILE_EXTENTS];
+    int nExtents = 0;
+    int indirectBlock = 0;
+    int allocated;
+    pthread_mutex_lock(&fs->allocLock);
+    if (fs->superBlock.version >= FORMAT_EXTENTS) {
+        allocated = allocateExtents(fs, blocksNeeded, extents, &nExtents, &indirectBlock);
+        for (int e = 0, i = 0; e < nExtents; e++) {
+            for (int j = 0; j < extents[e].length; j++) {
+                chainBlocks[i++] = extents[e].start + j;
+            }
+        }
+    } else {
+        allocated = allocateBlocks(fs, blocksNeeded, chainBlocks);
+    }
+    pthread_mutex_unlock(&fs->allocLock);
+    if (allocated < 0) {
+        free(inodeBuffer);
+        free(dataBuffers);
+        free(ios);
+        free(chainBlocks);
+        printf("Error: Free block could not be read. (writeFile)\n");
+        return FILE_READ_ERROR;
+    }
+    int bufferPointer = 0;
+    for (int i = 0; i < allocated; i++) {
+        char *blockData = dataBuffers + (size_t)i * fs->blockSize;
+        blockData[BLOCK_NUMBER_OFFSET] = DATA_BLOCK_TYPE;
+        blockData[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+        int writeBufferSize = (size - bufferPointer >= fs->dataSize ? fs->dataSize : size - bufferPointer) * sizeof(char);
+        memcpy(blockData + DATA_BLOCK_DATA_OFFSET, buffer + bufferPointer, writeBufferSize);
+        bufferPointer = bufferPointer + writeBufferSize;
+        if (i + 1 < allocated && fs->superBlock.version < FORMAT_EXTENTS) {
+            memcpy(blockData + DATA_NEXT_BLOCK_OFFSET, &chainBlocks[i + 1], sizeof(int));
         }
+        ios[i].bNum = chainBlocks[i];
+        ios[i].block = blockData;
     }
 
-    // Update the super block to reflect the new state of free blocks
-    memcpy(superData + FB_OFFSET, &freeBlock, sizeof(int));
-    success = writeBlock(activeDisk, SUPER_BLOCK, superData);
+    // Write all the data blocks with one vectored call
+    success = fsWriteBlocks(fs, ios, allocated);
+    int dataExtentHead = allocated > 0 ? ios[0].bNum : 0;
+    free(dataBuffers);
+    free(ios);
+    free(chainBlocks);
     if (success < 0) {
         free(inodeBuffer);
-        free(superData);
-        free(freeBuffer);
-        printf("Error: Super block could not be updated. (writeFile)\n");
+        printf("Error: Free block could not be written to. (writeFile)\n");
         return FILE_WRITE_ERROR;
     }
 
     // Update inode with the new file size and data block head
-    int finalSize = size - remainingBytes;
+    int finalSize = bufferPointer;
     memcpy(inodeBuffer + INODE_FILE_SIZE_OFFSET, &finalSize, sizeof(int));
     memcpy(inodeBuffer + INODE_DATA_BLOCK_OFFSET, &dataExtentHead, sizeof(int));
+    if (fs->superBlock.version >= FORMAT_EXTENTS) {
+        success = writeExtents(fs, inodeBuffer, extents, nExtents, indirectBlock);
+        if (success < 0) {
+            free(inodeBuffer);
+            return success;
+        }
+    }
 
     // Update the inode modification timestamp
-    char *timeStampBuffer = (char *)malloc(TIMESTAMP_BUFFER_SIZE);
-    getTimestamp(timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    memcpy(inodeBuffer + INODE_MOD_TIME_STAMP_OFFSET, timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    free(timeStampBuffer);
+    storeInodeTime(fs, inodeBuffer, INODE_TIME_MODIFIED, currentTime());
 
     // Write the updated inode back to the disk
-    success = writeBlock(activeDisk, fileInode, inodeBuffer);
+    success = fsWriteBlock(fs, fileInode, inodeBuffer);
+    free(inodeBuffer);
     if (success < 0) {
-        free(inodeBuffer);
-        free(superData);
-        free(freeBuffer);
         printf("Error: Inode block could not be updated. (writeFile)\n");
         return FILE_WRITE_ERROR;
     }
 
-    // Reset the file descriptor's file pointer to the beginning
+    // Reset the file descriptor's file pointer to the beginning; the old
+    // chain is gone, so the cursor into it is dropped too
     fileDescriptorEntry->filePointer = 0;
-    free(inodeBuffer);
-    free(superData);
-    free(freeBuffer);
+    fileDescriptorEntry->cursorBlock = 0;
 
     // Check if all necessary blocks were successfully allocated and written
-    if (blocksNeeded > 0) {
+    if (allocated < blocksNeeded) {
         printf("Error: No free blocks. Incomplete write (writeFile)\n");
         return FILE_WRITE_ERROR;
     }
     return 1;
 }
 
+int fsWriteFile(tfs_fs *fs, fileDescriptor fileDescriptor, char *buffer, int size) {
+    // Check if there is a disk mounted before attempting to write
+    if (fs == NULL) {
+        printf("Error: No disk mounted. Cannot find file. (writeFile)\n");
+        return FS_MOUNT_ERROR;
+    }
+    fileDescriptorTableEntry *entry = lockFile(fs, fileDescriptor, 1);
+    if (entry == NULL) {
+        printf("Error: File has not been opened. (writeFile)\n");
+        return FILE_BAD_DESCRIPTOR;
+    }
+    int result = writeFileLocked(fs, fileDescriptor, buffer, size);
+    unlockFile(entry);
+    return result;
+}
+
+/* Returns the block holding block index of an extent-format file, or 0 if
+the extents end first */
+int extentBlock(fileExtent *extents, int count, int index) {
+    for (int e = 0; e < count; e++) {
+        if (index < extents[e].length) {
+            return extents[e].start + index;
+        }
+        index -= extents[e].length;
+    }
+    return 0;
+}
+
+/* Writes size bytes from buffer into the file starting at byte offset,
+without moving the file pointer. Only the blocks covering that range are
+written: existing blocks are updated in place, read first only when part
+of their contents is kept, and blocks past the end of the file are
+allocated and linked onto the chain or extent list. A gap between the old
+end of file and offset reads back as zeros. Nothing is written if the
+disk cannot hold the new blocks. Returns the number of bytes written. */
+
+int pwriteLocked(tfs_fs *fs, fileDescriptor fileDescriptor, char *buffer, int size, int offset) {
+    if (size < 0 || offset < 0 || (long)offset + size > MAX_BYTES) {
+        printf("Error: Write range out of bounds. (pwrite)\n");
+        return FILE_WRITE_ERROR;
+    }
+    fileDescriptorTableEntry *fileDescriptorEntry = fs->fileDescriptorTable[fileDescriptor];
+
+    // Read the inode block of the file to access file-specific metadata
+    int fileInode = fileDescriptorEntry->inodeNumber;
+    char *inodeBuffer = (char *)malloc(fs->blockSize);
+    if (readBlock(fs->disk, fileInode, inodeBuffer) < 0) {
+        free(inodeBuffer);
+        printf("Error: Issue with inode read. (pwrite)\n");
+        return FILE_READ_ERROR;
+    }
+    int fileSize;
+    int dataBlock;
+    memcpy(&fileSize, inodeBuffer + INODE_FILE_SIZE_OFFSET, sizeof(int));
+    memcpy(&dataBlock, inodeBuffer + INODE_DATA_BLOCK_OFFSET, sizeof(int));
+    if (size == 0) {
+        free(inodeBuffer);
+        return 0;
+    }
+
+    // Work out which blocks change: the written range plus any zero-filled
+    // gap before it. Chained files also rewrite their old last block when
+    // new blocks get linked after it.
+    int end = offset + size;
+    int fillStart = (offset < fileSize) ? offset : fileSize;
+    int newSize = (end > fileSize) ? end : fileSize;
+    int oldBlocks = (fileSize + fs->dataSize - 1) / fs->dataSize;
+    int newBlocks = (newSize + fs->dataSize - 1) / fs->dataSize;
+    int firstIndex = fillStart / fs->dataSize;
+    int lastIndex = (end - 1) / fs->dataSize;
+    int chained = (fs->superBlock.version < FORMAT_EXTENTS);
+    if (chained && newBlocks > oldBlocks && oldBlocks > 0 && firstIndex == oldBlocks) {
+        firstIndex = oldBlocks - 1;
+    }
+    int count = lastIndex - firstIndex + 1;
+    int addCount = newBlocks - oldBlocks;
+
+    char *dataBuffers = (char *)calloc(count, fs->blockSize);
+    BlockIO *ios = (BlockIO *)malloc(count * sizeof(BlockIO));
+    int *newBlockNums = (int *)malloc((addCount > 0 ? addCount : 1) * sizeof(int));
+    if (dataBuffers == NULL || ios == NULL || newBlockNums == NULL) {
+        free(inodeBuffer);
+        free(dataBuffers);
+        free(ios);
+        free(newBlockNums);
+        printf("Error: Memory allocation failed. (pwrite)\n");
+        return MEM_ALLOC_FAILURE;
+    }
+    for (int i = 0; i < count; i++) {
+        ios[i].block = dataBuffers + (size_t)i * fs->blockSize;
+    }
+
+    // Find the existing blocks in the range. Chained files are walked from
+    // the cursor (or the first data block) and every block in range is read
+    // for its next pointer; extent files only read a block whose old
+    // contents are partly kept.
+    fileExtent extents[MAX_FILE_EXTENTS];
+    int nExtents = 0;
+    int indirectBlock = 0;
+    int success = 0;
+    int existingEnd = (lastIndex < oldBlocks - 1) ? lastIndex : oldBlocks - 1;
+    if (chained && firstIndex <= existingEnd) {
+        int index = 0;
+        int blockNum = dataBlock;
+        if (fileDescriptorEntry->cursorBlock != 0 && fileDescriptorEntry->cursorIndex <= firstIndex) {
+            index = fileDescriptorEntry->cursorIndex;
+            blockNum = fileDescriptorEntry->cursorBlock;
+        }
+        char *walkData = (char *)malloc(fs->blockSize);
+        while (success >= 0 && index <= existingEnd) {
+            char *target = (index >= firstIndex) ? (char *)ios[index - firstIndex].block : walkData;
+            success = readBlock(fs->disk, blockNum, target);
+            if (index >= firstIndex) {
+                ios[index - firstIndex].bNum = blockNum;
+            }
+            memcpy(&blockNum, target + DATA_NEXT_BLOCK_OFFSET, sizeof(int));
+            index++;
+        }
+        free(walkData);
+    } else if (!chained) {
+        memcpy(&indirectBlock, inodeBuffer + INODE_INDIRECT_OFFSET, sizeof(int));
+        nExtents = readExtents(fs, inodeBuffer, extents);
+        success = nExtents;
+        for (int index = firstIndex; success >= 0 && index <= existingEnd; index++) {
+            int blockStart = index * fs->dataSize;
+            int coverStart = (fillStart > blockStart) ? fillStart : blockStart;
+            int coverEnd = (end < blockStart + fs->dataSize) ? end : blockStart + fs->dataSize;
+            int keptEnd = (fileSize < blockStart + fs->dataSize) ? fileSize : blockStart + fs->dataSize;
+            ios[index - firstIndex].bNum = extentBlock(extents, nExtents, index);
+            if (coverStart > blockStart || coverEnd < keptEnd) {
+                if (ios[index - firstIndex].bNum == fileDescriptorEntry->cursorBlock) {
+                    memcpy(ios[index - firstIndex].block, fileDescriptorEntry->cursorData, fs->blockSize);
+                } else {
+                    success = readBlock(fs->disk, ios[index - firstIndex].bNum, ios[index - firstIndex].block);
+                }
+            }
+        }
+    }
+    if (success < 0) {
+        free(inodeBuffer);
+        free(dataBuffers);
+        free(ios);
+        free(newBlockNums);
+        printf("Error: Issue with data read. (pwrite)\n");
+        return FILE_READ_ERROR;
+    }
+
+    // Allocate the blocks past the old end of the file, all or nothing
+    if (addCount > 0) {
+        int added;
+        int missingIndirect = 0;
+        pthread_mutex_lock(&fs->allocLock);
+        if (chained) {
+            added = allocateBlocks(fs, addCount, newBlockNums);
+        } else {
+            added = growExtents(fs, extents, &nExtents, addCount, newBlockNums);
+            if (added == addCount && nExtents > fs->directExtents && indirectBlock == 0 && allocateBlocks(fs, 1, &indirectBlock) != 1) {
+                indirectBlock = 0;
+                missingIndirect = 1;
+            }
+        }
+        if (added < addCount || missingIndirect) {
+            if (added > 0) {
+                deallocateBlocks(fs, newBlockNums, added);
+            }
+            pthread_mutex_unlock(&fs->allocLock);
+            free(inodeBuffer);
+            free(dataBuffers);
+            free(ios);
+            free(newBlockNums);
+            printf("Error: No free blocks. (pwrite)\n");
+            return NO_SPACE_LEFT;
+        }
+        pthread_mutex_unlock(&fs->allocLock);
+        for (int i = 0; i < addCount; i++) {
+            ios[oldBlocks + i - firstIndex].bNum = newBlockNums[i];
+        }
+    }
+
+    // Fill in the blocks: headers and chain links, the zero-filled gap, then
+    // the new bytes
+    for (int index = firstIndex; index <= lastIndex; index++) {
+        char *blockData = ios[index - firstIndex].block;
+        int blockStart = index * fs->dataSize;
+        blockData[BLOCK_NUMBER_OFFSET] = DATA_BLOCK_TYPE;
+        blockData[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+        if (chained && index >= oldBlocks - 1 && addCount > 0) {
+            int nextBlock = (index + 1 < newBlocks) ? newBlockNums[index + 1 - oldBlocks] : 0;
+            memcpy(blockData + DATA_NEXT_BLOCK_OFFSET, &nextBlock, sizeof(int));
+        }
+
+        int gapStart = (fileSize > blockStart) ? fileSize : blockStart;
+        int gapEnd = (offset < blockStart + fs->dataSize) ? offset : blockStart + fs->dataSize;
+        if (gapEnd > gapStart) {
+            memset(blockData + DATA_BLOCK_DATA_OFFSET + gapStart - blockStart, 0, gapEnd - gapStart);
+        }
+        int copyStart = (offset > blockStart) ? offset : blockStart;
+        int copyEnd = (end < blockStart + fs->dataSize) ? end : blockStart + fs->dataSize;
+        if (copyEnd > copyStart) {
+            memcpy(blockData + DATA_BLOCK_DATA_OFFSET + copyStart - blockStart, buffer + copyStart - offset, copyEnd - copyStart);
+        }
+    }
+
+    // Write every changed block with one vectored call
+    success = fsWriteBlocks(fs, ios, count);
+    if (success < 0) {
+        free(inodeBuffer);
+        free(dataBuffers);
+        free(ios);
+        free(newBlockNums);
+        printf("Error: Data block could not be written. (pwrite)\n");
+        return FILE_WRITE_ERROR;
+    }
+
+    // The cursor moves to the last block written, which is where the next
+    // append or sequential write starts
+    fileDescriptorEntry->cursorBlock = ios[count - 1].bNum;
+    fileDescriptorEntry->cursorIndex = lastIndex;
+    memcpy(fileDescriptorEntry->cursorData, ios[count - 1].block, fs->blockSize);
+    free(dataBuffers);
+    free(ios);
+
+    // Update the inode: size, data head and extents if blocks were added,
+    // and the modification time
+    memcpy(inodeBuffer + INODE_FILE_SIZE_OFFSET, &newSize, sizeof(int));
+    if (addCount > 0) {
+        if (oldBlocks == 0) {
+            memcpy(inodeBuffer + INODE_DATA_BLOCK_OFFSET, &newBlockNums[0], sizeof(int));
+        }
+        if (!chained && writeExtents(fs, inodeBuffer, extents, nExtents, indirectBlock) < 0) {
+            free(inodeBuffer);
+            free(newBlockNums);
+            return FILE_WRITE_ERROR;
+        }
+    }
+    free(newBlockNums);
+    storeInodeTime(fs, inodeBuffer, INODE_TIME_MODIFIED, currentTime());
+
+    success = fsWriteBlock(fs, fileInode, inodeBuffer);
+    free(inodeBuffer);
+    if (success < 0) {
+        printf("Error: Inode block could not be updated. (pwrite)\n");
+        return FILE_WRITE_ERROR;
+    }
+    return size;
+}
+
+int fsPwrite(tfs_fs *fs, fileDescriptor fileDescriptor, char *buffer, int size, int offset) {
+    // Check if there is a disk mounted before attempting to write
+    if (fs == NULL) {
+        printf("Error: No disk mounted. Cannot find file. (pwrite)\n");
+        return FS_MOUNT_ERROR;
+    }
+    fileDescriptorTableEntry *entry = lockFile(fs, fileDescriptor, 1);
+    if (entry == NULL) {
+        printf("Error: File has not been opened. (pwrite)\n");
+        return FILE_BAD_DESCRIPTOR;
+    }
+    int result = pwriteLocked(fs, fileDescriptor, buffer, size, offset);
+    unlockFile(entry);
+    return result;
+}
+
+/* Appends size bytes from buffer to the end of the file, touching only the
+last block and any new ones. The file pointer does not move. Returns the
+number of bytes written. */
+
+int appendLocked(tfs_fs *fs, fileDescriptor fileDescriptor, char *buffer, int size) {
+    // The file size comes from the inode, which the write reads again from
+    // the block cache
+    char *inodeBuffer = (char *)malloc(fs->blockSize);
+    if (readBlock(fs->disk, fs->fileDescriptorTable[fileDescriptor]->inodeNumber, inodeBuffer) < 0) {
+        free(inodeBuffer);
+        printf("Error: Issue with inode read. (append)\n");
+        return FILE_READ_ERROR;
+    }
+    int fileSize;
+    memcpy(&fileSize, inodeBuffer + INODE_FILE_SIZE_OFFSET, sizeof(int));
+    free(inodeBuffer);
+    return pwriteLocked(fs, fileDescriptor, buffer, size, fileSize);
+}
+
+/* The file lock is held from reading the size to writing the data, so
+concurrent appends to one file never overwrite each other */
+int fsAppend(tfs_fs *fs, fileDescriptor fileDescriptor, char *buffer, int size) {
+    if (fs == NULL) {
+        printf("Error: No disk mounted. Cannot find file. (append)\n");
+        return FS_MOUNT_ERROR;
+    }
+    fileDescriptorTableEntry *entry = lockFile(fs, fileDescriptor, 1);
+    if (entry == NULL) {
+        printf("Error: File has not been opened. (append)\n");
+        return FILE_BAD_DESCRIPTOR;
+    }
+    int result = appendLocked(fs, fileDescriptor, buffer, size);
+    unlockFile(entry);
+    return result;
+}
+
 /* deletes a file and marks its blocks as free on disk. */
 
-int tfs_deleteFile(fileDescriptor fileDescriptor) {
+int deleteFileLocked(tfs_fs *fs, fileDescriptor fileDescriptor) {
+    // Retrieve inode to delete
+    int inodeToDelete = fs->fileDescriptorTable[fileDescriptor]->inodeNumber;
+
+    // Read the inode to delete for its successor and its blocks
+    char *currentInodeBuffer = (char *)malloc(fs->blockSize);
+    int success = readBlock(fs->disk, inodeToDelete, currentInodeBuffer);
+    if (success < 0) {
+        printf("Invalid pointer to inode block\n");
+        free(currentInodeBuffer);
+        return FILE_DELETE_ERROR;
+    }
+    int inodeAfterToDelete;
+    memcpy(&inodeAfterToDelete, currentInodeBuffer + INODE_NEXT_INODE_OFFSET, sizeof(int));
+
+    // List the file's blocks before anything changes, so a broken chain or
+    // extent list leaves the file where it was
+    int *chain = NULL;
+    int chainLength = collectFileBlocks(fs, currentInodeBuffer, &chain);
+    if (chainLength < 0) {
+        printf("Invalid pointer to data block\n");
+        free(currentInodeBuffer);
+        return FILE_DELETE_ERROR;
+    }
+
+    // Unlink the inode; its predecessor comes from the inode link map, so
+    // at most one other inode block is read and rewritten
+    int previousInode = fs->inodeLinks.prev[inodeToDelete];
+    if (previousInode == 0) {
+        // The inode is the list head; update the pinned super block
+        pthread_mutex_lock(&fs->allocLock);
+        fs->superBlock.inodeHead = inodeAfterToDelete;
+        fs->superBlock.dirty = 1;
+        pthread_mutex_unlock(&fs->allocLock);
+    } else {
+        char *previousInodeBuffer = (char *)malloc(fs->blockSize);
+        success = readBlock(fs->disk, previousInode, previousInodeBuffer);
+        if (success < 0) {
+            printf("Invalid pointer to inode block\n");
+            free(previousInodeBuffer);
+            free(currentInodeBuffer);
+            free(chain);
+            return FILE_DELETE_ERROR;
+        }
+        memcpy(previousInodeBuffer + INODE_NEXT_INODE_OFFSET, &inodeAfterToDelete, sizeof(int));
+        int writeSuccess = fsWriteBlock(fs, previousInode, previousInodeBuffer);
+        free(previousInodeBuffer);
+        if (writeSuccess < 0) {
+            printf("Issue with inode block write when deleting file\n");
+            free(currentInodeBuffer);
+            free(chain);
+            return FILE_DELETE_ERROR;
+        }
+    }
+    if (inodeAfterToDelete != 0) {
+        fs->inodeLinks.prev[inodeAfterToDelete] = previousInode;
+    }
+    fs->inodeLinks.prev[inodeToDelete] = 0;
+
+    // Free all data blocks associated with the inode, and the inode itself
+    char fileName[MAX_FILE_NAME_SIZE];
+    memcpy(fileName, currentInodeBuffer + INODE_FILE_NAME_OFFSET, MAX_FILE_NAME_SIZE);
+    fileName[MAX_FILE_NAME_SIZE - 1] = '\0';
+    removeName(fs, fileName, inodeToDelete);
+    fs->fileDescriptorTable[fileDescriptor]->cursorBlock = 0;
+    fs->fileDescriptorTable[fileDescriptor]->accessTime = 0;
+    pthread_mutex_lock(&fs->allocLock);
+    success = freeFileBlocks(fs, chain, chainLength);
+    if (success >= 0) {
+        success = deallocateBlock(fs, inodeToDelete);
+    }
+    pthread_mutex_unlock(&fs->allocLock);
+    free(chain);
+    free(currentInodeBuffer);
+    if (success < 0) {
+        printf("Could not deallocate file blocks\n");
+        return FILE_DELETE_ERROR;
+    }
+    return 1;
+}
 
-    // Validate file descriptor
-    if (fileDescriptorTable[fileDescriptor] == NULL) {
+/* Unlinking rewrites the previous inode's next pointer, so when that file
+is open its lock is held too, keeping its own writes from racing the
+update */
+int fsDeleteFile(tfs_fs *fs, fileDescriptor fileDescriptor) {
+    // Check if a disk is mounted
+    if (fs == NULL) {
+        printf("No disk mounted. Cannot delete file\n");
+        return FS_MOUNT_ERROR;
+    }
+    pthread_rwlock_wrlock(&fs->namespaceLock);
+    fileDescriptorTableEntry *entry = lockFile(fs, fileDescriptor, 1);
+    if (entry == NULL) {
+        pthread_rwlock_unlock(&fs->namespaceLock);
         printf("invalid File Descriptor. Cannot delete file\n");
         return FILE_BAD_DESCRIPTOR;
     }
+    fileDescriptorTableEntry *previous = lockFile(fs, findOpenFile(fs, fs->inodeLinks.prev[entry->inodeNumber]), 1);
+    int result = deleteFileLocked(fs, fileDescriptor);
+    unlockFile(previous);
+    unlockFile(entry);
 
-     // Retrieve inode to delete
-    int inodeToDelete = fileDescriptorTable[fileDescriptor]->inodeNumber;
-
-    // Read the super block to get inode information
-    char *superData = (char *)malloc(BLOCKSIZE);
-    int success = readBlock(activeDisk, SUPER_BLOCK, superData);
-    if (success < 0) {
-        printf("Issue with super block read when deleting file\n");
-        return FILE_DELETE_ERROR;
+    // The file is gone, so its entry is dropped without a close
+    if (result > 0) {
+        freeFileDescriptorEntry(fs, fileDescriptor);
     }
+    pthread_rwlock_unlock(&fs->namespaceLock);
+    return result;
+}
 
-    // Find the inode in the inode list
-    int currentInode;
-    char *currentInodeBuffer = (char *)malloc(BLOCKSIZE);
-    memcpy(&currentInode, superData + IB_OFFSET, sizeof(int));
-    success = readBlock(activeDisk, currentInode, currentInodeBuffer);
-    if (success < 0) {
-        printf("Invalid pointer to inode block\n");
-        return FILE_DELETE_ERROR;
+/* A reader's own copy of an open file's cursor: the block it holds (0 when
+unset), that block's position in the chain and its contents. readLocked
+fills one from the open file and hands it back when the read is done, so
+readers sharing the file never walk from the same cursor. */
+typedef struct readCursor {
+    int block;
+    int index;
+    char *data;
+} readCursor;
+
+/* Copies size bytes starting at byte offset of a chained file into
+buffer. The walk starts from the chain cursor when it sits at or before
+the block holding offset, so sequential reads and forward seeks never
+rewalk the chain; otherwise it starts over from the first data block.
+Returns size, or an error code. */
+int readChainData(tfs_fs *fs, readCursor *cursor, int dataBlock, int offset, char *buffer, int size) {
+    int targetIndex = offset / fs->dataSize;
+    int byteNumber = offset % fs->dataSize;
+    char *blockData = cursor->data;
+    if (cursor->block == 0 || cursor->index > targetIndex) {
+        cursor->block = 0;
+        if (readBlock(fs->disk, dataBlock, blockData) < 0) {
+            return FILE_READ_ERROR;
+        }
+        cursor->block = dataBlock;
+        cursor->index = 0;
+    }
+
+    // Move the cursor forward one block at a time until it reaches the
+    // target, then copy from consecutive blocks until the request is done
+    int bytesRead = 0;
+    while (1) {
+        if (cursor->index == targetIndex) {
+            int chunk = fs->dataSize - byteNumber;
+            if (chunk > size - bytesRead) {
+                chunk = size - bytesRead;
+            }
+            memcpy(buffer + bytesRead, blockData + DATA_BLOCK_DATA_OFFSET + byteNumber, chunk);
+            bytesRead += chunk;
+            byteNumber = 0;
+            if (bytesRead == size) {
+                break;
+            }
+            targetIndex++;
+        }
+
+        memcpy(&dataBlock, blockData + DATA_NEXT_BLOCK_OFFSET, sizeof(int));
+        if (readBlock(fs->disk, dataBlock, blockData) < 0) {
+            cursor->block = 0;
+            return FILE_READ_ERROR;
+        }
+        cursor->block = dataBlock;
+        cursor->index++;
     }
+    return bytesRead;
+}
 
-    // Check if the first inode is the one to delete
-    if (currentInode == inodeToDelete) {
-        // Update super block to point to next inode
-        memcpy(superData + IB_OFFSET, currentInodeBuffer + INODE_NEXT_INODE_OFFSET, sizeof(int));
-        int writeSuccess = writeBlock(activeDisk, SUPER_BLOCK, superData);
-        if (writeSuccess < 0) {
-            printf("Issue with super block write when deleting file\n");
-            return FILE_DELETE_ERROR;
+/* Lists the next n blocks of an extent-format file in ios, starting at
+block *blockIndex of extent *extent and advancing both, with buffers taken
+from buffers in order. Returns n, or an error code if the extent list ends
+first. */
+int nextExtentBlocks(tfs_fs *fs, fileExtent *extents, int count, int *extent, int *blockIndex, BlockIO *ios, int n, char *buffers) {
+    for (int i = 0; i < n; i++) {
+        if (*extent >= count) {
+            printf("Extent list ends before the end of the file\n");
+            return FILE_READ_ERROR;
         }
-    } else {
-        // Traverse inode list to find the target inode
-        int nextInode;
-        memcpy(&nextInode, currentInodeBuffer + INODE_NEXT_INODE_OFFSET, sizeof(int));
-        while (nextInode != inodeToDelete) {
-            success = readBlock(activeDisk, nextInode, currentInodeBuffer);
-            if (success < 0) {
-                printf("Invalid pointer to inode block\n");
-                return FILE_DELETE_ERROR;
-            }
-            currentInode = nextInode;
-            memcpy(&nextInode, currentInodeBuffer + INODE_NEXT_INODE_OFFSET, sizeof(int));
+        ios[i].bNum = extents[*extent].start + *blockIndex;
+        ios[i].block = buffers + (size_t)i * fs->blockSize;
+        if (++*blockIndex == extents[*extent].length) {
+            *blockIndex = 0;
+            (*extent)++;
         }
+    }
+    return n;
+}
 
-        // Update the previous inode to skip the deleted inode
-        char *nextinodeBuffer = (char *)malloc(BLOCKSIZE);
-        success = readBlock(activeDisk, nextInode, nextinodeBuffer);
-        if (success < 0) {
-            printf("Invalid pointer to inode block\n");
-            return FILE_DELETE_ERROR;
+/* Copies the data of n fetched blocks into buffer after *bytesRead bytes,
+starting at *byteNumber within the first, and leaves the last block in the
+cursor */
+void copyExtentBlocks(tfs_fs *fs, readCursor *cursor, BlockIO *ios, int n, char *buffer, int size, int *bytesRead, int *byteNumber) {
+    for (int i = 0; i < n; i++) {
+        int chunk = fs->dataSize - *byteNumber;
+        if (chunk > size - *bytesRead) {
+            chunk = size - *bytesRead;
         }
-        int inodeAfterToDelete;
-        memcpy(&inodeAfterToDelete, nextinodeBuffer + INODE_NEXT_INODE_OFFSET, sizeof(int));
-        memcpy(currentInodeBuffer + INODE_NEXT_INODE_OFFSET, &inodeAfterToDelete, sizeof(int));
-        int writeSuccess = writeBlock(activeDisk, currentInode, currentInodeBuffer);
-        if (writeSuccess < 0) {
-            printf("Issue with inode block write when deleting file\n");
-            return FILE_DELETE_ERROR;
+        memcpy(buffer + *bytesRead, (char *)ios[i].block + DATA_BLOCK_DATA_OFFSET + *byteNumber, chunk);
+        *bytesRead += chunk;
+        *byteNumber = 0;
+    }
+    memcpy(cursor->data, ios[n - 1].block, fs->blockSize);
+    cursor->block = ios[n - 1].bNum;
+}
+
+/* Copies size bytes starting at byte offset of an extent-format file
+into buffer. The block holding offset is found from the extent list by
+arithmetic, so no data block is read to get there. The blocks are
+fetched READ_BATCH_BLOCKS at a time as asynchronous batches, and the
+next batch is submitted before the current one is copied out, so a long
+read keeps up to two batches in flight; a read that fits in one batch is
+done synchronously, as there is nothing to overlap it with. The last
+block fetched stays in the open file's cursor, so small sequential reads
+do not fetch it again. Returns size, or an error code. */
+int readExtentData(tfs_fs *fs, readCursor *cursor, char *inodeBuffer, int offset, char *buffer, int size) {
+    fileExtent extents[MAX_FILE_EXTENTS];
+    int count = readExtents(fs, inodeBuffer, extents);
+    if (count < 0) {
+        return count;
+    }
+
+    // Find the extent and the block within it that hold offset
+    int extent = 0;
+    int blockIndex = offset / fs->dataSize;
+    int byteNumber = offset % fs->dataSize;
+    while (extent < count && blockIndex >= extents[extent].length) {
+        blockIndex -= extents[extent].length;
+        extent++;
+    }
+    if (extent >= count) {
+        printf("Extent list ends before the end of the file\n");
+        return FILE_READ_ERROR;
+    }
+
+    // The block the cursor holds is copied without a read
+    int bytesRead = 0;
+    int blocksLeft = (byteNumber + size + fs->dataSize - 1) / fs->dataSize;
+    if (extents[extent].start + blockIndex == cursor->block) {
+        int chunk = fs->dataSize - byteNumber;
+        if (chunk > size) {
+            chunk = size;
         }
-        free(nextinodeBuffer);
+        memcpy(buffer, cursor->data + DATA_BLOCK_DATA_OFFSET + byteNumber, chunk);
+        bytesRead = chunk;
+        byteNumber = 0;
+        blocksLeft--;
+        if (++blockIndex == extents[extent].length) {
+            blockIndex = 0;
+            extent++;
+        }
+    }
+    if (blocksLeft == 0) {
+        return bytesRead;
     }
 
-    // Free all data blocks associated with the inode
-    success = readBlock(activeDisk, inodeToDelete, currentInodeBuffer);
-    if (success < 0) {
-        printf("Invalid pointer to inode block\n");
-        return FILE_DELETE_ERROR;
+    char *batchData = (char *)malloc((size_t)(blocksLeft > READ_BATCH_BLOCKS ? 2 : 1) * READ_BATCH_BLOCKS * fs->blockSize);
+    if (batchData == NULL) {
+        return MEM_ALLOC_FAILURE;
     }
-    int dataBlockPointer;
-    memcpy(&dataBlockPointer, currentInodeBuffer + INODE_DATA_BLOCK_OFFSET, sizeof(int));
-    if (dataBlockPointer != 0) {
-        char *dataBlock = (char *)malloc(BLOCKSIZE);
-        while (1) {
-            success = readBlock(activeDisk, dataBlockPointer, dataBlock);
-            if (success < 0) {
-                printf("Invalid pointer to data block\n");
-                return FILE_DELETE_ERROR;
+    BlockIO ios[2][READ_BATCH_BLOCKS];
+    if (blocksLeft <= READ_BATCH_BLOCKS) {
+        int success = nextExtentBlocks(fs, extents, count, &extent, &blockIndex, ios[0], blocksLeft, batchData);
+        if (success >= 0 && readBlocks(fs->disk, ios[0], blocksLeft) < 0) {
+            success = FILE_READ_ERROR;
+        }
+        if (success >= 0) {
+            copyExtentBlocks(fs, cursor, ios[0], blocksLeft, buffer, size, &bytesRead, &byteNumber);
+        }
+        free(batchData);
+        return (success < 0) ? success : bytesRead;
+    }
+    DiskBatch *batches[2] = {NULL, NULL};
+    int counts[2] = {0, 0};
+    int current = 0;
+    int success = 0;
+    while (success >= 0 && (blocksLeft > 0 || batches[current] != NULL)) {
+        // Keep a batch in flight behind the one about to be copied out
+        for (int b = current; b != current + 2 && blocksLeft > 0; b++) {
+            int slot = b % 2;
+            if (batches[slot] != NULL) {
+                continue;
             }
-            int nextDataBlockPointer;
-            memcpy(&nextDataBlockPointer, dataBlock + DATA_NEXT_BLOCK_OFFSET, sizeof(int));
-            deallocateBlock(dataBlockPointer);
-            dataBlockPointer = nextDataBlockPointer;
-            if (dataBlockPointer == 0) {
+            int n = (blocksLeft < READ_BATCH_BLOCKS) ? blocksLeft : READ_BATCH_BLOCKS;
+            counts[slot] = nextExtentBlocks(fs, extents, count, &extent, &blockIndex, ios[slot], n, batchData + (size_t)slot * READ_BATCH_BLOCKS * fs->blockSize);
+            if (counts[slot] < 0 || (batches[slot] = readBlocksAsync(fs->disk, ios[slot], n)) == NULL) {
+                success = FILE_READ_ERROR;
                 break;
             }
+            blocksLeft -= n;
+        }
+        if (success < 0 || waitDiskBatch(batches[current]) < 0) {
+            success = FILE_READ_ERROR;
+        }
+        batches[current] = NULL;
+        if (success < 0) {
+            break;
         }
-        free(dataBlock);
+
+        copyExtentBlocks(fs, cursor, ios[current], counts[current], buffer, size, &bytesRead, &byteNumber);
+        current = 1 - current;
     }
 
-    // Free memory
-    deallocateBlock(inodeToDelete);
-    tfs_closeFile(fileDescriptor);
-    free(superData);
-    free(currentInodeBuffer);
-    return 1;
+    // A failed read still reaps whatever it left in flight
+    for (int b = 0; b < 2; b++) {
+        if (batches[b] != NULL) {
+            waitDiskBatch(batches[b]);
+        }
+    }
+    free(batchData);
+    return (success < 0) ? success : bytesRead;
 }
 
-/* reads one byte from the file and copies it to buffer, using the
-current file pointer location and incrementing it by one upon success.
-If the file pointer is already past the end of the file then
-tfs_readByte() should return an error and not increment the file pointer.
-*/
-
-int tfs_readByte(fileDescriptor fileDescriptor, char *buffer) {
-
-    // Check if a disk is mounted
-    if (activeDisk == INT_NULL) {
-        printf("Error: No disk mounted. Cannot find file. (readByte)\n");
-        return FS_MOUNT_ERROR;
-    }
+/* reads up to ‘size’ bytes from the file into buffer, starting at the
+current file pointer location and advancing it by the number of bytes
+read. Streaming a file costs about one block read per block: chained
+files are walked once per call from the open file's cursor, and extent
+files jump straight to the right block. Returns the number of bytes
+read, which is 0 once the file pointer is at or past the end of the
+file. */
 
+int readLocked(tfs_fs *fs, fileDescriptor fileDescriptor, char *buffer, int size) {
     // Retrieve the file descriptor entry
-    fileDescriptorTableEntry *fileDescriptorEntry = fileDescriptorTable[fileDescriptor];
-    if (fileDescriptorEntry == NULL) {
-        printf("Error: File has not been opened. (readByte)\n");
-        return FILE_BAD_DESCRIPTOR;
+    fileDescriptorTableEntry *fileDescriptorEntry = fs->fileDescriptorTable[fileDescriptor];
+    if (size < 0) {
+        printf("Error: Negative read size. (read)\n");
+        return FILE_READ_ERROR;
     }
     int fileInode = fileDescriptorEntry->inodeNumber;
-    int filePointer = fileDescriptorEntry->filePointer;
 
     // Read the inode block associated with the file descriptor
-    char *inodeBuffer = (char *)malloc(BLOCKSIZE * sizeof(char));
-    int success = readBlock(activeDisk, fileInode, inodeBuffer);
+    char *inodeBuffer = (char *)malloc(fs->blockSize);
+    char *cursorData = (char *)malloc(fs->blockSize);
+    if (inodeBuffer == NULL || cursorData == NULL) {
+        free(inodeBuffer);
+        free(cursorData);
+        return MEM_ALLOC_FAILURE;
+    }
+    int success = readBlock(fs->disk, fileInode, inodeBuffer);
     if (success < 0) {
         free(inodeBuffer);
-        printf("Error: Issue with inode read. (readByte)\n");
+        free(cursorData);
+        printf("Error: Issue with inode read. (read)\n");
         return FILE_READ_ERROR;
     }
 
-     // Extract file size and data block pointer
+    // Extract file size and data block pointer, and clamp the read to EOF
     int currentFileSize;
     memcpy(&currentFileSize, inodeBuffer + INODE_FILE_SIZE_OFFSET, sizeof(int));
     int dataBlock;
     memcpy(&dataBlock, inodeBuffer + INODE_DATA_BLOCK_OFFSET, sizeof(int));
-    if (filePointer >= currentFileSize) {
+
+    // Claim the bytes by advancing the file pointer, and copy the cursor so
+    // readers sharing the file each walk from their own
+    pthread_mutex_lock(&fileDescriptorEntry->cursorLock);
+    int filePointer = fileDescriptorEntry->filePointer;
+    if (filePointer < 0 || filePointer >= currentFileSize || size == 0) {
+        pthread_mutex_unlock(&fileDescriptorEntry->cursorLock);
         free(inodeBuffer);
-        printf("\nError: File pointer out of bounds, EOF. (readByte)\n");
-        return BLOCK_READ_ERROR;
+        free(cursorData);
+        return 0;
+    }
+    if (size > currentFileSize - filePointer) {
+        size = currentFileSize - filePointer;
     }
+    fileDescriptorEntry->filePointer = filePointer + size;
+    readCursor cursor = {fileDescriptorEntry->cursorBlock, fileDescriptorEntry->cursorIndex, cursorData};
+    memcpy(cursorData, fileDescriptorEntry->cursorData, fs->blockSize);
+    pthread_mutex_unlock(&fileDescriptorEntry->cursorLock);
 
-     // Read the correct data block based on the file pointer
-    int blockNumber = filePointer / USEABLE_DATA_SIZE;
-    int byteNumber = filePointer % USEABLE_DATA_SIZE;
-    char *blockData = (char *)malloc(BLOCKSIZE * sizeof(char));
-    success = readBlock(activeDisk, dataBlock, blockData);
-    if (success < 0) {
+    // Copy the data out, following the extent list or the data chain
+    int bytesRead;
+    if (fs->superBlock.version >= FORMAT_EXTENTS) {
+        bytesRead = readExtentData(fs, &cursor, inodeBuffer, filePointer, buffer, size);
+    } else {
+        bytesRead = readChainData(fs, &cursor, dataBlock, filePointer, buffer, size);
+    }
+
+    // Hand the cursor back and update the access timestamp, writing the
+    // inode back only if the mount's access-time mode asks for it. A failed
+    // read gives its bytes back unless another read has claimed more since.
+    pthread_mutex_lock(&fileDescriptorEntry->cursorLock);
+    if (bytesRead < 0) {
+        if (fileDescriptorEntry->filePointer == filePointer + size) {
+            fileDescriptorEntry->filePointer = filePointer;
+        }
+        pthread_mutex_unlock(&fileDescriptorEntry->cursorLock);
         free(inodeBuffer);
-        free(blockData);
-        printf("Error: Issue with data read. (readByte)\n");
+        free(cursorData);
+        printf("Error: Issue with data read. (read)\n");
         return FILE_READ_ERROR;
     }
-    while (blockNumber != 0) {
-        memcpy(&dataBlock, blockData + DATA_NEXT_BLOCK_OFFSET, sizeof(int));
-        success = readBlock(activeDisk, dataBlock, blockData);
-        if (success < 0) {
-            free(inodeBuffer);
-            free(blockData);
-            printf("Error: Issue with data read. (readByte)\n");
-            return FILE_READ_ERROR;
-        }
-        blockNumber--;
+    if (cursor.block != fileDescriptorEntry->cursorBlock) {
+        memcpy(fileDescriptorEntry->cursorData, cursorData, fs->blockSize);
     }
-
-     // Read byte into buffer
-    memcpy(buffer, blockData + DATA_BLOCK_DATA_OFFSET + byteNumber, sizeof(char));
-
-    // Increment file pointer
-    tfs_seek(fileDescriptor, 1);
-
-    // Update access timestamp in inode
-    char *timeStampBuffer = (char *)malloc(TIMESTAMP_BUFFER_SIZE);
-    getTimestamp(timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    memcpy(inodeBuffer + INODE_ACC_TIME_STAMP_OFFSET, timeStampBuffer, TIMESTAMP_BUFFER_SIZE);
-    free(timeStampBuffer);
-
-    // Write updated inode data back to disk
-    success = writeBlock(activeDisk, fileInode, inodeBuffer);
+    fileDescriptorEntry->cursorBlock = cursor.block;
+    fileDescriptorEntry->cursorIndex = cursor.index;
+    int touched = touchAccessTime(fs, fileDescriptorEntry, inodeBuffer, currentTime());
+    pthread_mutex_unlock(&fileDescriptorEntry->cursorLock);
+    free(cursorData);
+    success = 1;
+    if (touched) {
+        success = fsWriteBlock(fs, fileInode, inodeBuffer);
+    }
+    free(inodeBuffer);
     if (success < 0) {
-        free(inodeBuffer);
-        free(blockData);
-        printf("Error: Inode block could not be updated. (readByte)\n");
+        printf("Error: Inode block could not be updated. (read)\n");
         return FILE_WRITE_ERROR;
     }
 
-    // Free memory
-    free(inodeBuffer);
-    free(blockData);
+    return bytesRead;
+}
 
+/* Reads share the file's lock, so any number of threads read one file at
+once; each claims its bytes from the shared file pointer */
+int fsRead(tfs_fs *fs, fileDescriptor fileDescriptor, char *buffer, int size) {
+    // Check if a disk is mounted
+    if (fs == NULL) {
+        printf("Error: No disk mounted. Cannot find file. (read)\n");
+        return FS_MOUNT_ERROR;
+    }
+    fileDescriptorTableEntry *entry = lockFile(fs, fileDescriptor, 0);
+    if (entry == NULL) {
+        printf("Error: File has not been opened. (read)\n");
+        return FILE_BAD_DESCRIPTOR;
+    }
+    int result = readLocked(fs, fileDescriptor, buffer, size);
+    unlockFile(entry);
+    return result;
+}
+
+/* reads one byte from the file and copies it to buffer, using the
+current file pointer location and incrementing it by one upon success.
+If the file pointer is already past the end of the file then
+tfs_readByte() should return an error and not increment the file pointer.
+*/
+
+int fsReadByte(tfs_fs *fs, fileDescriptor fileDescriptor, char *buffer) {
+    int bytesRead = fsRead(fs, fileDescriptor, buffer, 1);
+    if (bytesRead < 0) {
+        return bytesRead;
+    }
+    if (bytesRead == 0) {
+        printf("\nError: File pointer out of bounds, EOF. (readByte)\n");
+        return BLOCK_READ_ERROR;
+    }
     return 1;
 }
 
 /* change the file pointer location to offset (absolute). Returns
 success/error codes.*/
 
-int tfs_seek(int descriptor, int offset) {
+int fsSeek(tfs_fs *fs, int descriptor, int offset) {
     // Check if there is a disk mounted before attempting to seek
-    if (activeDisk == INT_NULL) {
+    if (fs == NULL) {
         printf("Error: No disk mounted. Cannot perform seek operation. (seek)\n");
         return FS_MOUNT_ERROR;
     }
 
     // Retrieve the file descriptor entry from the file descriptor table
-    fileDescriptorTableEntry *entry = fileDescriptorTable[descriptor];
+    fileDescriptorTableEntry *entry = lockFile(fs, descriptor, 0);
     if (entry == NULL) {
         printf("Error: File descriptor not found or file not opened. (seek)\n");
         return FILE_BAD_DESCRIPTOR;
     }
 
     // Calculate the new file pointer position by adding the offset
+    pthread_mutex_lock(&entry->cursorLock);
     int newFilePointer = entry->filePointer + offset;
 
     // Update the file pointer in the file descriptor entry
     entry->filePointer = newFilePointer;
+    pthread_mutex_unlock(&entry->cursorLock);
+    unlockFile(entry);
 
     // Return the updated file pointer position
     return newFilePointer;
 }
 
-int tfs_readdir() {
-    // Check if a disk is mounted
-    if (activeDisk == INT_NULL) {
-        printf("Error: No disk mounted. Cannot perform directory read. (readdir)\n");
-        return FS_MOUNT_ERROR;
-    }
-
-    // Allocate and read super block data
-    char *superBlockData = (char *)malloc(BLOCKSIZE);
-    if (superBlockData == NULL) {
-        printf("Memory allocation failure for super block data.\n");
-        return MEM_ALLOC_FAILURE; // Define this error code accordingly
-    }
-
-    int readStatus = readBlock(activeDisk, SUPER_BLOCK, superBlockData);
-    if (readStatus < 0) {
-        free(superBlockData);
-        printf("Error: Issue with super block read. (readdir)\n");
-        return FILE_READ_ERROR;
-    }
-
-    // Extract the head of the inode list from the super block
-    int inodeIndex;
-    memcpy(&inodeIndex, superBlockData + IB_OFFSET, sizeof(int));
-    free(superBlockData);  // Free super block data after use
+int readdirLocked(tfs_fs *fs) {
+    // Start from the head of the inode list in the pinned super block
+    int inodeIndex = fs->superBlock.inodeHead;
+    int readStatus;
 
     printf("\nFILE SYSTEM:\nroot directory:\n");
 
     // Iterate through inode list and print file names
     while (inodeIndex != 0) {
-        char *inodeBuffer = (char *)malloc(BLOCKSIZE);
+        char *inodeBuffer = (char *)malloc(fs->blockSize);
         if (inodeBuffer == NULL) {
             printf("Memory allocation failure for inode data.\n");
             return MEM_ALLOC_FAILURE; // Define this error code accordingly
         }
 
-        readStatus = readBlock(activeDisk, inodeIndex, inodeBuffer);
+        readStatus = readBlock(fs->disk, inodeIndex, inodeBuffer);
         if (readStatus < 0) {
             free(inodeBuffer);
             printf("Error: Issue with inode block read. (readdir)\n");
@@ -911,32 +2925,34 @@ int tfs_readdir() {
     return 1;
 }
 
-int tfs_rename(int fd, char *newName) {
-
-    // Check if the new name is within the allowable length limit
-    if (strlen(newName) >= MAX_FILE_NAME_SIZE) {
-        printf("Error: File name is too long, cannot be supported. (rename)\n");
-        return FILE_RENAME_ERROR;
-    }
-
+int fsReaddir(tfs_fs *fs) {
     // Check if a disk is mounted
-    if (activeDisk == INT_NULL) {
-        printf("Error: No disk mounted. Cannot find file. (rename)\n");
+    if (fs == NULL) {
+        printf("Error: No disk mounted. Cannot perform directory read. (readdir)\n");
         return FS_MOUNT_ERROR;
     }
+    pthread_rwlock_rdlock(&fs->namespaceLock);
+    int result = readdirLocked(fs);
+    pthread_rwlock_unlock(&fs->namespaceLock);
+    return result;
+}
 
+int renameLocked(tfs_fs *fs, int fd, char *newName) {
     // Retrieve the file descriptor table entry
-    fileDescriptorTableEntry *descriptorEntry = fileDescriptorTable[fd];
-    if (descriptorEntry == NULL) {
-        printf("Error: File has not been opened. (rename)\n");
-        return FILE_BAD_DESCRIPTOR;
+    fileDescriptorTableEntry *descriptorEntry = fs->fileDescriptorTable[fd];
+    int inodeIndex = descriptorEntry->inodeNumber;
+
+    // Names must stay unique for lookups by name to find the right file
+    int existingInode = lookupName(fs, newName);
+    if (existingInode != 0 && existingInode != inodeIndex) {
+        printf("Error: A file named %s already exists. (rename)\n", newName);
+        return FILE_RENAME_ERROR;
     }
 
-    int inodeIndex = descriptorEntry->inodeNumber;
-    char *inodeBuffer = (char *)malloc(BLOCKSIZE * sizeof(char));
+    char *inodeBuffer = (char *)malloc(fs->blockSize);
 
     // Read the inode block
-    int readStatus = readBlock(activeDisk, inodeIndex, inodeBuffer);
+    int readStatus = readBlock(fs->disk, inodeIndex, inodeBuffer);
     if (readStatus < 0) {
         free(inodeBuffer);
         printf("Error: Issue with inode block read. (rename)\n");
@@ -944,25 +2960,336 @@ int tfs_rename(int fd, char *newName) {
     }
 
     // Clear and set new file name in the inode block
+    char oldName[MAX_FILE_NAME_SIZE];
+    memcpy(oldName, inodeBuffer + INODE_FILE_NAME_OFFSET, MAX_FILE_NAME_SIZE);
+    oldName[MAX_FILE_NAME_SIZE - 1] = '\0';
     memset(inodeBuffer + INODE_FILE_NAME_OFFSET, 0, MAX_FILE_NAME_SIZE * sizeof(char));
     memcpy(inodeBuffer + INODE_FILE_NAME_OFFSET, newName, strlen(newName) * sizeof(char));
 
     // Update modification timestamp
-    char *timestamp = (char *)malloc(TIMESTAMP_BUFFER_SIZE);
-    getTimestamp(timestamp, TIMESTAMP_BUFFER_SIZE);
-    memcpy(inodeBuffer + INODE_MOD_TIME_STAMP_OFFSET, timestamp, TIMESTAMP_BUFFER_SIZE);
-    free(timestamp);
+    storeInodeTime(fs, inodeBuffer, INODE_TIME_MODIFIED, currentTime());
 
     // Write the updated inode block back to disk
-    int writeStatus = writeBlock(activeDisk, inodeIndex, inodeBuffer);
+    int writeStatus = fsWriteBlock(fs, inodeIndex, inodeBuffer);
     if (writeStatus < 0) {
         free(inodeBuffer);
         printf("Error: Issue with inode block write. (rename)\n");
         return FILE_WRITE_ERROR;
     }
 
+    // Move the file to its new name in the index
+    removeName(fs, oldName, inodeIndex);
+    if (insertName(fs, newName, inodeIndex) < 0) {
+        free(inodeBuffer);
+        printf("Error: Could not update file name index. (rename)\n");
+        return MEM_ALLOC_FAILURE;
+    }
+
     // Free memory
     free(inodeBuffer);
 
     return 1;
-}
\ No newline at end of file
+}
+
+int fsRename(tfs_fs *fs, int fd, char *newName) {
+
+    // Check if the new name is within the allowable length limit
+    if (strlen(newName) >= MAX_FILE_NAME_SIZE) {
+        printf("Error: File name is too long, cannot be supported. (rename)\n");
+        return FILE_RENAME_ERROR;
+    }
+
+    // Check if a disk is mounted
+    if (fs == NULL) {
+        printf("Error: No disk mounted. Cannot find file. (rename)\n");
+        return FS_MOUNT_ERROR;
+    }
+    pthread_rwlock_wrlock(&fs->namespaceLock);
+    fileDescriptorTableEntry *entry = lockFile(fs, fd, 1);
+    if (entry == NULL) {
+        pthread_rwlock_unlock(&fs->namespaceLock);
+        printf("Error: File has not been opened. (rename)\n");
+        return FILE_BAD_DESCRIPTOR;
+    }
+    int result = renameLocked(fs, fd, newName);
+    unlockFile(entry);
+    pthread_rwlock_unlock(&fs->namespaceLock);
+    return result;
+}
+
+/* Operation statistics. Each thread counts into its own statsTable,
+found through a thread-local pointer, so counting a call takes no lock or
+atomic read-modify-write and threads never share a cache line. A table
+is linked into statsTables when its thread first counts, and stays there
+after the thread exits so its calls remain in the totals. Only the owning
+thread writes a table, with relaxed atomic stores that tfs_getStats reads
+with relaxed loads. tfs_resetStats cannot clear other threads' tables, so
+it saves the current totals in statsBaseline for tfs_getStats to subtract.
+Building with TFS_NO_STATS compiles all of it out. */
+#ifndef TFS_NO_STATS
+typedef struct statsTable {
+    tfs_opStats ops[TFS_OP_COUNT];
+    struct statsTable *next;
+} statsTable;
+
+__thread statsTable *threadStats = NULL;
+statsTable *statsTables = NULL;
+tfs_opStats statsBaseline[TFS_OP_COUNT];
+pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t opClock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Adds n to a counter that only the calling thread writes */
+void addCount(unsigned long *counter, unsigned long n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+/* Counts a call of op that started at start and returned result. Returns
+result, so a public function can return through it. */
+int opDone(int op, uint64_t start, int result) {
+    uint64_t nanos = opClock() - start;
+    statsTable *table = threadStats;
+
+    if (table == NULL) {
+        // Calls go uncounted rather than fail when there is no memory
+        if ((table = (statsTable *)calloc(1, sizeof(statsTable))) == NULL) {
+            return result;
+        }
+        pthread_mutex_lock(&statsLock);
+        table->next = statsTables;
+        statsTables = table;
+        pthread_mutex_unlock(&statsLock);
+        threadStats = table;
+    }
+
+    int bucket = (nanos == 0) ? 0 : 63 - __builtin_clzll(nanos);
+    if (bucket >= TFS_LATENCY_BUCKETS) {
+        bucket = TFS_LATENCY_BUCKETS - 1;
+    }
+    tfs_opStats *stats = &table->ops[op];
+    addCount(&stats->calls, 1);
+    if (result < 0) {
+        addCount(&stats->errors, 1);
+    }
+    addCount(&stats->totalNanos, nanos);
+    addCount(&stats->latency[bucket], 1);
+    return result;
+}
+
+/* Adds up every thread's counters. Called with statsLock held. */
+void sumStats(tfs_opStats *totals) {
+    memset(totals, 0, TFS_OP_COUNT * sizeof(tfs_opStats));
+    for (statsTable *table = statsTables; table != NULL; table = table->next) {
+        for (int op = 0; op < TFS_OP_COUNT; op++) {
+            tfs_opStats *from = &table->ops[op];
+            totals[op].calls += __atomic_load_n(&from->calls, __ATOMIC_RELAXED);
+            totals[op].errors += __atomic_load_n(&from->errors, __ATOMIC_RELAXED);
+            totals[op].totalNanos += __atomic_load_n(&from->totalNanos, __ATOMIC_RELAXED);
+            for (int b = 0; b < TFS_LATENCY_BUCKETS; b++) {
+                totals[op].latency[b] += __atomic_load_n(&from->latency[b], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+#else
+#define opClock() 0
+#define opDone(op, start, result) ((void)(start), (result))
+#endif
+
+/* Fills stats with the counters of every operation since the last
+tfs_resetStats, together with libDisk's I/O counters. Calls still running
+on other threads may or may not be included. */
+int tfs_getStats(tfs_stats *stats) {
+    memset(stats, 0, sizeof(tfs_stats));
+#ifndef TFS_NO_STATS
+    pthread_mutex_lock(&statsLock);
+    sumStats(stats->ops);
+    for (int op = 0; op < TFS_OP_COUNT; op++) {
+        stats->ops[op].calls -= statsBaseline[op].calls;
+        stats->ops[op].errors -= statsBaseline[op].errors;
+        stats->ops[op].totalNanos -= statsBaseline[op].totalNanos;
+        for (int b = 0; b < TFS_LATENCY_BUCKETS; b++) {
+            stats->ops[op].latency[b] -= statsBaseline[op].latency[b];
+        }
+    }
+    pthread_mutex_unlock(&statsLock);
+    getDiskIOStats(&stats->disk);
+    return 1;
+#else
+    return STATS_DISABLED;
+#endif
+}
+
+/* Starts every counter tfs_getStats reports over from zero */
+int tfs_resetStats(void) {
+#ifndef TFS_NO_STATS
+    pthread_mutex_lock(&statsLock);
+    sumStats(statsBaseline);
+    pthread_mutex_unlock(&statsLock);
+    resetDiskIOStats();
+    return 1;
+#else
+    return STATS_DISABLED;
+#endif
+}
+
+/* Name of a TFS_OP_* operation, for printing statistics, or NULL */
+const char *tfs_opName(int op) {
+    const char *names[TFS_OP_COUNT] = {
+        "mkfs", "mount", "unmount", "sync", "openFile", "closeFile", "writeFile", "pwrite", "append",
+        "deleteFile", "readByte", "read", "seek", "rename", "zeroFreeBlocks", "readdir", "readFileInfo"};
+    return (op >= 0 && op < TFS_OP_COUNT) ? names[op] : NULL;
+}
+
+/* The public operations time themselves around the functions that do the
+work */
+
+int tfs_mkfsWithBlockSize(char *filename, int nBytes, int blockSize) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_MKFS, start, formatDisk(filename, nBytes, blockSize));
+}
+
+tfs_fs *tfs_fsMount(char *diskname, int flags) {
+    uint64_t start = opClock();
+    tfs_fs *fs = fsMount(diskname, flags);
+    (void)opDone(TFS_OP_MOUNT, start, (fs != NULL) ? 1 : FS_MOUNT_ERROR);
+    return fs;
+}
+
+int tfs_fsUnmount(tfs_fs *fs) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_UNMOUNT, start, fsUnmount(fs));
+}
+
+int tfs_fsSync(tfs_fs *fs) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_SYNC, start, fsSync(fs));
+}
+
+fileDescriptor tfs_fsOpenFile(tfs_fs *fs, char *name) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_OPEN, start, fsOpenFile(fs, name));
+}
+
+int tfs_fsCloseFile(tfs_fs *fs, fileDescriptor FD) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_CLOSE, start, fsCloseFile(fs, FD));
+}
+
+int tfs_fsWriteFile(tfs_fs *fs, fileDescriptor FD, char *buffer, int size) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_WRITE, start, fsWriteFile(fs, FD, buffer, size));
+}
+
+int tfs_fsPwrite(tfs_fs *fs, fileDescriptor FD, char *buffer, int size, int offset) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_PWRITE, start, fsPwrite(fs, FD, buffer, size, offset));
+}
+
+int tfs_fsAppend(tfs_fs *fs, fileDescriptor FD, char *buffer, int size) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_APPEND, start, fsAppend(fs, FD, buffer, size));
+}
+
+int tfs_fsDeleteFile(tfs_fs *fs, fileDescriptor FD) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_DELETE, start, fsDeleteFile(fs, FD));
+}
+
+int tfs_fsReadByte(tfs_fs *fs, fileDescriptor FD, char *buffer) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_READBYTE, start, fsReadByte(fs, FD, buffer));
+}
+
+int tfs_fsRead(tfs_fs *fs, fileDescriptor FD, char *buffer, int size) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_READ, start, fsRead(fs, FD, buffer, size));
+}
+
+int tfs_fsSeek(tfs_fs *fs, fileDescriptor FD, int offset) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_SEEK, start, fsSeek(fs, FD, offset));
+}
+
+int tfs_fsRename(tfs_fs *fs, fileDescriptor FD, char *newName) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_RENAME, start, fsRename(fs, FD, newName));
+}
+
+int tfs_fsZeroFreeBlocks(tfs_fs *fs, int maxBlocks) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_ZERO, start, fsZeroFreeBlocks(fs, maxBlocks));
+}
+
+int tfs_fsReaddir(tfs_fs *fs) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_READDIR, start, fsReaddir(fs));
+}
+
+int tfs_fsReadFileInfo(tfs_fs *fs, fileDescriptor FD) {
+    uint64_t start = opClock();
+    return opDone(TFS_OP_READINFO, start, fsReadFileInfo(fs, FD));
+}
+
+/* Single-mount API: each function runs on the file system mounted by
+tfs_mount */
+
+int tfs_sync(void) {
+    return tfs_fsSync(defaultFs);
+}
+
+fileDescriptor tfs_openFile(char *name) {
+    return tfs_fsOpenFile(defaultFs, name);
+}
+
+int tfs_closeFile(fileDescriptor FD) {
+    return tfs_fsCloseFile(defaultFs, FD);
+}
+
+int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
+    return tfs_fsWriteFile(defaultFs, FD, buffer, size);
+}
+
+int tfs_pwrite(fileDescriptor FD, char *buffer, int size, int offset) {
+    return tfs_fsPwrite(defaultFs, FD, buffer, size, offset);
+}
+
+int tfs_append(fileDescriptor FD, char *buffer, int size) {
+    return tfs_fsAppend(defaultFs, FD, buffer, size);
+}
+
+int tfs_deleteFile(fileDescriptor FD) {
+    return tfs_fsDeleteFile(defaultFs, FD);
+}
+
+int tfs_readByte(fileDescriptor FD, char *buffer) {
+    return tfs_fsReadByte(defaultFs, FD, buffer);
+}
+
+int tfs_read(fileDescriptor FD, char *buffer, int size) {
+    return tfs_fsRead(defaultFs, FD, buffer, size);
+}
+
+int tfs_seek(fileDescriptor FD, int offset) {
+    return tfs_fsSeek(defaultFs, FD, offset);
+}
+
+int tfs_rename(fileDescriptor FD, char *newName) {
+    return tfs_fsRename(defaultFs, FD, newName);
+}
+
+int tfs_zeroFreeBlocks(int maxBlocks) {
+    return tfs_fsZeroFreeBlocks(defaultFs, maxBlocks);
+}
+
+int tfs_readdir() {
+    return tfs_fsReaddir(defaultFs);
+}
+
+int tfs_readFileInfo(fileDescriptor FD) {
+    return tfs_fsReadFileInfo(defaultFs, FD);
+}
@@ -1,8 +1,14 @@
 #ifndef libTinyFS_h
 #define libTinyFS_h
+#include <stdint.h>
+#include "libDisk.h"
 
-/* The default size of the disk and file system block */
+/* The default size of the disk and file system block. tfs_mkfsWithBlockSize
+formats an image with any power of two from MIN_BLOCKSIZE to MAX_BLOCKSIZE
+instead; the size is kept in the super block and used from mount on. */
 #define BLOCKSIZE 256
+#define MIN_BLOCKSIZE 256
+#define MAX_BLOCKSIZE 65536
 /* Your program should use a 10240 Byte disk size giving you 40 blocks
 total. This is a default size. You must be able to support different
 possible values */
@@ -13,7 +19,10 @@ possible values */
 typedef int fileDescriptor;
 
 #define MAX_BYTES 2147483647
-#define USEABLE_DATA_SIZE 250
+/* Data bytes held by one data block of a blockSize-byte image, and by one
+of a default-size image */
+#define DATA_BYTES_PER_BLOCK(blockSize) ((blockSize) - DATA_BLOCK_DATA_OFFSET)
+#define USEABLE_DATA_SIZE DATA_BYTES_PER_BLOCK(BLOCKSIZE)
 #define MAGIC_NUMBER 0x44
 #define BLOCK_NUMBER_OFFSET 0
 #define MAGIC_NUMBER_OFFSET 1
@@ -23,6 +32,26 @@ typedef int fileDescriptor;
 #define FB_OFFSET 2
 #define IB_OFFSET 6
 #define SUPER_MAX_NUM_FILES_OFFSET 10
+#define SUPER_VERSION_OFFSET 14
+#define SUPER_TOTAL_BLOCKS_OFFSET 18
+#define SUPER_BITMAP_START_OFFSET 22
+#define SUPER_BITMAP_BLOCKS_OFFSET 26
+#define SUPER_BLOCK_SIZE_OFFSET 30
+#define SUPER_STATE_OFFSET 34
+/* On-disk format versions. Images from before the version field read as
+0 and keep free blocks in a linked list; version 1 tracks them in a bitmap
+region following the super block; version 2 adds extent-based files on
+top of the bitmap; version 3 stores inode timestamps in binary; version 4
+records the block size in the super block, which earlier versions always
+have at BLOCKSIZE; version 5 adds the clean-unmount flag. tfs_mkfs writes
+FORMAT_VERSION. */
+#define FORMAT_FREE_LIST 0
+#define FORMAT_BITMAP 1
+#define FORMAT_EXTENTS 2
+#define FORMAT_BINARY_TIMES 3
+#define FORMAT_BLOCK_SIZE 4
+#define FORMAT_CLEAN_FLAG 5
+#define FORMAT_VERSION FORMAT_CLEAN_FLAG
 #define INODE_BLOCK_TYPE 2
 #define INODE_NEXT_INODE_OFFSET 2
 #define INODE_FILE_SIZE_OFFSET 6
@@ -31,32 +60,232 @@ typedef int fileDescriptor;
 #define INODE_CR8_TIME_STAMP_OFFSET 23
 #define INODE_MOD_TIME_STAMP_OFFSET 48
 #define INODE_ACC_TIME_STAMP_OFFSET 73
+/* Version 3 inodes replace the three timestamp strings with 64-bit
+nanoseconds since the epoch, created, modified and accessed in that
+order. The bytes after them up to INODE_EXTENT_COUNT_OFFSET are unused. */
+#define INODE_TIMES_OFFSET 23
+#define INODE_TIME_SIZE 8
+#define INODE_TIME_CREATED 0
+#define INODE_TIME_MODIFIED 1
+#define INODE_TIME_ACCESSED 2
+/* Extent-format inodes describe their data as runs of contiguous blocks
+instead of a chain: the run count and indirect extent block follow the
+timestamps, then as many (start, length) pairs as fill the inode block.
+Runs past those live in the one indirect extent block. A file has at most
+MAX_FILE_EXTENTS runs whatever the block size. */
+#define INODE_EXTENT_COUNT_OFFSET 100
+#define INODE_INDIRECT_OFFSET 104
+#define INODE_EXTENTS_OFFSET 108
+#define EXTENT_SIZE 8
+#define INODE_DIRECT_EXTENTS(blockSize) (((blockSize) - INODE_EXTENTS_OFFSET) / EXTENT_SIZE)
 #define FREE_BLOCK_TYPE 4
 #define FREE_NEXT_BLOCK_OFFSET 2
 #define DATA_BLOCK_TYPE 3
 #define DATA_NEXT_BLOCK_OFFSET 2
 #define DATA_BLOCK_DATA_OFFSET 6
+#define BITMAP_BLOCK_TYPE 5
+#define BITMAP_DATA_OFFSET 4
+/* Bitmap bytes held by one bitmap block; bit i of the region is set while
+block i is free */
+#define BITMAP_BYTES_PER_BLOCK(blockSize) ((blockSize) - BITMAP_DATA_OFFSET)
+#define EXTENT_BLOCK_TYPE 6
+#define EXTENT_BLOCK_DATA_OFFSET 4
+#define INDIRECT_EXTENTS(blockSize) (((blockSize) - EXTENT_BLOCK_DATA_OFFSET) / EXTENT_SIZE)
+#define MAX_FILE_EXTENTS 1024
+/* Most blocks tfs_read fetches with one vectored read on extent images */
+#define READ_BATCH_BLOCKS 64
 #define MAX_FILE_NAME_SIZE 9
 #define INT_NULL 0
 #define BEGINNING_OF_FILE 0
+/* tfs_mountWithFlags access-time modes, at most one of them per mount.
+With none set every open and read rewrites the inode's access time.
+NOATIME never updates it. RELATIME updates it only when it is older than
+the modification time or more than RELATIME_STALE_SECONDS old. LAZYATIME
+keeps it in the open file entry and writes it at tfs_closeFile, tfs_sync
+and tfs_unmount. */
+#define TFS_MOUNT_NOATIME 0x1
+#define TFS_MOUNT_RELATIME 0x2
+#define TFS_MOUNT_LAZYATIME 0x4
+#define TFS_MOUNT_ATIME_MASK (TFS_MOUNT_NOATIME | TFS_MOUNT_RELATIME | TFS_MOUNT_LAZYATIME)
+#define RELATIME_STALE_SECONDS (24 * 60 * 60)
+/* Starting bucket count of the file name index; it doubles whenever it
+holds more names than buckets */
+#define NAME_INDEX_MIN_BUCKETS 64
+/* Bytes tfs_mkfs formats per sequential write */
+#define MKFS_STAGING_BYTES (1 << 20)
+/* Bytes tfs_mount validates per sequential read when it has to check
+every block of an image that was not cleanly unmounted */
+#define MOUNT_CHECK_BYTES (1 << 20)
 
 
-typedef struct fileDescriptorTableEntry {
+/* An open file, kept in the mount's open file table. Its fields and locks
+are private to libTinyFS.c. */
+typedef struct fileDescriptorTableEntry fileDescriptorTableEntry;
+
+/* A run of length contiguous blocks starting at block start, as stored in
+extent-format inodes */
+typedef struct fileExtent {
+    int start;
+    int length;
+} fileExtent;
+
+/* In-memory copy of the super block, loaded by tfs_mount. Operations
+update it instead of reading and rewriting block 0 each time; it is
+written back (when dirty) by tfs_sync and tfs_unmount. clean is the
+clean-unmount flag of a FORMAT_CLEAN_FLAG image: tfs_unmount sets it once
+everything else is on disk, and it is 0 in memory while mounted. */
+typedef struct superBlockInfo {
+    int freeBlockHead;
+    int inodeHead;
+    int maxNumberOfFiles;
+    int version;
+    int totalBlocks;
+    int bitmapStart;
+    int bitmapBlocks;
+    int blockSize;
+    int clean;
+    int dirty;
+} superBlockInfo;
+
+/* In-memory copy of the free-space bitmap of a FORMAT_BITMAP image, loaded
+by tfs_mount. Allocation scans it a 64-bit word at a time and never reads
+the disk; changed bitmap blocks are written back by tfs_sync and
+tfs_unmount. */
+typedef struct blockBitmap {
+    int bytesPerBlock;
+    int nWords;
+    int hint;
+    uint64_t *words;
+    char *dirty;
+} blockBitmap;
+
+/* In-memory index from file name to inode block, built by tfs_mount from
+one walk of the inode list and kept up to date by tfs_openFile,
+tfs_rename and tfs_deleteFile, so opening a file by name does not read
+the inode list. Names hash into chained buckets. */
+typedef struct nameIndexEntry {
+    char name[MAX_FILE_NAME_SIZE];
     int inodeNumber;
-    int filePointer;
-} fileDescriptorTableEntry;
+    struct nameIndexEntry *next;
+} nameIndexEntry;
+
+typedef struct nameIndex {
+    int nBuckets;
+    int count;
+    nameIndexEntry **buckets;
+} nameIndex;
+
+/* In-memory map from each inode block to the inode before it in the
+inode list (0 for the list head), indexed by block number. Built by
+tfs_mount in the same walk as the name index, so tfs_deleteFile unlinks
+an inode without walking the list to find its predecessor. */
+typedef struct inodeLinkMap {
+    int nSlots;
+    int *prev;
+} inodeLinkMap;
+
+/* Blocks freed since mount that still hold their old contents on disk,
+one bit per block number, waiting for the lazy zeroing pass run by
+tfs_zeroFreeBlocks. Not kept across unmounts. */
+typedef struct zeroPendingSet {
+    int nWords;
+    int count;
+    uint64_t *words;
+} zeroPendingSet;
+
+/* One mounted file system: its disk, pinned super block, in-memory
+indexes and open file table. tfs_fsMount returns one; any number may be
+mounted at once, each on its own disk. Every tfs_fs* call is thread-safe.
+The structure is private to libTinyFS.c, so including this header needs
+no POSIX thread definitions. */
+typedef struct tfs_fs tfs_fs;
+
+/* Public operations counted by tfs_getStats, indexing tfs_stats.ops. A
+call through the single-mount API counts as its tfs_fs* form, and
+tfs_mkfs as tfs_mkfsWithBlockSize. */
+#define TFS_OP_MKFS 0
+#define TFS_OP_MOUNT 1
+#define TFS_OP_UNMOUNT 2
+#define TFS_OP_SYNC 3
+#define TFS_OP_OPEN 4
+#define TFS_OP_CLOSE 5
+#define TFS_OP_WRITE 6
+#define TFS_OP_PWRITE 7
+#define TFS_OP_APPEND 8
+#define TFS_OP_DELETE 9
+#define TFS_OP_READBYTE 10
+#define TFS_OP_READ 11
+#define TFS_OP_SEEK 12
+#define TFS_OP_RENAME 13
+#define TFS_OP_ZERO 14
+#define TFS_OP_READDIR 15
+#define TFS_OP_READINFO 16
+#define TFS_OP_COUNT 17
+/* Latency histogram buckets: bucket i counts calls that took from 2^i to
+2^(i+1) - 1 nanoseconds, bucket 0 also those under a nanosecond, and the
+last bucket everything longer */
+#define TFS_LATENCY_BUCKETS 40
+
+/* Counters of one public operation since the last tfs_resetStats. errors
+counts calls that returned a negative code. */
+typedef struct tfs_opStats {
+    unsigned long calls;
+    unsigned long errors;
+    unsigned long totalNanos;
+    unsigned long latency[TFS_LATENCY_BUCKETS];
+} tfs_opStats;
+
+/* Everything tfs_getStats reports: every operation of every mount in the
+process, and libDisk's I/O counters */
+typedef struct tfs_stats {
+    tfs_opStats ops[TFS_OP_COUNT];
+    DiskIOStats disk;
+} tfs_stats;
 
 int tfs_mkfs(char* filename, int nBytes);
+int tfs_mkfsWithBlockSize(char* filename, int nBytes, int blockSize);
 int tfs_mount(char* diskname);
+int tfs_mountWithFlags(char* diskname, int flags);
 int tfs_unmount(void);
+int tfs_sync(void);
 fileDescriptor tfs_openFile(char* name);
 int tfs_closeFile(fileDescriptor FD);
 int tfs_writeFile(fileDescriptor FD, char* buffer, int size);
+int tfs_pwrite(fileDescriptor FD, char* buffer, int size, int offset);
+int tfs_append(fileDescriptor FD, char* buffer, int size);
 int tfs_deleteFile(fileDescriptor FD);
 int tfs_readByte(fileDescriptor FD, char* buffer);
+int tfs_read(fileDescriptor FD, char* buffer, int size);
 int tfs_seek(fileDescriptor FD, int offset);
 int tfs_rename(fileDescriptor FD, char* newName);
+int tfs_zeroFreeBlocks(int maxBlocks);
 int tfs_readdir();
 int tfs_readFileInfo(fileDescriptor FD);
 
+/* The same operations on an explicit file system context. The functions
+above act on the single file system mounted by tfs_mount. */
+tfs_fs* tfs_fsMount(char* diskname, int flags);
+int tfs_fsUnmount(tfs_fs* fs);
+int tfs_fsSync(tfs_fs* fs);
+fileDescriptor tfs_fsOpenFile(tfs_fs* fs, char* name);
+int tfs_fsCloseFile(tfs_fs* fs, fileDescriptor FD);
+int tfs_fsWriteFile(tfs_fs* fs, fileDescriptor FD, char* buffer, int size);
+int tfs_fsPwrite(tfs_fs* fs, fileDescriptor FD, char* buffer, int size, int offset);
+int tfs_fsAppend(tfs_fs* fs, fileDescriptor FD, char* buffer, int size);
+int tfs_fsDeleteFile(tfs_fs* fs, fileDescriptor FD);
+int tfs_fsReadByte(tfs_fs* fs, fileDescriptor FD, char* buffer);
+int tfs_fsRead(tfs_fs* fs, fileDescriptor FD, char* buffer, int size);
+int tfs_fsSeek(tfs_fs* fs, fileDescriptor FD, int offset);
+int tfs_fsRename(tfs_fs* fs, fileDescriptor FD, char* newName);
+int tfs_fsZeroFreeBlocks(tfs_fs* fs, int maxBlocks);
+int tfs_fsReaddir(tfs_fs* fs);
+int tfs_fsReadFileInfo(tfs_fs* fs, fileDescriptor FD);
+
+/* Call counts, latencies and I/O of every operation, for the whole
+process. Build with TFS_NO_STATS defined to compile the counting out; the
+functions then return STATS_DISABLED. */
+int tfs_getStats(tfs_stats* stats);
+int tfs_resetStats(void);
+const char* tfs_opName(int op);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../libTinyFS.h"
+
+/* Mounts images written by older versions of the library and runs every
+kind of operation on them. v0.dsk was formatted by the original tfs_mkfs
+(a free list, chained files) and v1.dsk by the bitmap allocator before
+extents (a bitmap, chained files). Both are 10240-byte images holding
+"alpha" (600 bytes, 'a' to 'z' repeating) and "beta" (50 bytes, '0' to '9'
+repeating); a third file, "gamma", was written and deleted, so its blocks
+are free again.
+
+Usage: compatTest fixture scratch. The fixture is copied to scratch and
+only the copy is changed. */
+
+#define CHECK(condition)                                             \
+    do {                                                             \
+        if (!(condition)) {                                          \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            return 1;                                                \
+        }                                                            \
+    } while (0)
+
+int copyImage(const char *from, const char *to) {
+    char buffer[4096];
+    size_t n;
+    FILE *in = fopen(from, "rb");
+    FILE *out = (in != NULL) ? fopen(to, "wb") : NULL;
+    int success = (out != NULL) ? 0 : -1;
+
+    while (success == 0 && (n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (fwrite(buffer, 1, n, out) != n) {
+            success = -1;
+        }
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    if (out != NULL && fclose(out) != 0) {
+        success = -1;
+    }
+    return success;
+}
+
+int main(int argc, char *argv[]) {
+    char alpha[600], content[3000], buffer[4000];
+    char byte;
+
+    if (argc != 3) {
+        printf("Usage: %s fixture scratch\n", argv[0]);
+        return 2;
+    }
+    char *image = argv[2];
+    CHECK(copyImage(argv[1], image) == 0);
+    for (int i = 0; i < 600; i++) {
+        alpha[i] = 'a' + i % 26;
+    }
+    memset(content, 'z', sizeof(content));
+
+    // The files written by the old library read back whole and byte by
+    // byte; tfs_seek moves the file pointer relative to where it is
+    CHECK(tfs_mount(image) >= 0);
+    fileDescriptor fa = tfs_openFile("alpha");
+    CHECK(fa >= 0);
+    CHECK(tfs_read(fa, buffer, sizeof(buffer)) == 600 && memcmp(buffer, alpha, 600) == 0);
+    CHECK(tfs_seek(fa, 377 - 600) == 377 && tfs_readByte(fa, &byte) >= 0 && byte == alpha[377]);
+    fileDescriptor fb = tfs_openFile("beta");
+    CHECK(fb >= 0);
+    CHECK(tfs_read(fb, buffer, sizeof(buffer)) == 50 && buffer[0] == '0' && buffer[49] == '9');
+    fileDescriptor fg = tfs_openFile("gamma");
+    CHECK(fg >= 0 && tfs_writeFile(fg, content, 700) >= 0);
+
+    // New files, positional and append writes, renames and deletes
+    fileDescriptor fn = tfs_openFile("new");
+    CHECK(fn >= 0 && tfs_writeFile(fn, content, sizeof(content)) >= 0);
+    CHECK(tfs_pwrite(fa, "XYZ", 3, 590) == 3);
+    CHECK(tfs_append(fa, "tail", 4) == 4);
+    CHECK(tfs_rename(fb, "renamed") >= 0);
+    CHECK(tfs_deleteFile(fg) >= 0);
+    CHECK(tfs_zeroFreeBlocks(1000) >= 0);
+    CHECK(tfs_unmount() >= 0);
+
+    // Everything survives a remount
+    CHECK(tfs_mount(image) >= 0);
+    fa = tfs_openFile("alpha");
+    CHECK(tfs_read(fa, buffer, sizeof(buffer)) == 604);
+    CHECK(memcmp(buffer, alpha, 590) == 0 && memcmp(buffer + 590, "XYZ", 3) == 0 && memcmp(buffer + 600, "tail", 4) == 0);
+    fn = tfs_openFile("new");
+    CHECK(tfs_read(fn, buffer, sizeof(buffer)) == sizeof(content) && memcmp(buffer, content, sizeof(content)) == 0);
+    fb = tfs_openFile("renamed");
+    CHECK(tfs_read(fb, buffer, sizeof(buffer)) == 50);
+    CHECK(tfs_deleteFile(fn) >= 0 && tfs_deleteFile(fb) >= 0);
+
+    // Filling the disk reaches every free block, then frees them all again;
+    // a write that runs out of blocks fails and is retried smaller
+    fileDescriptor big = tfs_openFile("big");
+    char *fill = (char *)malloc(20000);
+    CHECK(fill != NULL);
+    memset(fill, 'q', 20000);
+    int size = 20000;
+    while (size > 0 && tfs_writeFile(big, fill, size) < 0) {
+        size -= 250;
+    }
+    CHECK(size > 0);
+    CHECK(tfs_unmount() >= 0);
+    CHECK(tfs_mount(image) >= 0);
+    big = tfs_openFile("big");
+    CHECK(tfs_read(big, fill, 20000) == size);
+    CHECK(tfs_deleteFile(big) >= 0);
+    big = tfs_openFile("big");
+    CHECK(tfs_writeFile(big, fill, size) >= 0);
+    CHECK(tfs_unmount() >= 0);
+    free(fill);
+
+    printf("%s: ok\n", argv[1]);
+    return 0;
+}
@@ -0,0 +1,1187 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "libDisk.h"
+#include "libTinyFS.h"
+#include "tinyFS_errno.h"
+
+#define BENCH_DISK_NAME "bench.dsk"
+
+double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* With --json, every result is also written to this file as one element
+of a JSON array */
+FILE *jsonOutput = NULL;
+int jsonResults = 0;
+
+/* Prints one result line. p50 and p99 are per-op latencies in seconds and
+blocks is block accesses per op; each is negative when the benchmark does
+not measure it, and is then left out of the line and null in the JSON. */
+void reportResult(const char *name, const char *params, long ops, double seconds,
+                  double p50, double p99, double blocks) {
+    printf("%-10s %-36s %10ld ops %10.3f ms %12.0f ops/s %9.0f ns/op",
+           name, params, ops, seconds * 1e3, ops / seconds, seconds * 1e9 / ops);
+    if (p50 >= 0) {
+        printf(" p50 %9.0f ns p99 %9.0f ns", p50 * 1e9, p99 * 1e9);
+    }
+    if (blocks >= 0) {
+        printf(" %8.2f blocks/op", blocks);
+    }
+    printf("\n");
+
+    if (jsonOutput == NULL) {
+        return;
+    }
+    // Names and params never hold quotes or backslashes, so need no escaping
+    fprintf(jsonOutput, "%s\n  {\"name\": \"%s\", \"params\": \"%s\", \"ops\": %ld, \"seconds\": %.9f, "
+            "\"ops_per_sec\": %.1f, \"ns_per_op\": %.1f",
+            jsonResults == 0 ? "" : ",", name, params, ops, seconds, ops / seconds, seconds * 1e9 / ops);
+    if (p50 >= 0) {
+        fprintf(jsonOutput, ", \"p50_ns\": %.0f, \"p99_ns\": %.0f", p50 * 1e9, p99 * 1e9);
+    } else {
+        fprintf(jsonOutput, ", \"p50_ns\": null, \"p99_ns\": null");
+    }
+    if (blocks >= 0) {
+        fprintf(jsonOutput, ", \"blocks_per_op\": %.3f}", blocks);
+    } else {
+        fprintf(jsonOutput, ", \"blocks_per_op\": null}");
+    }
+    jsonResults++;
+}
+
+void report(const char *name, const char *params, long ops, double seconds) {
+    reportResult(name, params, ops, seconds, -1, -1, -1);
+}
+
+/* Latencies of single operations, in seconds, collected over one run */
+typedef struct LatencyLog {
+    long count;
+    long capacity;
+    double *seconds;
+} LatencyLog;
+
+int logLatency(LatencyLog *log, double seconds) {
+    if (log->count == log->capacity) {
+        long capacity = log->capacity == 0 ? 1024 : log->capacity * 2;
+        double *grown = realloc(log->seconds, capacity * sizeof(double));
+        if (grown == NULL) {
+            return -1;
+        }
+        log->seconds = grown;
+        log->capacity = capacity;
+    }
+    log->seconds[log->count++] = seconds;
+    return 0;
+}
+
+int compareSeconds(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Reports a run from its per-op latencies, with blocks block accesses over
+the whole run (negative if not measured), and empties the log */
+void reportLatencies(const char *name, const char *params, LatencyLog *log, long blocks) {
+    if (log->count == 0) {
+        return;
+    }
+    double total = 0;
+    for (long i = 0; i < log->count; i++) {
+        total += log->seconds[i];
+    }
+    qsort(log->seconds, log->count, sizeof(double), compareSeconds);
+    double p50 = log->seconds[log->count / 2];
+    double p99 = log->seconds[log->count * 99 / 100];
+    reportResult(name, params, log->count, total, p50, p99, blocks < 0 ? -1 : (double)blocks / log->count);
+    log->count = 0;
+}
+
+/* Random single-block reads straight through libDisk. The cache is turned
+off for file-backed disks so the numbers reflect the I/O backend itself;
+"mmap" copies out of the mapping and "mmap-ptr" only takes the direct
+block pointer. */
+int benchRandomRead(void) {
+    int sizes[] = {1 << 20, 16 << 20, 64 << 20};
+    const char *modes[] = {"pread", "mmap", "mmap-ptr"};
+    long ops = 200000;
+    char block[BLOCKSIZE];
+    volatile char sink = 0;
+
+    for (int s = 0; s < 3; s++) {
+        for (int m = 0; m < 3; m++) {
+            int disk = openDiskWithFlags(BENCH_DISK_NAME, sizes[s], m == 0 ? 0 : DISK_MMAP);
+            if (disk < 0) {
+                return -1;
+            }
+            if (m == 0) {
+                setDiskCacheSize(disk, 0);
+            }
+            int nBlocks = sizes[s] / BLOCKSIZE;
+
+            srand(1);
+            double start = nowSeconds();
+            for (long i = 0; i < ops; i++) {
+                if (m == 2) {
+                    const char *ptr = getBlockPointer(disk, rand() % nBlocks);
+                    if (ptr == NULL) {
+                        closeDisk(disk);
+                        return -1;
+                    }
+                    sink += ptr[0];
+                } else if (readBlock(disk, rand() % nBlocks, block) < 0) {
+                    closeDisk(disk);
+                    return -1;
+                }
+            }
+            double elapsed = nowSeconds() - start;
+
+            char params[64];
+            snprintf(params, sizeof(params), "disk=%dMiB %s", sizes[s] >> 20, modes[m]);
+            report("randread", params, ops, elapsed);
+            closeDisk(disk);
+        }
+    }
+    return 0;
+}
+
+/* Reads 4096 scattered blocks of a 64 MiB disk with the cache off, no two
+adjacent, so none merge into a shared readv. "sync" reads them one
+readBlock at a time; "ring" and "pool" hand all of them to readBlocks at
+once, which keeps every read in flight on io_uring or on the worker pool.
+"ring-async" submits batches of 64 with readBlocksAsync and keeps four in
+flight. One op is one block. */
+int benchAsync(void) {
+    const char *modes[] = {"sync", "ring", "pool", "ring-async"};
+    int nBlocks = 4096;
+    int diskSize = 64 << 20;
+    char *data = malloc((size_t)nBlocks * BLOCKSIZE);
+    BlockIO *ios = malloc(nBlocks * sizeof(BlockIO));
+
+    for (int m = 0; m < 4; m++) {
+        int disk = openDiskWithFlags(BENCH_DISK_NAME, diskSize, m == 2 ? DISK_THREAD_POOL : 0);
+        if (disk < 0) {
+            free(data);
+            free(ios);
+            return -1;
+        }
+        setDiskCacheSize(disk, 0);
+        srand(1);
+        for (int i = 0; i < nBlocks; i++) {
+            ios[i].bNum = 2 * (rand() % (diskSize / BLOCKSIZE / 2));
+            ios[i].block = data + (size_t)i * BLOCKSIZE;
+        }
+
+        int success = 0;
+        double start = nowSeconds();
+        if (m == 0) {
+            for (int i = 0; i < nBlocks && success == 0; i++) {
+                success = readBlock(disk, ios[i].bNum, ios[i].block);
+            }
+        } else if (m < 3) {
+            success = readBlocks(disk, ios, nBlocks);
+        } else {
+            DiskBatch *inFlight[4] = {NULL, NULL, NULL, NULL};
+            for (int i = 0; i < nBlocks / 64 + 4; i++) {
+                if (inFlight[i % 4] != NULL && waitDiskBatch(inFlight[i % 4]) < 0) {
+                    success = -1;
+                }
+                inFlight[i % 4] = (i < nBlocks / 64) ? readBlocksAsync(disk, ios + i * 64, 64) : NULL;
+            }
+        }
+        double elapsed = nowSeconds() - start;
+        closeDisk(disk);
+        if (success < 0) {
+            free(data);
+            free(ios);
+            return -1;
+        }
+        report("async", modes[m], nBlocks, elapsed);
+    }
+    free(data);
+    free(ios);
+    return 0;
+}
+
+/* Format time against image size. Each formatted block counts as one op. */
+int benchMkfs(void) {
+    int sizes[] = {1 << 20, 16 << 20, 64 << 20, 256 << 20};
+
+    for (int s = 0; s < 4; s++) {
+        double start = nowSeconds();
+        if (tfs_mkfs(BENCH_DISK_NAME, sizes[s]) < 0) {
+            return -1;
+        }
+        double elapsed = nowSeconds() - start;
+
+        char params[64];
+        snprintf(params, sizeof(params), "disk=%dMiB", sizes[s] >> 20);
+        report("mkfs", params, sizes[s] / BLOCKSIZE, elapsed);
+    }
+    return 0;
+}
+
+/* Clears the clean-unmount flag of the bench image, as a crash would
+leave it */
+int markImageDirty(void) {
+    FILE *image = fopen(BENCH_DISK_NAME, "r+b");
+    if (image == NULL) {
+        return -1;
+    }
+    int success = (fseek(image, SUPER_STATE_OFFSET, SEEK_SET) == 0 && fputc(0, image) == 0) ? 0 : -1;
+    fclose(image);
+    return success;
+}
+
+/* Mounts and unmounts freshly formatted images of each size, cleanly
+unmounted and with the clean flag cleared so every block is checked. One
+op is one mount plus unmount. */
+int benchMount(void) {
+    const char *modes[] = {"clean", "dirty"};
+    int sizes[] = {16 << 20, 256 << 20};
+    int mounts = 20;
+
+    for (int s = 0; s < 2; s++) {
+        if (tfs_mkfs(BENCH_DISK_NAME, sizes[s]) < 0) {
+            return -1;
+        }
+        for (int m = 0; m < 2; m++) {
+            double elapsed = 0;
+            for (int i = 0; i < mounts; i++) {
+                if (m == 1 && markImageDirty() < 0) {
+                    return -1;
+                }
+                double start = nowSeconds();
+                if (tfs_mount(BENCH_DISK_NAME) < 0 || tfs_unmount() < 0) {
+                    return -1;
+                }
+                elapsed += nowSeconds() - start;
+            }
+
+            char params[64];
+            snprintf(params, sizeof(params), "%s disk=%dMiB", modes[m], sizes[s] >> 20);
+            report("mount", params, mounts, elapsed);
+        }
+    }
+    return 0;
+}
+
+/* Block accesses (cache hits plus misses) seen by a disk so far */
+long blockAccesses(int disk) {
+    DiskCacheStats stats;
+    getDiskCacheStats(disk, &stats);
+    return stats.hits + stats.misses;
+}
+
+/* Creates a file holding size bytes on a freshly formatted and mounted
+bench disk. Returns its descriptor. */
+fileDescriptor makeBenchFile(int diskSize, int size, int *disk) {
+    char *content = malloc(size > 0 ? size : 1);
+    for (int i = 0; i < size; i++) {
+        content[i] = 'a' + i % 26;
+    }
+    if (tfs_mkfs(BENCH_DISK_NAME, diskSize) < 0 || (*disk = tfs_mount(BENCH_DISK_NAME)) < 0) {
+        free(content);
+        return -1;
+    }
+    fileDescriptor fd = tfs_openFile("bench");
+    if (fd < 0 || tfs_writeFile(fd, content, size) < 0) {
+        free(content);
+        tfs_unmount();
+        return -1;
+    }
+    free(content);
+    return fd;
+}
+
+/* Streams whole files byte by byte with tfs_readByte, in 4 KiB pieces
+with tfs_read, and with a single tfs_read of the whole file. One op is one
+byte delivered; blocks counts block accesses during the run. */
+int benchRead(void) {
+    const char *modes[] = {"readByte", "readByte", "read4k", "read4k", "readAll"};
+    int sizes[] = {4 << 10, 16 << 10, 64 << 10, 1 << 20, 1 << 20};
+
+    for (int s = 0; s < 5; s++) {
+        int size = sizes[s];
+        int disk;
+        char *buffer = malloc(size);
+        fileDescriptor fd = makeBenchFile(4 << 20, size, &disk);
+        if (fd < 0) {
+            free(buffer);
+            return -1;
+        }
+
+        long before = blockAccesses(disk);
+        double start = nowSeconds();
+        long bytes = 0;
+        int n;
+        if (s < 2) {
+            for (int i = 0; i < size && tfs_readByte(fd, buffer) > 0; i++) {
+                bytes++;
+            }
+        } else {
+            int chunk = (s < 4) ? 4096 : size;
+            while ((n = tfs_read(fd, buffer + bytes, chunk)) > 0) {
+                bytes += n;
+            }
+        }
+        double elapsed = nowSeconds() - start;
+        long accesses = blockAccesses(disk) - before;
+        tfs_unmount();
+        free(buffer);
+        if (bytes != size) {
+            return -1;
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "%s file=%dKiB blocks=%ld", modes[s], size >> 10, accesses);
+        report("read", params, bytes, elapsed);
+    }
+    return 0;
+}
+
+/* Streams a 64 KiB file byte by byte with tfs_readByte under each
+access-time mount mode. One op is one byte read; blocks is the number of
+block accesses for the whole run, including the close that writes a lazy
+access time. */
+int benchAtime(void) {
+    const char *modes[] = {"strict", "noatime", "relatime", "lazyatime"};
+    int flags[] = {0, TFS_MOUNT_NOATIME, TFS_MOUNT_RELATIME, TFS_MOUNT_LAZYATIME};
+    int size = 64 << 10;
+    char byte;
+
+    for (int m = 0; m < 4; m++) {
+        int disk;
+        fileDescriptor fd = makeBenchFile(4 << 20, size, &disk);
+        if (fd < 0) {
+            return -1;
+        }
+        tfs_unmount();
+        if ((disk = tfs_mountWithFlags(BENCH_DISK_NAME, flags[m])) < 0) {
+            return -1;
+        }
+
+        long before = blockAccesses(disk);
+        double start = nowSeconds();
+        fd = tfs_openFile("bench");
+        long bytes = 0;
+        while (fd >= 0 && bytes < size && tfs_readByte(fd, &byte) > 0) {
+            bytes++;
+        }
+        int closed = tfs_closeFile(fd);
+        double elapsed = nowSeconds() - start;
+        long accesses = blockAccesses(disk) - before;
+        tfs_unmount();
+        if (bytes != size || closed < 0) {
+            return -1;
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "readByte %s blocks=%ld", modes[m], accesses);
+        report("atime", params, bytes, elapsed);
+    }
+    return 0;
+}
+
+/* Reads 64 bytes at random offsets of a file. One op is one seek plus
+read; blocks is the number of block accesses per op. */
+int benchSeekRead(void) {
+    int sizes[] = {64 << 10, 1 << 20};
+    long ops = 5000;
+    char buffer[64];
+
+    for (int s = 0; s < 2; s++) {
+        int disk;
+        fileDescriptor fd = makeBenchFile(4 << 20, sizes[s], &disk);
+        if (fd < 0) {
+            return -1;
+        }
+
+        // tfs_seek moves the file pointer relative to where it is
+        int position = 0;
+        srand(1);
+        long before = blockAccesses(disk);
+        double start = nowSeconds();
+        for (long i = 0; i < ops; i++) {
+            int target = rand() % (sizes[s] - (int)sizeof(buffer));
+            int n;
+            if (tfs_seek(fd, target - position) < 0 || (n = tfs_read(fd, buffer, sizeof(buffer))) != sizeof(buffer)) {
+                tfs_unmount();
+                return -1;
+            }
+            position = target + n;
+        }
+        double elapsed = nowSeconds() - start;
+        long accesses = blockAccesses(disk) - before;
+        tfs_unmount();
+
+        char params[64];
+        snprintf(params, sizeof(params), "file=%dKiB blocks/op=%ld", sizes[s] >> 10, accesses / ops);
+        report("seekread", params, ops, elapsed);
+    }
+    return 0;
+}
+
+/* Rewrites a whole file with tfs_writeFile. One op is one rewrite; blocks
+is the number of block accesses per rewrite, which includes freeing the
+old chain and allocating the new one. */
+int benchWrite(void) {
+    int sizes[] = {4 << 10, 64 << 10, 1 << 20};
+    int rewrites[] = {2000, 500, 40};
+
+    for (int s = 0; s < 3; s++) {
+        int disk;
+        char *content = malloc(sizes[s]);
+        memset(content, 'w', sizes[s]);
+        fileDescriptor fd = makeBenchFile(16 << 20, sizes[s], &disk);
+        if (fd < 0) {
+            free(content);
+            return -1;
+        }
+
+        long before = blockAccesses(disk);
+        double start = nowSeconds();
+        for (int i = 0; i < rewrites[s]; i++) {
+            if (tfs_writeFile(fd, content, sizes[s]) < 0) {
+                free(content);
+                tfs_unmount();
+                return -1;
+            }
+        }
+        double elapsed = nowSeconds() - start;
+        long accesses = blockAccesses(disk) - before;
+        tfs_unmount();
+        free(content);
+
+        char params[64];
+        snprintf(params, sizeof(params), "file=%dKiB blocks/op=%ld", sizes[s] >> 10, accesses / rewrites[s]);
+        report("write", params, rewrites[s], elapsed);
+    }
+    return 0;
+}
+
+/* Deletes one large file, then runs the lazy zeroing pass over its
+blocks. One op is one block freed or zeroed; blocks is the number of
+block accesses for the whole delete or pass. */
+int benchFree(void) {
+    int sizes[] = {1000, 10000};
+
+    for (int s = 0; s < 2; s++) {
+        int disk;
+        fileDescriptor fd = makeBenchFile(16 << 20, sizes[s] * USEABLE_DATA_SIZE, &disk);
+        if (fd < 0) {
+            return -1;
+        }
+
+        long before = blockAccesses(disk);
+        double start = nowSeconds();
+        if (tfs_deleteFile(fd) < 0) {
+            tfs_unmount();
+            return -1;
+        }
+        double elapsed = nowSeconds() - start;
+        long accesses = blockAccesses(disk) - before;
+
+        char params[64];
+        snprintf(params, sizeof(params), "delete file=%dblk blocks=%ld", sizes[s], accesses);
+        report("free", params, sizes[s], elapsed);
+
+        before = blockAccesses(disk);
+        start = nowSeconds();
+        int zeroed = 0;
+        int n;
+        while ((n = tfs_zeroFreeBlocks(1024)) > 0) {
+            zeroed += n;
+        }
+        elapsed = nowSeconds() - start;
+        accesses = blockAccesses(disk) - before;
+        tfs_unmount();
+        if (n < 0 || zeroed == 0) {
+            return -1;
+        }
+
+        snprintf(params, sizeof(params), "zero file=%dblk blocks=%ld", sizes[s], accesses);
+        report("free", params, zeroed, elapsed);
+    }
+    return 0;
+}
+
+/* Grows a log file by 100-byte records, with tfs_append and, for
+comparison, by rewriting the whole file with tfs_writeFile. One op is one
+record; blocks is the number of block accesses per record. */
+int benchAppend(void) {
+    const char *modes[] = {"append", "writeFile"};
+    int records = 2000;
+    int recordSize = 100;
+    char *log = malloc((size_t)records * recordSize);
+    memset(log, 'r', (size_t)records * recordSize);
+
+    for (int m = 0; m < 2; m++) {
+        int disk;
+        fileDescriptor fd = makeBenchFile(4 << 20, 0, &disk);
+        if (fd < 0) {
+            free(log);
+            return -1;
+        }
+
+        long before = blockAccesses(disk);
+        double start = nowSeconds();
+        for (int i = 0; i < records; i++) {
+            int success = (m == 0) ? tfs_append(fd, log + (size_t)i * recordSize, recordSize)
+                                   : tfs_writeFile(fd, log, (i + 1) * recordSize);
+            if (success < 0) {
+                free(log);
+                tfs_unmount();
+                return -1;
+            }
+        }
+        double elapsed = nowSeconds() - start;
+        long accesses = blockAccesses(disk) - before;
+        tfs_unmount();
+
+        char params[64];
+        snprintf(params, sizeof(params), "%s record=%dB blocks/op=%ld", modes[m], recordSize, accesses / records);
+        report("append", params, records, elapsed);
+    }
+    free(log);
+    return 0;
+}
+
+/* Writes a 16 MiB file with one tfs_writeFile and reads it back with one
+tfs_read on images formatted with each block size. One op is one byte
+moved; blocks is the number of block accesses for the transfer. */
+int benchBlockSize(void) {
+    int blockSizes[] = {256, 1024, 4096, 16384, 65536};
+    int size = 16 << 20;
+    char *content = malloc(size);
+    char *buffer = malloc(size);
+    memset(content, 'b', size);
+
+    for (int b = 0; b < 5; b++) {
+        int disk;
+        if (tfs_mkfsWithBlockSize(BENCH_DISK_NAME, 64 << 20, blockSizes[b]) < 0 || (disk = tfs_mount(BENCH_DISK_NAME)) < 0) {
+            free(content);
+            free(buffer);
+            return -1;
+        }
+        fileDescriptor fd = tfs_openFile("bench");
+
+        long before = blockAccesses(disk);
+        double start = nowSeconds();
+        int written = (fd < 0) ? fd : tfs_writeFile(fd, content, size);
+        double writeElapsed = nowSeconds() - start;
+        long writeAccesses = blockAccesses(disk) - before;
+
+        before = blockAccesses(disk);
+        start = nowSeconds();
+        int n = (written < 0) ? written : tfs_read(fd, buffer, size);
+        double readElapsed = nowSeconds() - start;
+        long readAccesses = blockAccesses(disk) - before;
+        tfs_unmount();
+        if (n != size) {
+            free(content);
+            free(buffer);
+            return -1;
+        }
+
+        char params[64];
+        snprintf(params, sizeof(params), "write block=%dB blocks=%ld", blockSizes[b], writeAccesses);
+        report("blocksize", params, size, writeElapsed);
+        snprintf(params, sizeof(params), "read block=%dB blocks=%ld", blockSizes[b], readAccesses);
+        report("blocksize", params, size, readElapsed);
+    }
+    free(content);
+    free(buffer);
+    return 0;
+}
+
+/* Opens (and closes) existing files by name on file systems holding an
+increasing number of files. One op is one open/close pair. */
+int benchOpen(void) {
+    int fileCounts[] = {100, 1000, 4000};
+    long ops = 20000;
+    char name[16];
+
+    for (int c = 0; c < 3; c++) {
+        if (tfs_mkfs(BENCH_DISK_NAME, 4 << 20) < 0 || tfs_mount(BENCH_DISK_NAME) < 0) {
+            return -1;
+        }
+        for (int i = 0; i < fileCounts[c]; i++) {
+            snprintf(name, sizeof(name), "f%d", i);
+            fileDescriptor fd = tfs_openFile(name);
+            if (fd < 0 || tfs_closeFile(fd) < 0) {
+                tfs_unmount();
+                return -1;
+            }
+        }
+
+        srand(1);
+        double start = nowSeconds();
+        for (long i = 0; i < ops; i++) {
+            snprintf(name, sizeof(name), "f%d", rand() % fileCounts[c]);
+            fileDescriptor fd = tfs_openFile(name);
+            if (fd < 0 || tfs_closeFile(fd) < 0) {
+                tfs_unmount();
+                return -1;
+            }
+        }
+        double elapsed = nowSeconds() - start;
+        tfs_unmount();
+
+        char params[64];
+        snprintf(params, sizeof(params), "files=%d lookup", fileCounts[c]);
+        report("open", params, ops, elapsed);
+    }
+    return 0;
+}
+
+/* Creates a number of empty files, then deletes them all in random order.
+One op is one open plus delete; blocks is the number of block accesses
+per op. */
+int benchDelete(void) {
+    int fileCounts[] = {1000, 4000};
+    char name[16];
+
+    for (int c = 0; c < 2; c++) {
+        int nFiles = fileCounts[c];
+        int *order = malloc(nFiles * sizeof(int));
+        int disk;
+        if (tfs_mkfs(BENCH_DISK_NAME, 4 << 20) < 0 || (disk = tfs_mount(BENCH_DISK_NAME)) < 0) {
+            free(order);
+            return -1;
+        }
+        for (int i = 0; i < nFiles; i++) {
+            snprintf(name, sizeof(name), "f%d", i);
+            fileDescriptor fd = tfs_openFile(name);
+            if (fd < 0 || tfs_closeFile(fd) < 0) {
+                free(order);
+                tfs_unmount();
+                return -1;
+            }
+            order[i] = i;
+        }
+
+        // Shuffle so deletes hit every position in the inode list
+        srand(1);
+        for (int i = nFiles - 1; i > 0; i--) {
+            int j = rand() % (i + 1);
+            int swap = order[i];
+            order[i] = order[j];
+            order[j] = swap;
+        }
+
+        long before = blockAccesses(disk);
+        double start = nowSeconds();
+        for (int i = 0; i < nFiles; i++) {
+            snprintf(name, sizeof(name), "f%d", order[i]);
+            fileDescriptor fd = tfs_openFile(name);
+            if (fd < 0 || tfs_deleteFile(fd) < 0) {
+                free(order);
+                tfs_unmount();
+                return -1;
+            }
+        }
+        double elapsed = nowSeconds() - start;
+        long accesses = blockAccesses(disk) - before;
+        tfs_unmount();
+        free(order);
+
+        char params[64];
+        snprintf(params, sizeof(params), "files=%d blocks/op=%ld", nFiles, accesses / nFiles);
+        report("delete", params, nFiles, elapsed);
+    }
+    return 0;
+}
+
+/* One thread of benchThreads: its mount, the file it works on and how
+many ops it runs */
+typedef struct ThreadJob {
+    tfs_fs *fs;
+    fileDescriptor fd;
+    int mode;
+    int fileSize;
+    long ops;
+    unsigned int seed;
+    int failed;
+} ThreadJob;
+
+void *runThreadJob(void *arg) {
+    ThreadJob *job = (ThreadJob *)arg;
+    char buffer[4096];
+    memset(buffer, 'x', sizeof(buffer));
+    int position = 0;
+    for (long i = 0; i < job->ops; i++) {
+        int target = rand_r(&job->seed) % (job->fileSize - (int)sizeof(buffer));
+        int n;
+        if (job->mode == 0) {
+            // Random 4 KiB read of the thread's own file
+            if (tfs_fsSeek(job->fs, job->fd, target - position) < 0 || (n = tfs_fsRead(job->fs, job->fd, buffer, sizeof(buffer))) != sizeof(buffer)) {
+                job->failed = 1;
+                return NULL;
+            }
+            position = target + n;
+        } else if (job->mode == 1) {
+            // Random 4 KiB overwrite of the thread's own file
+            if (tfs_fsPwrite(job->fs, job->fd, buffer, sizeof(buffer), target) != sizeof(buffer)) {
+                job->failed = 1;
+                return NULL;
+            }
+        } else {
+            // Next 4 KiB of a file every thread streams through at once
+            if (tfs_fsRead(job->fs, job->fd, buffer, sizeof(buffer)) <= 0) {
+                job->ops = i;
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Runs 1 to 8 threads against one mount. "read" and "pwrite" give every
+thread its own 256 KiB file and do random 4 KiB reads or overwrites;
+"shared" has every thread stream the same 8 MiB file in 4 KiB reads
+through one descriptor. One op is one 4 KiB transfer and ops/s is the
+total over all threads, so it grows with the thread count as far as
+locking and the available cores allow. */
+int benchThreads(void) {
+    const char *modes[] = {"read", "pwrite", "shared"};
+    int threadCounts[] = {1, 2, 4, 8};
+    int fileSize = 256 << 10;
+    int sharedSize = 8 << 20;
+    long opsPerThread = 4000;
+    char *content = malloc(sharedSize);
+    memset(content, 'a', sharedSize);
+
+    for (int m = 0; m < 3; m++) {
+        for (int t = 0; t < 4; t++) {
+            int nThreads = threadCounts[t];
+            tfs_fs *fs = NULL;
+            if (tfs_mkfs(BENCH_DISK_NAME, 32 << 20) < 0 || (fs = tfs_fsMount(BENCH_DISK_NAME, 0)) == NULL) {
+                free(content);
+                return -1;
+            }
+
+            ThreadJob jobs[8];
+            fileDescriptor shared = -1;
+            for (int i = 0; i < nThreads; i++) {
+                char name[8];
+                snprintf(name, sizeof(name), "t%d", i);
+                jobs[i].fs = fs;
+                jobs[i].mode = m;
+                jobs[i].fileSize = fileSize;
+                jobs[i].ops = opsPerThread;
+                jobs[i].seed = i + 1;
+                jobs[i].failed = 0;
+                if (m == 2) {
+                    if (shared < 0 && ((shared = tfs_fsOpenFile(fs, "shared")) < 0 || tfs_fsWriteFile(fs, shared, content, sharedSize) < 0)) {
+                        jobs[i].fd = -1;
+                    } else {
+                        jobs[i].fd = shared;
+                    }
+                } else if ((jobs[i].fd = tfs_fsOpenFile(fs, name)) >= 0 && tfs_fsWriteFile(fs, jobs[i].fd, content, fileSize) < 0) {
+                    jobs[i].fd = -1;
+                }
+                if (jobs[i].fd < 0) {
+                    tfs_fsUnmount(fs);
+                    free(content);
+                    return -1;
+                }
+            }
+
+            pthread_t threads[8];
+            double start = nowSeconds();
+            for (int i = 0; i < nThreads; i++) {
+                pthread_create(&threads[i], NULL, runThreadJob, &jobs[i]);
+            }
+            long ops = 0;
+            int failed = 0;
+            for (int i = 0; i < nThreads; i++) {
+                pthread_join(threads[i], NULL);
+                ops += jobs[i].ops;
+                failed |= jobs[i].failed;
+            }
+            double elapsed = nowSeconds() - start;
+            tfs_fsUnmount(fs);
+            if (failed) {
+                free(content);
+                return -1;
+            }
+
+            char params[64];
+            snprintf(params, sizeof(params), "%s threads=%d", modes[m], nThreads);
+            report("threads", params, ops, elapsed);
+        }
+    }
+    free(content);
+    return 0;
+}
+
+/* The grid of the "ops" suite. Every combination of disk size, file count
+and file size whose files fit on the disk is run. --disks (in MiB),
+--files and --sizes (in bytes) replace these lists. */
+#define MAX_OPS_PARAMS 8
+int opsDiskSizes[MAX_OPS_PARAMS] = {16 << 20, 64 << 20};
+int nOpsDiskSizes = 2;
+int opsFileCounts[MAX_OPS_PARAMS] = {100, 1000};
+int nOpsFileCounts = 2;
+int opsFileSizes[MAX_OPS_PARAMS] = {1 << 10, 16 << 10};
+int nOpsFileSizes = 2;
+
+/* Points stdout at an unlinked temporary file while tfs_readdir prints its
+listings, and back again. Returns the saved descriptor for
+restoreStdout. */
+int silenceStdout(void) {
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    FILE *discard = tmpfile();
+    if (saved >= 0 && discard != NULL) {
+        dup2(fileno(discard), STDOUT_FILENO);
+    }
+    if (discard != NULL) {
+        fclose(discard);
+    }
+    return saved;
+}
+
+void restoreStdout(int saved) {
+    fflush(stdout);
+    if (saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    }
+}
+
+/* One pass of the "ops" suite on a fresh image: formats and mounts it,
+then creates, writes, looks up, reads, seeks in, renames, lists and
+deletes nFiles files of fileSize bytes, timing every call on its own.
+fds and order hold nFiles entries and content fileSize bytes. Leaves the
+image unmounted on success. */
+int measureOps(int diskSize, int nFiles, int fileSize, fileDescriptor *fds, int *order,
+               char *content, const char *params) {
+    LatencyLog log = {0, 0, NULL};
+    char name[16];
+    int disk = -1;
+    long before;
+    int success = 0;
+    double start;
+
+    for (int i = 0; i < 3 && success == 0; i++) {
+        start = nowSeconds();
+        success = tfs_mkfs(BENCH_DISK_NAME, diskSize) < 0 ? -1 : logLatency(&log, nowSeconds() - start);
+    }
+    reportLatencies("mkfs", params, &log, -1);
+
+    // Each mount's block accesses are those it made on its freshly opened disk
+    long mountBlocks = 0;
+    for (int i = 0; i < 10 && success == 0; i++) {
+        start = nowSeconds();
+        disk = tfs_mount(BENCH_DISK_NAME);
+        double elapsed = nowSeconds() - start;
+        if (disk < 0) {
+            success = -1;
+        } else {
+            mountBlocks += blockAccesses(disk);
+            success = logLatency(&log, elapsed);
+            if (i < 9 && tfs_unmount() < 0) {
+                success = -1;
+            }
+        }
+    }
+    reportLatencies("mount", params, &log, mountBlocks);
+    if (success < 0) {
+        free(log.seconds);
+        return -1;
+    }
+
+    before = blockAccesses(disk);
+    for (int i = 0; i < nFiles && success == 0; i++) {
+        snprintf(name, sizeof(name), "f%d", i);
+        start = nowSeconds();
+        fds[i] = tfs_openFile(name);
+        success = fds[i] < 0 ? -1 : logLatency(&log, nowSeconds() - start);
+    }
+    reportLatencies("create", params, &log, blockAccesses(disk) - before);
+
+    before = blockAccesses(disk);
+    for (int i = 0; i < nFiles && success == 0; i++) {
+        start = nowSeconds();
+        success = tfs_writeFile(fds[i], content, fileSize) < 0 ? -1 : logLatency(&log, nowSeconds() - start);
+    }
+    reportLatencies("writeFile", params, &log, blockAccesses(disk) - before);
+
+    for (int i = 0; i < nFiles && success == 0; i++) {
+        success = tfs_closeFile(fds[i]) < 0 ? -1 : 0;
+    }
+    srand(1);
+    for (int i = 0; i < nFiles; i++) {
+        order[i] = i;
+    }
+    for (int i = nFiles - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        int swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+
+    before = blockAccesses(disk);
+    for (int i = 0; i < nFiles && success == 0; i++) {
+        snprintf(name, sizeof(name), "f%d", order[i]);
+        start = nowSeconds();
+        fds[order[i]] = tfs_openFile(name);
+        success = fds[order[i]] < 0 ? -1 : logLatency(&log, nowSeconds() - start);
+    }
+    reportLatencies("lookup", params, &log, blockAccesses(disk) - before);
+
+    // The first 256 bytes of every file, one call per byte
+    int bytesPerFile = fileSize < 256 ? fileSize : 256;
+    char byte;
+    before = blockAccesses(disk);
+    for (int i = 0; i < nFiles && success == 0; i++) {
+        for (int b = 0; b < bytesPerFile && success == 0; b++) {
+            start = nowSeconds();
+            success = tfs_readByte(fds[i], &byte) < 0 ? -1 : logLatency(&log, nowSeconds() - start);
+        }
+    }
+    reportLatencies("readByte", params, &log, blockAccesses(disk) - before);
+
+    before = blockAccesses(disk);
+    for (int i = 0; i < nFiles && success == 0; i++) {
+        for (int k = 0; k < 16 && success == 0; k++) {
+            int offset = fileSize > 0 ? rand() % fileSize : 0;
+            start = nowSeconds();
+            success = tfs_seek(fds[i], offset) < 0 ? -1 : logLatency(&log, nowSeconds() - start);
+        }
+    }
+    reportLatencies("seek", params, &log, blockAccesses(disk) - before);
+
+    before = blockAccesses(disk);
+    for (int i = 0; i < nFiles && success == 0; i++) {
+        snprintf(name, sizeof(name), "r%d", order[i]);
+        start = nowSeconds();
+        success = tfs_rename(fds[order[i]], name) < 0 ? -1 : logLatency(&log, nowSeconds() - start);
+    }
+    reportLatencies("rename", params, &log, blockAccesses(disk) - before);
+
+    int savedStdout = silenceStdout();
+    before = blockAccesses(disk);
+    for (int i = 0; i < 20 && success == 0; i++) {
+        start = nowSeconds();
+        success = tfs_readdir() < 0 ? -1 : logLatency(&log, nowSeconds() - start);
+    }
+    long readdirBlocks = blockAccesses(disk) - before;
+    restoreStdout(savedStdout);
+    reportLatencies("readdir", params, &log, readdirBlocks);
+
+    before = blockAccesses(disk);
+    for (int i = 0; i < nFiles && success == 0; i++) {
+        start = nowSeconds();
+        success = tfs_deleteFile(fds[order[i]]) < 0 ? -1 : logLatency(&log, nowSeconds() - start);
+    }
+    reportLatencies("delete", params, &log, blockAccesses(disk) - before);
+
+    free(log.seconds);
+    if (tfs_unmount() < 0) {
+        return -1;
+    }
+    return success;
+}
+
+/* Times every public operation on its own across the grid above. One op
+is one call; the results carry p50 and p99 latencies and block accesses
+per call. */
+int benchOps(void) {
+    for (int d = 0; d < nOpsDiskSizes; d++) {
+        for (int c = 0; c < nOpsFileCounts; c++) {
+            for (int s = 0; s < nOpsFileSizes; s++) {
+                int diskSize = opsDiskSizes[d];
+                int nFiles = opsFileCounts[c];
+                int fileSize = opsFileSizes[s];
+                char params[64];
+                snprintf(params, sizeof(params), "disk=%dMiB files=%d size=%d", diskSize >> 20, nFiles, fileSize);
+
+                // An inode and the data blocks of every file, with a quarter to spare
+                long needed = (long)nFiles * (1 + (fileSize + USEABLE_DATA_SIZE - 1) / USEABLE_DATA_SIZE);
+                if (needed + needed / 4 > diskSize / BLOCKSIZE) {
+                    printf("%-10s %-36s skipped, the files do not fit\n", "ops", params);
+                    continue;
+                }
+
+                fileDescriptor *fds = malloc(nFiles * sizeof(fileDescriptor));
+                int *order = malloc(nFiles * sizeof(int));
+                char *content = malloc(fileSize > 0 ? fileSize : 1);
+                for (int i = 0; i < fileSize; i++) {
+                    content[i] = 'a' + i % 26;
+                }
+                int success = measureOps(diskSize, nFiles, fileSize, fds, order, content, params);
+                free(fds);
+                free(order);
+                free(content);
+                if (success < 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+typedef struct Benchmark {
+    const char *name;
+    int (*run)(void);
+} Benchmark;
+
+Benchmark benchmarks[] = {
+    {"randread", benchRandomRead},
+    {"async", benchAsync},
+    {"mkfs", benchMkfs},
+    {"mount", benchMount},
+    {"read", benchRead},
+    {"seekread", benchSeekRead},
+    {"atime", benchAtime},
+    {"write", benchWrite},
+    {"append", benchAppend},
+    {"free", benchFree},
+    {"blocksize", benchBlockSize},
+    {"open", benchOpen},
+    {"delete", benchDelete},
+    {"threads", benchThreads},
+    {"ops", benchOps},
+};
+
+/* Upper bound, in nanoseconds, of the latency histogram bucket holding
+the given fraction of calls */
+double histogramPercentile(const tfs_opStats *stats, double fraction) {
+    unsigned long seen = 0;
+    for (int b = 0; b < TFS_LATENCY_BUCKETS; b++) {
+        seen += stats->latency[b];
+        if (seen > 0 && seen >= fraction * stats->calls) {
+            return (double)(2UL << b);
+        }
+    }
+    return (double)(2UL << (TFS_LATENCY_BUCKETS - 1));
+}
+
+/* Prints what tfs_getStats collected over the whole run: every operation
+called, with p50 and p99 rounded up to their histogram bucket, and
+libDisk's I/O */
+void printStats(void) {
+    tfs_stats stats;
+    if (tfs_getStats(&stats) < 0) {
+        printf("Statistics were compiled out (TFS_NO_STATS)\n");
+        return;
+    }
+    printf("\n%-14s %10s %8s %12s %12s %12s\n", "operation", "calls", "errors", "mean ns", "p50 ns <=", "p99 ns <=");
+    for (int op = 0; op < TFS_OP_COUNT; op++) {
+        tfs_opStats *opStats = &stats.ops[op];
+        if (opStats->calls == 0) {
+            continue;
+        }
+        printf("%-14s %10lu %8lu %12.0f %12.0f %12.0f\n", tfs_opName(op), opStats->calls, opStats->errors,
+               (double)opStats->totalNanos / opStats->calls, histogramPercentile(opStats, 0.5),
+               histogramPercentile(opStats, 0.99));
+    }
+    printf("disk: %lu blocks read, %lu written, %lu bytes read, %lu written, %lu system calls taking %.3f ms\n",
+           stats.disk.blockReads, stats.disk.blockWrites, stats.disk.bytesRead, stats.disk.bytesWritten,
+           stats.disk.syscalls, stats.disk.syscallNanos / 1e6);
+}
+
+/* Parses a comma-separated list of positive numbers, each multiplied by
+scale, into values. Returns how many there were, or -1 if the list is
+malformed or too long. */
+int parseList(const char *text, int scale, int *values) {
+    int count = 0;
+    while (*text != '\0') {
+        char *end;
+        long value = strtol(text, &end, 10);
+        if (end == text || value <= 0 || value > (1L << 30) / scale || count == MAX_OPS_PARAMS ||
+            (*end != ',' && *end != '\0')) {
+            return -1;
+        }
+        values[count++] = (int)(value * scale);
+        text = (*end == ',') ? end + 1 : end;
+    }
+    return count > 0 ? count : -1;
+}
+
+int main(int argc, char *argv[]) {
+    int nBenchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    int status = 0;
+    int nNames = 0;
+    int showStats = 0;
+
+    // Options other than --stats take their value from the next argument;
+    // anything else names a benchmark to run
+    for (int a = 1; a < argc; a++) {
+        if (strncmp(argv[a], "--", 2) != 0) {
+            argv[++nNames] = argv[a];
+            continue;
+        }
+        if (strcmp(argv[a], "--stats") == 0) {
+            showStats = 1;
+            continue;
+        }
+        if (a + 1 == argc) {
+            printf("Option %s needs a value\n", argv[a]);
+            return 2;
+        }
+        const char *value = argv[++a];
+        int count = 0;
+        if (strcmp(argv[a - 1], "--json") == 0) {
+            if (jsonOutput != NULL) {
+                fclose(jsonOutput);
+            }
+            if ((jsonOutput = fopen(value, "w")) == NULL) {
+                printf("Cannot open %s\n", value);
+                return 2;
+            }
+            count = 1;
+        } else if (strcmp(argv[a - 1], "--disks") == 0) {
+            count = nOpsDiskSizes = parseList(value, 1 << 20, opsDiskSizes);
+        } else if (strcmp(argv[a - 1], "--files") == 0) {
+            count = nOpsFileCounts = parseList(value, 1, opsFileCounts);
+        } else if (strcmp(argv[a - 1], "--sizes") == 0) {
+            count = nOpsFileSizes = parseList(value, 1, opsFileSizes);
+        }
+        if (count <= 0) {
+            printf("Usage: %s [--json file] [--stats] [--disks MiB,...] [--files n,...] [--sizes bytes,...] [benchmark...]\n",
+                   argv[0]);
+            return 2;
+        }
+    }
+    if (jsonOutput != NULL) {
+        fprintf(jsonOutput, "[");
+    }
+
+    // With no names every benchmark runs, otherwise only the named ones
+    for (int i = 0; i < nBenchmarks; i++) {
+        int selected = (nNames == 0);
+        for (int a = 1; a <= nNames; a++) {
+            if (strcmp(argv[a], benchmarks[i].name) == 0) {
+                selected = 1;
+            }
+        }
+        if (selected && benchmarks[i].run() < 0) {
+            printf("Benchmark %s failed\n", benchmarks[i].name);
+            status = 1;
+        }
+    }
+
+    if (showStats) {
+        printStats();
+    }
+    if (jsonOutput != NULL) {
+        fprintf(jsonOutput, "\n]\n");
+        fclose(jsonOutput);
+    }
+    remove(BENCH_DISK_NAME);
+    return status;
+}
@@ -225,6 +225,19 @@ int main() {
     }
     printf("File descriptors after delete and reopen (should be the same): \n%d, %d, %d, %d, %d, %d, %d, %d\n", fd1, fd2, fd3, fd4, fd5, fd6, fd7, fd8);
 
+    // tfs_read copies a whole range in one call instead of byte by byte
+    printf("\nWriting btcwhitepaper to file5 and reading it back with tfs_read\n");
+    if (tfs_writeFile(fd5, btcwhitepaper, 169) < 0) {
+        return -1;
+    }
+    char *bulkBuffer = (char *)malloc(sizeof(char) * 170);
+    int bytesRead = tfs_read(fd5, bulkBuffer, 169);
+    if (bytesRead < 0) {
+        return -1;
+    }
+    bulkBuffer[bytesRead] = '\0';
+    printf("Read %d bytes: %s\n", bytesRead, bulkBuffer);
+    free(bulkBuffer);
 
     // Testing unmounting and remounting the file system, for persistence
     if (tfs_unmount() < 0) {
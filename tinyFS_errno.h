@@ -15,5 +15,6 @@
 #define BLOCK_READ_ERROR -12
 #define FILE_RENAME_ERROR -13
 #define MEM_ALLOC_FAILURE -14
+#define STATS_DISABLED -15
 
 #endif
@@ -0,0 +1,627 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libDisk.h"
+#include "libTinyFS.h"
+
+/* Offline consistency checker for TinyFS images. The image is read once
+with large sequential reads into a compact per-block map (type and next
+pointer). The inode list is then walked, and the data of every file is
+claimed block by block into an ownership map by a pool of worker threads,
+so every block is accounted for exactly once: by the file system itself,
+by one file, or as free space. Run it only on an image that is not
+mounted. */
+
+/* Bytes one scan task reads with a single sequential read */
+#define FSCK_READ_BYTES (8 << 20)
+#define FSCK_MAX_THREADS 64
+/* Problems printed one per line; the summary counts all of them */
+#define FSCK_MAX_REPORTED 1000
+/* Owners in the block-ownership map other than an inode block number */
+#define OWNER_NONE 0
+#define OWNER_SYSTEM -1
+#define OWNER_FREE -2
+/* Exit codes, as fsck(8) uses them */
+#define FSCK_OK 0
+#define FSCK_CORRECTED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_FAILED 8
+
+typedef enum ProblemKind {
+    PROBLEM_LEAK,
+    PROBLEM_FREE_IN_USE,
+    PROBLEM_DOUBLE,
+    PROBLEM_CYCLE,
+    PROBLEM_BAD_POINTER,
+    PROBLEM_BAD_EXTENTS,
+    PROBLEM_KINDS
+} ProblemKind;
+
+const char *problemNames[PROBLEM_KINDS] = {
+    "leaked", "free but in use", "doubly allocated", "cycles", "bad pointers", "bad extent lists",
+};
+
+/* One inconsistency. block is where it was found and owner the file (or
+OWNER_FREE for the free list) that reached it. from is the block holding
+the pointer that led there, with the pointer at linkOffset; from is 0 for
+a pointer in the super block. */
+typedef struct Problem {
+    ProblemKind kind;
+    int block;
+    int owner;
+    int from;
+    int linkOffset;
+} Problem;
+
+/* The image being checked. type, next and owner are indexed by block
+number. owner is claimed with compare-and-swap by the workers; problems
+is appended to under problemLock. nextTask hands out work to the pool. */
+typedef struct FsckImage {
+    int disk;
+    int blockSize;
+    int nBlocks;
+    int version;
+    int inodeHead;
+    int freeHead;
+    int bitmapStart;
+    int bitmapBlocks;
+    int directExtents;
+    int maxExtents;
+    char *superData;
+    unsigned char *type;
+    int *next;
+    int *owner;
+    unsigned char *bitmap;
+    int *inodes;
+    int nInodes;
+    int nTasks;
+    int nextTask;
+    int failed;
+    pthread_mutex_t problemLock;
+    Problem *problems;
+    int nProblems;
+    int problemCapacity;
+} FsckImage;
+
+double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void addProblem(FsckImage *image, ProblemKind kind, int block, int owner, int from, int linkOffset) {
+    pthread_mutex_lock(&image->problemLock);
+    if (image->nProblems == image->problemCapacity) {
+        int capacity = image->problemCapacity ? image->problemCapacity * 2 : 64;
+        Problem *grown = (Problem *)realloc(image->problems, capacity * sizeof(Problem));
+        if (grown == NULL) {
+            image->failed = 1;
+            pthread_mutex_unlock(&image->problemLock);
+            return;
+        }
+        image->problems = grown;
+        image->problemCapacity = capacity;
+    }
+    Problem *problem = &image->problems[image->nProblems++];
+    problem->kind = kind;
+    problem->block = block;
+    problem->owner = owner;
+    problem->from = from;
+    problem->linkOffset = linkOffset;
+    pthread_mutex_unlock(&image->problemLock);
+}
+
+/* Claims block for owner. Returns 1, or 0 after recording a cycle (the
+owner already holds it) or a double allocation (someone else does). */
+int claimBlock(FsckImage *image, int block, int owner, int from, int linkOffset) {
+    int expected = OWNER_NONE;
+    if (__atomic_compare_exchange_n(&image->owner[block], &expected, owner, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return 1;
+    }
+    addProblem(image, (expected == owner) ? PROBLEM_CYCLE : PROBLEM_DOUBLE, block, owner, from, linkOffset);
+    return 0;
+}
+
+/* Runs worker on nThreads threads until it has taken all nTasks tasks */
+int runPool(FsckImage *image, int nThreads, int nTasks, void *(*worker)(void *)) {
+    pthread_t threads[FSCK_MAX_THREADS];
+    int started = 0;
+
+    image->nTasks = nTasks;
+    image->nextTask = 0;
+    for (; started < nThreads; started++) {
+        if (pthread_create(&threads[started], NULL, worker, image) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        worker(image);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return image->failed ? -1 : 0;
+}
+
+/* Next task index for the calling worker, or -1 when none are left */
+int takeTask(FsckImage *image) {
+    int task = __atomic_fetch_add(&image->nextTask, 1, __ATOMIC_RELAXED);
+    return (task < image->nTasks) ? task : -1;
+}
+
+/* Scan task: reads one FSCK_READ_BYTES run of blocks and records the type
+and next pointer of each, and the bytes of any bitmap block */
+void *scanWorker(void *arg) {
+    FsckImage *image = (FsckImage *)arg;
+    int runBlocks = FSCK_READ_BYTES / image->blockSize;
+    char *data = (char *)malloc((size_t)runBlocks * image->blockSize);
+    int task;
+
+    if (data == NULL) {
+        image->failed = 1;
+        return NULL;
+    }
+    while ((task = takeTask(image)) >= 0) {
+        int first = task * runBlocks;
+        int count = (image->nBlocks - first < runBlocks) ? image->nBlocks - first : runBlocks;
+        if (readBlockRange(image->disk, first, count, data) < 0) {
+            image->failed = 1;
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            char *block = data + (size_t)i * image->blockSize;
+            int bNum = first + i;
+            image->type[bNum] = (block[MAGIC_NUMBER_OFFSET] == MAGIC_NUMBER) ? (unsigned char)block[BLOCK_NUMBER_OFFSET] : 0;
+            memcpy(&image->next[bNum], block + DATA_NEXT_BLOCK_OFFSET, sizeof(int));
+            if (image->bitmap != NULL && bNum >= image->bitmapStart && bNum < image->bitmapStart + image->bitmapBlocks) {
+                int bytes = BITMAP_BYTES_PER_BLOCK(image->blockSize);
+                memcpy(image->bitmap + (size_t)(bNum - image->bitmapStart) * bytes, block + BITMAP_DATA_OFFSET, bytes);
+            }
+        }
+    }
+    free(data);
+    return NULL;
+}
+
+/* Claims the data chain of a chained file, stopping at the first block
+that is out of range, not a data block, or already claimed */
+void claimChain(FsckImage *image, int inode, int first) {
+    int from = inode;
+    int linkOffset = INODE_DATA_BLOCK_OFFSET;
+    int block = first;
+
+    while (block != 0) {
+        if (block < 0 || block >= image->nBlocks || image->type[block] != DATA_BLOCK_TYPE) {
+            addProblem(image, PROBLEM_BAD_POINTER, block, inode, from, linkOffset);
+            return;
+        }
+        if (!claimBlock(image, block, inode, from, linkOffset)) {
+            return;
+        }
+        from = block;
+        linkOffset = DATA_NEXT_BLOCK_OFFSET;
+        block = image->next[block];
+    }
+}
+
+/* Claims every block of an extent-format file: its runs and its indirect
+extent block. Runs that leave the disk make the whole list bad. */
+void claimExtents(FsckImage *image, int inode, char *inodeData, char *extentData) {
+    int count;
+    int indirect;
+    memcpy(&count, inodeData + INODE_EXTENT_COUNT_OFFSET, sizeof(int));
+    memcpy(&indirect, inodeData + INODE_INDIRECT_OFFSET, sizeof(int));
+    if (count < 0 || count > image->maxExtents) {
+        addProblem(image, PROBLEM_BAD_EXTENTS, inode, inode, inode, INODE_EXTENT_COUNT_OFFSET);
+        return;
+    }
+
+    int direct = (count < image->directExtents) ? count : image->directExtents;
+    fileExtent extents[MAX_FILE_EXTENTS];
+    memcpy(extents, inodeData + INODE_EXTENTS_OFFSET, direct * EXTENT_SIZE);
+    if (count > direct) {
+        if (indirect <= 0 || indirect >= image->nBlocks || image->type[indirect] != EXTENT_BLOCK_TYPE) {
+            addProblem(image, PROBLEM_BAD_POINTER, indirect, inode, inode, INODE_INDIRECT_OFFSET);
+            return;
+        }
+        if (!claimBlock(image, indirect, inode, inode, INODE_INDIRECT_OFFSET)) {
+            return;
+        }
+        if (readBlockRange(image->disk, indirect, 1, extentData) < 0) {
+            image->failed = 1;
+            return;
+        }
+        memcpy(extents + direct, extentData + EXTENT_BLOCK_DATA_OFFSET, (count - direct) * EXTENT_SIZE);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (extents[i].start <= 0 || extents[i].length <= 0 || extents[i].start > image->nBlocks - extents[i].length) {
+            addProblem(image, PROBLEM_BAD_EXTENTS, inode, inode, inode, INODE_EXTENT_COUNT_OFFSET);
+            return;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < extents[i].length; j++) {
+            claimBlock(image, extents[i].start + j, inode, inode, INODE_EXTENT_COUNT_OFFSET);
+        }
+    }
+}
+
+/* Walk task: claims the data blocks of one file */
+void *walkWorker(void *arg) {
+    FsckImage *image = (FsckImage *)arg;
+    char *inodeData = (char *)malloc(image->blockSize);
+    char *extentData = (char *)malloc(image->blockSize);
+    int task;
+
+    if (inodeData == NULL || extentData == NULL) {
+        image->failed = 1;
+        free(inodeData);
+        free(extentData);
+        return NULL;
+    }
+    while ((task = takeTask(image)) >= 0) {
+        int inode = image->inodes[task];
+        if (readBlockRange(image->disk, inode, 1, inodeData) < 0) {
+            image->failed = 1;
+            break;
+        }
+        if (image->version >= FORMAT_EXTENTS) {
+            claimExtents(image, inode, inodeData, extentData);
+        } else {
+            int first;
+            memcpy(&first, inodeData + INODE_DATA_BLOCK_OFFSET, sizeof(int));
+            claimChain(image, inode, first);
+        }
+    }
+    free(inodeData);
+    free(extentData);
+    return NULL;
+}
+
+/* Walks a list linked through next pointers from head, claiming each
+block for owner and collecting them into list when it is not NULL.
+wantType is the type every block must have, or 0 for any. Returns the
+number of blocks claimed. */
+int walkList(FsckImage *image, int head, int owner, int wantType, int headOffset, int linkOffset, int *list) {
+    int from = 0;
+    int offset = headOffset;
+    int count = 0;
+
+    for (int block = head; block != 0; block = image->next[block]) {
+        if (block < 0 || block >= image->nBlocks || (wantType != 0 && image->type[block] != wantType)) {
+            addProblem(image, PROBLEM_BAD_POINTER, block, owner, from, offset);
+            break;
+        }
+        int blockOwner = (owner == 0) ? block : owner;
+        int current = __atomic_load_n(&image->owner[block], __ATOMIC_RELAXED);
+        if (current != OWNER_NONE) {
+            addProblem(image, (current == blockOwner) ? PROBLEM_CYCLE : PROBLEM_DOUBLE, block, blockOwner, from, offset);
+            break;
+        }
+        image->owner[block] = blockOwner;
+        if (list != NULL) {
+            list[count] = block;
+        }
+        count++;
+        from = block;
+        offset = linkOffset;
+    }
+    return count;
+}
+
+int isBlockFree(FsckImage *image, int block) {
+    return (image->bitmap[block / 8] >> (block % 8)) & 1;
+}
+
+/* Finds blocks that nothing owns and, on bitmap images, blocks that are
+both owned and marked free */
+void checkFreeSpace(FsckImage *image) {
+    for (int block = 0; block < image->nBlocks; block++) {
+        int owned = (image->owner[block] != OWNER_NONE);
+        int markedFree = (image->bitmap != NULL) ? isBlockFree(image, block) : 0;
+        if (markedFree && owned) {
+            addProblem(image, PROBLEM_FREE_IN_USE, block, image->owner[block], 0, 0);
+        } else if (!markedFree && !owned) {
+            addProblem(image, PROBLEM_LEAK, block, OWNER_NONE, 0, 0);
+        }
+    }
+}
+
+/* Sets the pointer at linkOffset of block from (or of the super block when
+from is 0) to 0, ending a list or chain there */
+int cutLink(FsckImage *image, int from, int linkOffset) {
+    if (from == 0) {
+        memset(image->superData + linkOffset, 0, sizeof(int));
+        return 1;
+    }
+    char *data = (char *)malloc(image->blockSize);
+    int success = (data != NULL && readBlockRange(image->disk, from, 1, data) == 0);
+    if (success) {
+        memset(data + linkOffset, 0, sizeof(int));
+        success = (writeBlockRange(image->disk, from, 1, data) == 0);
+    }
+    free(data);
+    return success;
+}
+
+/* Whether the pointer that led to a problem links a list or chain, as
+opposed to an extent list, so that cutting it only shortens the list */
+int isChainLink(Problem *problem) {
+    return problem->linkOffset != INODE_EXTENT_COUNT_OFFSET && problem->linkOffset != INODE_INDIRECT_OFFSET;
+}
+
+/* Fixes what can be fixed without guessing: leaked blocks become free,
+free blocks in use are marked used, and a cycle or bad pointer ends its
+chain at the block before it. Blocks two files share and bad extent lists
+are left alone. Returns the number of problems fixed, or -1. */
+int repairImage(FsckImage *image) {
+    int fixed = 0;
+    char *freeData = (char *)calloc(1, image->blockSize);
+    if (freeData == NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < image->nProblems; i++) {
+        Problem *problem = &image->problems[i];
+        int done = 0;
+        if (problem->kind == PROBLEM_LEAK && image->bitmap != NULL) {
+            image->bitmap[problem->block / 8] |= (unsigned char)(1 << (problem->block % 8));
+            done = 1;
+        } else if (problem->kind == PROBLEM_LEAK) {
+            // Free-list images get the block pushed onto the list head
+            freeData[BLOCK_NUMBER_OFFSET] = FREE_BLOCK_TYPE;
+            freeData[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+            memcpy(freeData + FREE_NEXT_BLOCK_OFFSET, &image->freeHead, sizeof(int));
+            if (writeBlockRange(image->disk, problem->block, 1, freeData) < 0) {
+                free(freeData);
+                return -1;
+            }
+            image->freeHead = problem->block;
+            memcpy(image->superData + FB_OFFSET, &image->freeHead, sizeof(int));
+            done = 1;
+        } else if (problem->kind == PROBLEM_FREE_IN_USE) {
+            image->bitmap[problem->block / 8] &= (unsigned char)~(1 << (problem->block % 8));
+            done = 1;
+        } else if ((problem->kind == PROBLEM_CYCLE || problem->kind == PROBLEM_BAD_POINTER) && isChainLink(problem)) {
+            if (!cutLink(image, problem->from, problem->linkOffset)) {
+                free(freeData);
+                return -1;
+            }
+            done = 1;
+        }
+        fixed += done;
+    }
+    free(freeData);
+
+    // The bitmap region is rewritten as a whole from the repaired map
+    if (image->bitmap != NULL) {
+        int bytes = BITMAP_BYTES_PER_BLOCK(image->blockSize);
+        char *data = (char *)calloc(image->bitmapBlocks, image->blockSize);
+        if (data == NULL) {
+            return -1;
+        }
+        for (int i = 0; i < image->bitmapBlocks; i++) {
+            char *block = data + (size_t)i * image->blockSize;
+            block[BLOCK_NUMBER_OFFSET] = BITMAP_BLOCK_TYPE;
+            block[MAGIC_NUMBER_OFFSET] = MAGIC_NUMBER;
+            memcpy(block + BITMAP_DATA_OFFSET, image->bitmap + (size_t)i * bytes, bytes);
+        }
+        int success = writeBlockRange(image->disk, image->bitmapStart, image->bitmapBlocks, data);
+        free(data);
+        if (success < 0) {
+            return -1;
+        }
+    }
+    return fixed;
+}
+
+/* Reads the super block and sizes the per-block maps */
+int loadImage(FsckImage *image, char *filename) {
+    image->disk = openDisk(filename, 0);
+    if (image->disk < 0) {
+        return -1;
+    }
+    setDiskCacheSize(image->disk, 0);
+
+    // The super block fields all lie in its first BLOCKSIZE bytes
+    char superData[BLOCKSIZE];
+    if (readBlock(image->disk, SUPER_BLOCK, superData) < 0 ||
+        superData[BLOCK_NUMBER_OFFSET] != SUPER_BLOCK_TYPE || superData[MAGIC_NUMBER_OFFSET] != MAGIC_NUMBER) {
+        printf("%s: no TinyFS super block\n", filename);
+        return -1;
+    }
+    memcpy(&image->version, superData + SUPER_VERSION_OFFSET, sizeof(int));
+    memcpy(&image->inodeHead, superData + IB_OFFSET, sizeof(int));
+    memcpy(&image->freeHead, superData + FB_OFFSET, sizeof(int));
+    memcpy(&image->bitmapStart, superData + SUPER_BITMAP_START_OFFSET, sizeof(int));
+    memcpy(&image->bitmapBlocks, superData + SUPER_BITMAP_BLOCKS_OFFSET, sizeof(int));
+    image->blockSize = BLOCKSIZE;
+    if (image->version >= FORMAT_BLOCK_SIZE) {
+        memcpy(&image->blockSize, superData + SUPER_BLOCK_SIZE_OFFSET, sizeof(int));
+    }
+    if (image->version < 0 || image->version > FORMAT_VERSION || image->blockSize < MIN_BLOCKSIZE ||
+        image->blockSize > MAX_BLOCKSIZE || (image->blockSize & (image->blockSize - 1)) != 0 ||
+        setDiskBlockSize(image->disk, image->blockSize) < 0) {
+        printf("%s: unsupported format version %d or block size %d\n", filename, image->version, image->blockSize);
+        return -1;
+    }
+    image->nBlocks = getDiskBlockCount(image->disk);
+    image->directExtents = INODE_DIRECT_EXTENTS(image->blockSize);
+    image->maxExtents = image->directExtents + INDIRECT_EXTENTS(image->blockSize);
+    if (image->maxExtents > MAX_FILE_EXTENTS) {
+        image->maxExtents = MAX_FILE_EXTENTS;
+    }
+    if (image->version >= FORMAT_BITMAP &&
+        (image->bitmapStart != 1 || image->bitmapBlocks <= 0 || image->bitmapStart + image->bitmapBlocks >= image->nBlocks)) {
+        printf("%s: bitmap region does not fit the disk\n", filename);
+        return -1;
+    }
+
+    image->superData = (char *)malloc(image->blockSize);
+    image->type = (unsigned char *)malloc(image->nBlocks);
+    image->next = (int *)malloc((size_t)image->nBlocks * sizeof(int));
+    image->owner = (int *)calloc(image->nBlocks, sizeof(int));
+    image->inodes = (int *)malloc((size_t)image->nBlocks * sizeof(int));
+    if (image->version >= FORMAT_BITMAP) {
+        image->bitmap = (unsigned char *)calloc(image->bitmapBlocks, BITMAP_BYTES_PER_BLOCK(image->blockSize));
+    }
+    if (image->superData == NULL || image->type == NULL || image->next == NULL || image->owner == NULL ||
+        image->inodes == NULL || (image->version >= FORMAT_BITMAP && image->bitmap == NULL)) {
+        printf("Could not allocate memory for %d blocks\n", image->nBlocks);
+        return -1;
+    }
+    return readBlock(image->disk, SUPER_BLOCK, image->superData);
+}
+
+int compareProblems(const void *a, const void *b) {
+    const Problem *left = (const Problem *)a;
+    const Problem *right = (const Problem *)b;
+    if (left->block != right->block) {
+        return (left->block < right->block) ? -1 : 1;
+    }
+    return (int)left->kind - (int)right->kind;
+}
+
+void printProblem(Problem *problem) {
+    switch (problem->kind) {
+    case PROBLEM_LEAK:
+        printf("block %d: in use but owned by nothing\n", problem->block);
+        break;
+    case PROBLEM_FREE_IN_USE:
+        printf("block %d: marked free but owned by inode %d\n", problem->block, problem->owner);
+        break;
+    case PROBLEM_DOUBLE:
+        printf("block %d: claimed again by %s %d\n", problem->block, problem->owner == OWNER_FREE ? "the free list at" : "inode", problem->owner == OWNER_FREE ? problem->from : problem->owner);
+        break;
+    case PROBLEM_CYCLE:
+        printf("block %d: closes a cycle from block %d\n", problem->block, problem->from);
+        break;
+    case PROBLEM_BAD_POINTER:
+        printf("block %d: bad pointer from block %d\n", problem->block, problem->from);
+        break;
+    default:
+        printf("block %d: bad extent list\n", problem->block);
+        break;
+    }
+}
+
+void usage(char *program) {
+    printf("usage: %s [-r] [-j threads] image\n", program);
+    printf("  -r          repair what can be repaired\n");
+    printf("  -j threads  worker threads (default: one per CPU)\n");
+}
+
+int main(int argc, char *argv[]) {
+    int repair = 0;
+    int nThreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "rj:")) != -1) {
+        if (opt == 'r') {
+            repair = 1;
+        } else if (opt == 'j') {
+            nThreads = atoi(optarg);
+        } else {
+            usage(argv[0]);
+            return FSCK_FAILED;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return FSCK_FAILED;
+    }
+    if (nThreads < 1) {
+        nThreads = 1;
+    }
+    if (nThreads > FSCK_MAX_THREADS) {
+        nThreads = FSCK_MAX_THREADS;
+    }
+
+    char *filename = argv[optind];
+    FsckImage image;
+    memset(&image, 0, sizeof(image));
+    pthread_mutex_init(&image.problemLock, NULL);
+    double start = nowSeconds();
+    if (loadImage(&image, filename) < 0) {
+        printf("%s: could not open image\n", filename);
+        return FSCK_FAILED;
+    }
+
+    // Pass 1: every block's type and next pointer, in large sequential reads
+    int runBlocks = FSCK_READ_BYTES / image.blockSize;
+    if (runPool(&image, nThreads, (image.nBlocks + runBlocks - 1) / runBlocks, scanWorker) < 0) {
+        printf("%s: could not read image\n", filename);
+        return FSCK_FAILED;
+    }
+
+    // Pass 2: the super block, the bitmap, the inode list and on free-list
+    // images the free list, which are single lists walked in order
+    image.owner[SUPER_BLOCK] = OWNER_SYSTEM;
+    for (int i = 0; image.bitmap != NULL && i < image.bitmapBlocks; i++) {
+        image.owner[image.bitmapStart + i] = OWNER_SYSTEM;
+    }
+    image.nInodes = walkList(&image, image.inodeHead, 0, INODE_BLOCK_TYPE, IB_OFFSET, INODE_NEXT_INODE_OFFSET, image.inodes);
+    if (image.version == FORMAT_FREE_LIST) {
+        walkList(&image, image.freeHead, OWNER_FREE, 0, FB_OFFSET, FREE_NEXT_BLOCK_OFFSET, NULL);
+    }
+
+    // Pass 3: each file's data, one file per task on the worker pool
+    if (runPool(&image, nThreads, image.nInodes, walkWorker) < 0) {
+        printf("%s: could not read inodes\n", filename);
+        return FSCK_FAILED;
+    }
+
+    // The original tfs_mkfs started the free list at block 2, leaving block
+    // 1 as a free block that no list reaches
+    if (image.version == FORMAT_FREE_LIST && image.nBlocks > 1 && image.owner[1] == OWNER_NONE &&
+        image.type[1] == FREE_BLOCK_TYPE) {
+        image.owner[1] = OWNER_SYSTEM;
+    }
+    checkFreeSpace(&image);
+
+    int counts[PROBLEM_KINDS] = {0};
+    qsort(image.problems, image.nProblems, sizeof(Problem), compareProblems);
+    for (int i = 0; i < image.nProblems; i++) {
+        if (i < FSCK_MAX_REPORTED) {
+            printProblem(&image.problems[i]);
+        }
+        counts[image.problems[i].kind]++;
+    }
+    if (image.nProblems > FSCK_MAX_REPORTED) {
+        printf("... %d more\n", image.nProblems - FSCK_MAX_REPORTED);
+    }
+
+    int fixed = 0;
+    if (repair && image.nProblems > 0 && (fixed = repairImage(&image)) < 0) {
+        printf("%s: repair failed\n", filename);
+        return FSCK_FAILED;
+    }
+
+    // A consistent image is marked clean so it mounts without a full check
+    if (repair && fixed == image.nProblems && image.version >= FORMAT_CLEAN_FLAG) {
+        image.superData[SUPER_STATE_OFFSET] = 1;
+    }
+    if (repair && (writeBlockRange(image.disk, SUPER_BLOCK, 1, image.superData) < 0 || closeDisk(image.disk) < 0)) {
+        printf("%s: could not write super block\n", filename);
+        return FSCK_FAILED;
+    }
+
+    printf("%s: %d blocks of %d bytes, %d files, %.3f s\n", filename, image.nBlocks, image.blockSize, image.nInodes, nowSeconds() - start);
+    for (int kind = 0; kind < PROBLEM_KINDS; kind++) {
+        printf("%s%s %d", kind ? ", " : "", problemNames[kind], counts[kind]);
+    }
+    printf("\n");
+    if (image.nProblems == 0) {
+        return FSCK_OK;
+    }
+    if (repair) {
+        printf("%d of %d problems repaired\n", fixed, image.nProblems);
+    }
+    return (fixed == image.nProblems) ? FSCK_CORRECTED : FSCK_UNCORRECTED;
+}